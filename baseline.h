@@ -0,0 +1,262 @@
+/*
+    Performance baselines for bench.c: the measurements of a run, saved to a CSV file
+    and checked against by later runs to flag regressions.
+
+    A baseline is the measurement of one variant on one program and its args, tagged
+    with the machine and build it was measured on:
+
+        cpu         the model name of /proc/cpuinfo
+        compiler    the compiler of bench.c and the harness, and its version
+        flags       the CFLAGS of the build (BUILD_FLAGS, set by the Makefile)
+
+    Measurements are only checked against baselines of the same tag, so that files can
+    hold baselines of several machines and builds (-O2, -O3, profile-guided...) side
+    by side, and saving replaces the baselines of the same tag and key only.
+
+    A measurement regresses if, compared to its baseline:
+
+        - its median time per dispatched instruction is higher by more than the
+          threshold. The threshold is at least the given one, and at least twice the
+          relative standard deviations of both, so that noisy runs are not flagged.
+          If the number of dispatches changed (the loader translates to other
+          instructions), the time per dispatch is no measure of speed and the median
+          time per run is compared instead, as it is for the variants whose dispatches
+          are not counted (left empty);
+        - its IPC is lower by more than the given threshold, where both have one.
+ */
+
+#ifndef BASELINE_H
+#define BASELINE_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "bytecode.h"
+
+#ifndef BUILD_FLAGS
+    #define BUILD_FLAGS "unknown"
+#endif
+
+#ifdef __clang__
+    #define COMPILER_VERSION "clang " __clang_version__
+#elif defined(__GNUC__)
+    #define COMPILER_VERSION "gcc " __VERSION__
+#else
+    #define COMPILER_VERSION "unknown"
+#endif
+
+#define BASELINE_FIELD_SIZE 128
+#define BASELINE_FIELD_COUNT 11
+#define MAX_BASELINE_LINE (BASELINE_FIELD_COUNT * BASELINE_FIELD_SIZE)
+#define DEFAULT_REGRESSION_THRESHOLD 0.05
+
+struct baseline_tag {
+    char cpu[BASELINE_FIELD_SIZE];
+    char compiler[BASELINE_FIELD_SIZE];
+    char flags[BASELINE_FIELD_SIZE];
+};
+
+struct baseline {
+    struct baseline_tag tag;
+    char program[BASELINE_FIELD_SIZE];
+    char variant[BASELINE_FIELD_SIZE];
+    char args[BASELINE_FIELD_SIZE]; // separated by spaces
+    uint64_t dispatches;
+    int runs;
+    double median_ns;
+    double stddev_ns;
+    double ipc; // 0 if not measured
+};
+
+struct baselines {
+    struct baseline *entries;
+    size_t count;
+    size_t capacity;
+};
+
+// Copy 'value' to a field, with the commas and line breaks the CSV cannot hold as spaces.
+static void set_baseline_field(char *field, const char *value)
+{
+    size_t length = strnlen(value, BASELINE_FIELD_SIZE - 1); // truncating longer ones
+    memcpy(field, value, length);
+    field[length] = '\0';
+    for (char *c = field; *c; c++) {
+        if (*c == ',' || *c == '\n' || *c == '\r') *c = ' ';
+    }
+}
+
+// The tag of the running machine and build.
+MAYBE_UNUSED
+static void get_baseline_tag(struct baseline_tag *tag)
+{
+    set_baseline_field(tag->cpu, "unknown");
+    FILE *cpuinfo = fopen("/proc/cpuinfo", "r");
+    char line[MAX_BASELINE_LINE];
+    while (cpuinfo != NULL && fgets(line, sizeof(line), cpuinfo) != NULL) {
+        if (strncmp(line, "model name", 10) != 0) continue;
+        const char *value = strchr(line, ':');
+        if (value == NULL) continue;
+        value += strspn(value + 1, " \t") + 1;
+        set_baseline_field(tag->cpu, value);
+        break;
+    }
+    if (cpuinfo != NULL) fclose(cpuinfo);
+    // Trailing spaces, from the line break.
+    for (size_t length = strlen(tag->cpu); length > 0 && tag->cpu[length - 1] == ' '; length--) {
+        tag->cpu[length - 1] = '\0';
+    }
+    set_baseline_field(tag->compiler, COMPILER_VERSION);
+    set_baseline_field(tag->flags, BUILD_FLAGS);
+}
+
+static bool same_baseline_key(const struct baseline *a, const struct baseline *b)
+{
+    return strcmp(a->tag.cpu, b->tag.cpu) == 0 && strcmp(a->tag.compiler, b->tag.compiler) == 0
+        && strcmp(a->tag.flags, b->tag.flags) == 0 && strcmp(a->program, b->program) == 0
+        && strcmp(a->variant, b->variant) == 0 && strcmp(a->args, b->args) == 0;
+}
+
+MAYBE_UNUSED
+static const struct baseline *find_baseline(const struct baselines *baselines, const struct baseline *key)
+{
+    for (size_t i = 0; i < baselines->count; i++) {
+        if (same_baseline_key(baselines->entries + i, key)) return baselines->entries + i;
+    }
+    return NULL;
+}
+
+// Add 'baseline', replacing the one of the same tag and key if any.
+MAYBE_UNUSED
+static void put_baseline(struct baselines *baselines, const struct baseline *baseline)
+{
+    struct baseline *existing = (struct baseline *) find_baseline(baselines, baseline);
+    if (existing != NULL) {
+        *existing = *baseline;
+        return;
+    }
+    if (baselines->count == baselines->capacity) {
+        baselines->capacity = baselines->capacity ? 2 * baselines->capacity : 64;
+        baselines->entries = realloc(baselines->entries, baselines->capacity * sizeof(struct baseline));
+        if (baselines->entries == NULL) {
+            fprintf(stderr, "ERROR: Out of memory.\n");
+            exit(1);
+        }
+    }
+    baselines->entries[baselines->count++] = *baseline;
+}
+
+MAYBE_UNUSED
+static void free_baselines(struct baselines *baselines)
+{
+    free(baselines->entries);
+    baselines->entries = NULL;
+    baselines->count = 0;
+    baselines->capacity = 0;
+}
+
+static const char baseline_header[] = "cpu,compiler,flags,program,variant,args,dispatches,runs,median_ns,stddev_ns,ipc\n";
+
+/*
+    Read the baselines of 'path' into 'baselines'. A missing file has none if
+    'missing_ok'; otherwise it is an error, as are malformed lines. Errors are
+    reported on stderr.
+ */
+MAYBE_UNUSED
+static bool read_baselines(const char *path, bool missing_ok, struct baselines *baselines)
+{
+    FILE *file = fopen(path, "r");
+    if (file == NULL) {
+        if (missing_ok) return true;
+        fprintf(stderr, "ERROR: Cannot open %s.\n", path);
+        return false;
+    }
+    char line[MAX_BASELINE_LINE];
+    bool ok = fgets(line, sizeof(line), file) != NULL && strcmp(line, baseline_header) == 0;
+    if (!ok) fprintf(stderr, "ERROR: %s is not a baseline file.\n", path);
+    for (size_t number = 2; ok && fgets(line, sizeof(line), file) != NULL; number++) {
+        line[strcspn(line, "\n")] = '\0';
+        char *fields[BASELINE_FIELD_COUNT];
+        char *rest = line;
+        size_t count = 0;
+        while (rest != NULL && count < BASELINE_FIELD_COUNT) {
+            fields[count++] = rest;
+            rest = strchr(rest, ',');
+            if (rest != NULL) *rest++ = '\0';
+        }
+        if (count != BASELINE_FIELD_COUNT || rest != NULL) {
+            fprintf(stderr, "ERROR: %s:%zu: Expected %d fields.\n", path, number, BASELINE_FIELD_COUNT);
+            ok = false;
+            break;
+        }
+        struct baseline baseline;
+        set_baseline_field(baseline.tag.cpu, fields[0]);
+        set_baseline_field(baseline.tag.compiler, fields[1]);
+        set_baseline_field(baseline.tag.flags, fields[2]);
+        set_baseline_field(baseline.program, fields[3]);
+        set_baseline_field(baseline.variant, fields[4]);
+        set_baseline_field(baseline.args, fields[5]);
+        baseline.dispatches = strtoull(fields[6], NULL, 10);
+        baseline.runs = atoi(fields[7]);
+        baseline.median_ns = strtod(fields[8], NULL);
+        baseline.stddev_ns = strtod(fields[9], NULL);
+        baseline.ipc = strtod(fields[10], NULL);
+        put_baseline(baselines, &baseline);
+    }
+    fclose(file);
+    return ok;
+}
+
+// Write all 'baselines' to 'path', returning false on any I/O error.
+MAYBE_UNUSED
+static bool write_baselines(const char *path, const struct baselines *baselines)
+{
+    FILE *file = fopen(path, "w");
+    if (file == NULL) return false;
+    bool ok = fputs(baseline_header, file) >= 0;
+    for (size_t i = 0; ok && i < baselines->count; i++) {
+        const struct baseline *b = baselines->entries + i;
+        ok = fprintf(file, "%s,%s,%s,%s,%s,%s,", b->tag.cpu, b->tag.compiler, b->tag.flags,
+            b->program, b->variant, b->args) > 0;
+        if (b->dispatches > 0) ok = ok && fprintf(file, "%llu", (unsigned long long) b->dispatches) > 0;
+        ok = ok && fprintf(file, ",") > 0;
+        ok = ok && fprintf(file, "%d,%.0f,%.0f,", b->runs, b->median_ns, b->stddev_ns) > 0;
+        ok = ok && (b->ipc > 0 ? fprintf(file, "%.3f\n", b->ipc) : fprintf(file, "\n")) > 0;
+    }
+    return fclose(file) == 0 && ok;
+}
+
+/*
+    Check 'now' against its baseline 'base' as described above, with a given
+    threshold of 'threshold' (relative: 0.05 for 5%), reporting a regression on
+    stderr. Returns true if it regressed.
+ */
+MAYBE_UNUSED
+static bool check_baseline(const struct baseline *base, const struct baseline *now, double threshold)
+{
+    bool same_dispatches = base->dispatches == now->dispatches && now->dispatches > 0;
+    double base_time = same_dispatches ? base->median_ns / base->dispatches : base->median_ns;
+    double now_time = same_dispatches ? now->median_ns / now->dispatches : now->median_ns;
+    double noise = 2 * (base->stddev_ns / base->median_ns + now->stddev_ns / now->median_ns);
+    double time_threshold = noise > threshold ? noise : threshold;
+    const char *time_name = same_dispatches ? "time per dispatch"
+        : now->dispatches == 0 ? "time per run (dispatches not counted)"
+        : "time per run (dispatches changed)";
+    bool regressed = false;
+    if (now_time > base_time * (1 + time_threshold)) {
+        fprintf(stderr, "REGRESSION: %s %s: median %s %.4f -> %.4f ns (%+.1f%%, threshold %.1f%%)\n",
+            now->variant, now->program, time_name,
+            base_time, now_time, 100 * (now_time / base_time - 1), 100 * time_threshold);
+        regressed = true;
+    }
+    if (base->ipc > 0 && now->ipc > 0 && now->ipc < base->ipc * (1 - threshold)) {
+        fprintf(stderr, "REGRESSION: %s %s: IPC %.3f -> %.3f (%+.1f%%, threshold %.1f%%)\n",
+            now->variant, now->program, base->ipc, now->ipc, 100 * (now->ipc / base->ipc - 1), 100 * threshold);
+        regressed = true;
+    }
+    return regressed;
+}
+
+#endif
@@ -0,0 +1,222 @@
+/*
+    Runs a stream of evaluations on one warm interpreter, for drivers that would
+    otherwise start a process per evaluation.
+
+        batch [-v variant] [-b batch_size] < records
+
+    Reads records from stdin, one per line, each the command line of an engine:
+    <n> to run fib on it, or the name of a program of programs.h followed by either
+    all or none of its args. Blank lines and lines starting with # are skipped.
+    Every record runs in the same process, on the same variant of variants.h
+    (threadedlink by default), which keeps the program it ran last loaded: a stream
+    switching programs reloads on every switch.
+
+    Writes the result of each record on stdout, one line per record, or ERROR with
+    its line number for records that are not valid, or longer than MAX_LINE - 1
+    characters. Results are written out every
+    'batch_size' records (1000 by default) and at the end, in single writes.
+
+    At the end, writes the sustained throughput (evaluations per second of wall clock
+    time, reading and writing included) and percentiles of the latency of single
+    evaluations (the run alone) to stderr, as CSV.
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "programs.h"
+#include "variants.h"
+
+#define VARIANT(name, ancestor) uint64_t run_##name(uint64_t arg);
+#define ENGINE(name, ancestor) \
+    VARIANT(name, ancestor) \
+    uint64_t run_program_##name(const struct program *program, const uint64_t *args);
+VARIANTS
+#undef ENGINE
+#undef VARIANT
+
+struct variant {
+    const char *name;
+    uint64_t (*run)(uint64_t arg);
+    uint64_t (*run_program)(const struct program *program, const uint64_t *args); // NULL if fib only
+};
+
+static const struct variant variants[] = {
+    #define VARIANT(name, ancestor) { #name, run_##name, NULL },
+    #define ENGINE(name, ancestor) { #name, run_##name, run_program_##name },
+    VARIANTS
+    #undef ENGINE
+    #undef VARIANT
+};
+
+#define VARIANT_COUNT (sizeof(variants) / sizeof(*variants))
+
+#define MAX_LINE 1024
+#define MAX_FIELDS (2 + MAX_BENCHMARK_ARGS) // argv[0], the program, its args
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000u + ts.tv_nsec;
+}
+
+static void *checked_realloc(void *memory, size_t size)
+{
+    void *result = realloc(memory, size);
+    if (result == NULL) {
+        fprintf(stderr, "ERROR: Out of memory.\n");
+        exit(1);
+    }
+    return result;
+}
+
+// Results not written out yet.
+struct output {
+    char *text;
+    size_t size;
+    size_t capacity;
+    size_t records;
+};
+
+static void output_line(struct output *output, const char *format, unsigned long long value)
+{
+    if (output->capacity - output->size < 32) {
+        output->capacity = 2 * output->capacity + 4096;
+        output->text = checked_realloc(output->text, output->capacity);
+    }
+    output->size += snprintf(output->text + output->size, output->capacity - output->size, format, value);
+    output->records++;
+}
+
+static void flush_output(struct output *output)
+{
+    if (fwrite(output->text, 1, output->size, stdout) != output->size || fflush(stdout) != 0) {
+        fprintf(stderr, "ERROR: Cannot write the results.\n");
+        exit(1);
+    }
+    output->size = 0;
+    output->records = 0;
+}
+
+// Split 'line' into the fields of a command line, after a dummy argv[0]; -1 if too many.
+static int split_fields(char *line, const char *fields[MAX_FIELDS])
+{
+    int count = 0;
+    fields[count++] = "batch";
+    for (char *field = strtok(line, " \t\r\n"); field != NULL; field = strtok(NULL, " \t\r\n")) {
+        if (count == MAX_FIELDS) return -1;
+        fields[count++] = field;
+    }
+    return count;
+}
+
+static int compare_latencies(const void *a, const void *b)
+{
+    uint64_t lhs = *(const uint64_t *) a;
+    uint64_t rhs = *(const uint64_t *) b;
+    return lhs < rhs ? -1 : lhs > rhs;
+}
+
+// The nearest-rank percentile of 'count' sorted latencies.
+static uint64_t percentile(const uint64_t *sorted, size_t count, double p)
+{
+    double exact = p / 100 * count;
+    size_t rank = (size_t) exact;
+    if (rank < exact) rank++;
+    return sorted[rank == 0 ? 0 : rank - 1];
+}
+
+static void usage(void)
+{
+    fprintf(stderr, "Usage: batch [-v variant] [-b batch_size] < records\n");
+    exit(1);
+}
+
+int main(int argc, const char *argv[])
+{
+    const char *name = "threadedlink";
+    long batch_size = 1000;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-v") == 0 && i + 1 < argc) {
+            name = argv[++i];
+        } else if (strcmp(argv[i], "-b") == 0 && i + 1 < argc) {
+            batch_size = atol(argv[++i]);
+        } else {
+            usage();
+        }
+    }
+    if (batch_size < 1) usage();
+    const struct variant *variant = NULL;
+    for (size_t i = 0; i < VARIANT_COUNT; i++) {
+        if (strcmp(variants[i].name, name) == 0) variant = variants + i;
+    }
+    if (variant == NULL) {
+        fprintf(stderr, "ERROR: Unknown variant %s.\n", name);
+        return 1;
+    }
+
+    struct output output = { NULL, 0, 0, 0 };
+    uint64_t *latencies = NULL;
+    size_t count = 0;
+    size_t capacity = 0;
+    size_t errors = 0;
+    size_t line_number = 0;
+    char line[MAX_LINE];
+    uint64_t start = now_ns();
+    while (fgets(line, sizeof(line), stdin) != NULL) {
+        line_number++;
+        // The rest of a record too long for the buffer is not a record of its own.
+        bool too_long = false;
+        if (strchr(line, '\n') == NULL) {
+            int c = getchar();
+            too_long = c != '\n' && c != EOF;
+            while (c != '\n' && c != EOF) c = getchar();
+        }
+        const char *fields[MAX_FIELDS];
+        int field_count = split_fields(line, fields);
+        if (field_count == 1 || (field_count > 1 && fields[1][0] == '#')) continue;
+
+        const struct program *program;
+        uint64_t args[MAX_BENCHMARK_ARGS];
+        if (too_long || field_count < 0 || !parse_program_args(field_count, fields, &program, args)
+            || (program != &fib_program && variant->run_program == NULL))
+        {
+            output_line(&output, "ERROR %llu\n", (unsigned long long) line_number);
+            errors++;
+        } else {
+            uint64_t before = now_ns();
+            uint64_t result = variant->run_program != NULL ? variant->run_program(program, args) : variant->run(args[0]);
+            uint64_t latency = now_ns() - before;
+            if (count == capacity) {
+                capacity = 2 * capacity + 1024;
+                latencies = checked_realloc(latencies, capacity * sizeof(uint64_t));
+            }
+            latencies[count++] = latency;
+            output_line(&output, "%llu\n", (unsigned long long) result);
+        }
+        if (output.records == (size_t) batch_size) flush_output(&output);
+    }
+    flush_output(&output);
+    uint64_t wall_ns = now_ns() - start;
+
+    fprintf(stderr, "variant,evaluations,errors,wall_ns,evals_per_second,p50_ns,p90_ns,p99_ns,p999_ns,max_ns\n");
+    fprintf(stderr, "%s,%zu,%zu,%llu,%.1f", variant->name, count, errors, (unsigned long long) wall_ns,
+        wall_ns > 0 ? count * 1e9 / wall_ns : 0);
+    if (count > 0) {
+        qsort(latencies, count, sizeof(uint64_t), compare_latencies);
+        fprintf(stderr, ",%llu,%llu,%llu,%llu,%llu\n",
+            (unsigned long long) percentile(latencies, count, 50), (unsigned long long) percentile(latencies, count, 90),
+            (unsigned long long) percentile(latencies, count, 99), (unsigned long long) percentile(latencies, count, 99.9),
+            (unsigned long long) latencies[count - 1]);
+    } else {
+        fprintf(stderr, ",,,,,\n");
+    }
+    free(latencies);
+    free(output.text);
+    return errors > 0;
+}
@@ -0,0 +1,547 @@
+/*
+    Benchmark harness running every interpreter variant of variants.h in one process.
+
+        bench [-r runs] [-w warmups] [-f csv|json] [-v variant,...] [-p program,...|all] [-n]
+              [-c baselines] [-s baselines] [-t threshold%] [args...]
+
+    For each program (fib by default) and variant, runs the program once in the
+    dispatch-counting build of the variant to get the number of instructions it
+    dispatches, then 'warmups' untimed and 'runs' timed times in the regular build,
+    measured with the monotonic clock. Without args, each program runs on its default
+    args from programs.h and its result is checked against the expected one. Programs
+    other than fib only run on the engines marked ENGINE in variants.h. The dispatches
+    of the UNCOUNTED_VARIANTS of variants.h are not counted, and their figures per
+    dispatch are left empty (CSV) or null (JSON).
+
+    Reports, per program and variant, the min/median/stddev of the run time in nanoseconds, the same
+    per dispatched instruction, and the median speedup relative to the variant it is
+    derived from on the same program, as listed in README.md. Output is CSV (the default) or JSON on stdout.
+
+    Where the kernel and CPU allow it (see perf.h), the timed runs are also measured with
+    hardware counters: instructions, cycles, branch misses and L1i misses, reported as
+    averages per run and per dispatched instruction, along with IPC. Counters that are
+    not available are left empty (CSV) or null (JSON). -n turns them off.
+
+    -c checks the measurements against the baselines saved in a file for this CPU,
+    compiler and CFLAGS (baseline.h), reporting those whose time per dispatch or IPC
+    regressed by more than the threshold (5% by default, more for noisy runs) on
+    stderr; the exit status is 2 if any did. -s saves them as the baselines, replacing
+    those of the same CPU, compiler, CFLAGS, variant, program and args in the file.
+ */
+
+#include <math.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "baseline.h"
+#include "perf.h"
+#include "programs.h"
+#include "variants.h"
+
+#define VARIANT(name, ancestor) \
+    uint64_t run_##name(uint64_t arg); \
+    uint64_t counted_run_##name(uint64_t arg); \
+    extern uint64_t dispatch_count_##name;
+#define ENGINE(name, ancestor) \
+    VARIANT(name, ancestor) \
+    uint64_t run_program_##name(const struct program *program, const uint64_t *args); \
+    uint64_t counted_run_program_##name(const struct program *program, const uint64_t *args);
+VARIANTS
+#undef ENGINE
+#undef VARIANT
+
+struct variant {
+    const char *name;
+    const char *ancestor;
+    uint64_t (*run)(uint64_t arg);
+    uint64_t (*counted_run)(uint64_t arg);
+    uint64_t *dispatch_count;
+    uint64_t (*run_program)(const struct program *program, const uint64_t *args); // NULL if fib only
+    uint64_t (*counted_run_program)(const struct program *program, const uint64_t *args);
+};
+
+static const struct variant variants[] = {
+    #define VARIANT(name, ancestor) \
+        { #name, ancestor, run_##name, counted_run_##name, &dispatch_count_##name, NULL, NULL },
+    #define ENGINE(name, ancestor) \
+        { #name, ancestor, run_##name, counted_run_##name, &dispatch_count_##name, \
+            run_program_##name, counted_run_program_##name },
+    VARIANTS
+    #undef ENGINE
+    #undef VARIANT
+};
+
+#define VARIANT_COUNT (sizeof(variants) / sizeof(*variants))
+
+static const char *const uncounted_variants[] = { UNCOUNTED_VARIANTS };
+
+// Whether the dispatch count of the variant measures the work it does.
+static bool counts_dispatches(const struct variant *variant)
+{
+    for (size_t i = 0; i < sizeof(uncounted_variants) / sizeof(*uncounted_variants); i++) {
+        if (strcmp(uncounted_variants[i], variant->name) == 0) return false;
+    }
+    return true;
+}
+
+struct measurement {
+    const struct variant *variant;
+    const struct program *program;
+    const uint64_t *args;
+    uint64_t result;
+    uint64_t dispatches; // 0 if not counted
+    double min_ns;
+    double median_ns;
+    double stddev_ns;
+    struct counter_values counters; // totals over the timed runs
+};
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000u + ts.tv_nsec;
+}
+
+static int compare_doubles(const void *a, const void *b)
+{
+    double lhs = *(const double *) a;
+    double rhs = *(const double *) b;
+    return lhs < rhs ? -1 : lhs > rhs ? 1 : 0;
+}
+
+// Run the program on the variant, through run() for fib so that every variant can run it.
+static uint64_t run_variant(
+    const struct variant *variant,
+    bool counted,
+    const struct program *program,
+    const uint64_t *args)
+{
+    if (program == &fib_program) {
+        return counted ? variant->counted_run(args[0]) : variant->run(args[0]);
+    }
+    return counted ? variant->counted_run_program(program, args) : variant->run_program(program, args);
+}
+
+static void measure(
+    const struct variant *variant,
+    const struct program *program,
+    const uint64_t *args,
+    int runs,
+    int warmups,
+    struct counters *counters,
+    struct measurement *m)
+{
+    double *times = malloc(runs * sizeof(double));
+    if (times == NULL) {
+        fprintf(stderr, "ERROR: Out of memory.\n");
+        exit(1);
+    }
+
+    *variant->dispatch_count = 0;
+    m->variant = variant;
+    m->program = program;
+    m->args = args;
+    m->result = run_variant(variant, true, program, args);
+    m->dispatches = counts_dispatches(variant) ? *variant->dispatch_count : 0;
+
+    for (int i = 0; i < warmups; i++) {
+        run_variant(variant, false, program, args);
+    }
+    double sum = 0;
+    reset_counters(counters);
+    for (int i = 0; i < runs; i++) {
+        start_counters(counters);
+        uint64_t start = now_ns();
+        uint64_t result = run_variant(variant, false, program, args);
+        uint64_t end = now_ns();
+        stop_counters(counters);
+        if (result != m->result) {
+            fprintf(stderr, "ERROR: %s returned %llu and %llu for the same %s args.\n",
+                variant->name, (unsigned long long) m->result, (unsigned long long) result,
+                program->name);
+            exit(1);
+        }
+        times[i] = end - start;
+        sum += times[i];
+    }
+
+    double mean = sum / runs;
+    double squares = 0;
+    for (int i = 0; i < runs; i++) {
+        squares += (times[i] - mean) * (times[i] - mean);
+    }
+    read_counters(counters, &m->counters);
+    qsort(times, runs, sizeof(double), compare_doubles);
+    m->min_ns = times[0];
+    m->median_ns = runs % 2 ? times[runs / 2] : (times[runs / 2 - 1] + times[runs / 2]) / 2;
+    m->stddev_ns = runs > 1 ? sqrt(squares / (runs - 1)) : 0;
+    free(times);
+}
+
+static const struct measurement *find_measurement(
+    const struct measurement *ms,
+    size_t count,
+    const struct program *program,
+    const char *name)
+{
+    for (size_t i = 0; name != NULL && i < count; i++) {
+        if (ms[i].program == program && strcmp(ms[i].variant->name, name) == 0) return ms + i;
+    }
+    return NULL;
+}
+
+// Median time of the ancestor divided by that of the variant, or 0 if the ancestor did not run the program.
+static double speedup(const struct measurement *ms, size_t count, const struct measurement *m)
+{
+    const struct measurement *ancestor = find_measurement(ms, count, m->program, m->variant->ancestor);
+    return ancestor ? ancestor->median_ns / m->median_ns : 0;
+}
+
+// Print 'value' per dispatch of the measurement in 'format', or 'none' if its dispatches were not counted.
+static void print_per_dispatch(double value, const struct measurement *m, const char *format, const char *none)
+{
+    if (m->dispatches > 0) {
+        printf(format, value / m->dispatches);
+    } else {
+        printf("%s", none);
+    }
+}
+
+// Print the counter averages per run and per dispatch, then IPC, as CSV fields or JSON members.
+static void print_counters(const struct measurement *m, int runs, bool json)
+{
+    const struct counter_values *c = &m->counters;
+    for (int i = 0; i < COUNTER_COUNT; i++) {
+        double per_run = (double) c->values[i] / runs;
+        if (json) {
+            if (c->available[i]) {
+                printf(", \"%s\": %.0f, \"%s_per_dispatch\": ", counter_names[i], per_run, counter_names[i]);
+                print_per_dispatch(per_run, m, "%.4f", "null");
+            } else {
+                printf(", \"%s\": null, \"%s_per_dispatch\": null", counter_names[i], counter_names[i]);
+            }
+        } else if (c->available[i]) {
+            printf(",%.0f,", per_run);
+            print_per_dispatch(per_run, m, "%.4f", "");
+        } else {
+            printf(",,");
+        }
+    }
+    bool have_ipc = c->available[COUNTER_INSTRUCTIONS] && c->available[COUNTER_CYCLES]
+        && c->values[COUNTER_CYCLES] > 0;
+    double ipc = have_ipc ? (double) c->values[COUNTER_INSTRUCTIONS] / c->values[COUNTER_CYCLES] : 0;
+    if (json) {
+        if (have_ipc) {
+            printf(", \"ipc\": %.3f", ipc);
+        } else {
+            printf(", \"ipc\": null");
+        }
+    } else if (have_ipc) {
+        printf(",%.3f", ipc);
+    } else {
+        printf(",");
+    }
+}
+
+// Print the args separated by 'separator'.
+static void print_args(const struct measurement *m, const char *separator)
+{
+    for (size_t i = 0; i < m->program->functions[0].arity; i++) {
+        printf("%s%llu", i > 0 ? separator : "", (unsigned long long) m->args[i]);
+    }
+}
+
+static void print_csv(const struct measurement *ms, size_t count, int runs)
+{
+    printf("program,variant,ancestor,args,result,runs,dispatches,min_ns,median_ns,stddev_ns,"
+        "min_ns_per_dispatch,median_ns_per_dispatch,stddev_ns_per_dispatch,speedup_vs_ancestor");
+    for (int i = 0; i < COUNTER_COUNT; i++) {
+        printf(",%s,%s_per_dispatch", counter_names[i], counter_names[i]);
+    }
+    printf(",ipc\n");
+    for (size_t i = 0; i < count; i++) {
+        const struct measurement *m = ms + i;
+        printf("%s,%s,%s,", m->program->name, m->variant->name, m->variant->ancestor ? m->variant->ancestor : "");
+        print_args(m, " ");
+        printf(",%llu,%d,", (unsigned long long) m->result, runs);
+        if (m->dispatches > 0) printf("%llu", (unsigned long long) m->dispatches);
+        printf(",%.0f,%.0f,%.0f,", m->min_ns, m->median_ns, m->stddev_ns);
+        print_per_dispatch(m->min_ns, m, "%.4f,", ",");
+        print_per_dispatch(m->median_ns, m, "%.4f,", ",");
+        print_per_dispatch(m->stddev_ns, m, "%.4f,", ",");
+        double s = speedup(ms, count, m);
+        if (s > 0) printf("%.3f", s);
+        print_counters(m, runs, false);
+        printf("\n");
+    }
+}
+
+static void print_json(const struct measurement *ms, size_t count, int runs)
+{
+    printf("[\n");
+    for (size_t i = 0; i < count; i++) {
+        const struct measurement *m = ms + i;
+        printf("  {\"program\": \"%s\", \"variant\": \"%s\", ", m->program->name, m->variant->name);
+        if (m->variant->ancestor) {
+            printf("\"ancestor\": \"%s\", ", m->variant->ancestor);
+        } else {
+            printf("\"ancestor\": null, ");
+        }
+        printf("\"args\": [");
+        print_args(m, ", ");
+        printf("], \"result\": %llu, \"runs\": %d, \"dispatches\": ", (unsigned long long) m->result, runs);
+        if (m->dispatches > 0) {
+            printf("%llu", (unsigned long long) m->dispatches);
+        } else {
+            printf("null");
+        }
+        printf(", \"min_ns\": %.0f, \"median_ns\": %.0f, \"stddev_ns\": %.0f, \"min_ns_per_dispatch\": ",
+            m->min_ns, m->median_ns, m->stddev_ns);
+        print_per_dispatch(m->min_ns, m, "%.4f", "null");
+        printf(", \"median_ns_per_dispatch\": ");
+        print_per_dispatch(m->median_ns, m, "%.4f", "null");
+        printf(", \"stddev_ns_per_dispatch\": ");
+        print_per_dispatch(m->stddev_ns, m, "%.4f", "null");
+        printf(", ");
+        double s = speedup(ms, count, m);
+        if (s > 0) {
+            printf("\"speedup_vs_ancestor\": %.3f", s);
+        } else {
+            printf("\"speedup_vs_ancestor\": null");
+        }
+        print_counters(m, runs, true);
+        printf("}%s\n", i + 1 < count ? "," : "");
+    }
+    printf("]\n");
+}
+
+static void to_baseline(const struct measurement *m, int runs, const struct baseline_tag *tag, struct baseline *b)
+{
+    const struct counter_values *c = &m->counters;
+    b->tag = *tag;
+    set_baseline_field(b->program, m->program->name);
+    set_baseline_field(b->variant, m->variant->name);
+    b->args[0] = '\0';
+    for (size_t i = 0; i < m->program->functions[0].arity; i++) {
+        size_t length = strlen(b->args);
+        snprintf(b->args + length, sizeof(b->args) - length, "%s%llu", i > 0 ? " " : "", (unsigned long long) m->args[i]);
+    }
+    b->dispatches = m->dispatches;
+    b->runs = runs;
+    b->median_ns = m->median_ns;
+    b->stddev_ns = m->stddev_ns;
+    bool have_ipc = c->available[COUNTER_INSTRUCTIONS] && c->available[COUNTER_CYCLES]
+        && c->values[COUNTER_CYCLES] > 0;
+    b->ipc = have_ipc ? (double) c->values[COUNTER_INSTRUCTIONS] / c->values[COUNTER_CYCLES] : 0;
+}
+
+// Whether 'path' can be written, without changing it or leaving it behind if it did not exist.
+static bool can_write(const char *path)
+{
+    FILE *file = fopen(path, "r+");
+    if (file != NULL) return fclose(file) == 0;
+    file = fopen(path, "w");
+    if (file == NULL) return false;
+    fclose(file);
+    remove(path);
+    return true;
+}
+
+/*
+    Check the measurements against the baselines read from 'check_path', and save them
+    with the baselines read from 'save_path' to that file, either path being NULL.
+    The files are read before measuring (see main()), so that a wrong path fails fast.
+    Returns 0, 1 on errors or 2 on regressions, for the exit status.
+ */
+static int update_baselines(
+    const struct measurement *ms,
+    size_t count,
+    int runs,
+    const char *check_path,
+    struct baselines *check_baselines,
+    const char *save_path,
+    struct baselines *save_baselines,
+    double threshold)
+{
+    struct baseline_tag tag;
+    get_baseline_tag(&tag);
+    int status = 0;
+    if (check_path != NULL) {
+        size_t checked = 0;
+        size_t regressed = 0;
+        for (size_t i = 0; i < count; i++) {
+            struct baseline now;
+            to_baseline(ms + i, runs, &tag, &now);
+            const struct baseline *base = find_baseline(check_baselines, &now);
+            if (base == NULL) continue;
+            checked++;
+            regressed += check_baseline(base, &now, threshold);
+        }
+        fprintf(stderr, "%zu of %zu measurements checked against the baselines of %s (%s, %s, %s): %zu regressed.\n",
+            checked, count, check_path, tag.cpu, tag.compiler, tag.flags, regressed);
+        if (regressed > 0) status = 2;
+    }
+    if (save_path != NULL) {
+        for (size_t i = 0; i < count; i++) {
+            struct baseline now;
+            to_baseline(ms + i, runs, &tag, &now);
+            put_baseline(save_baselines, &now);
+        }
+        if (!write_baselines(save_path, save_baselines)) {
+            fprintf(stderr, "ERROR: Cannot write %s.\n", save_path);
+            status = 1;
+        }
+    }
+    return status;
+}
+
+static bool selected(const char *list, const char *name)
+{
+    if (list == NULL) return true;
+    size_t length = strlen(name);
+    for (const char *p = list; *p; ) {
+        size_t item = strcspn(p, ",");
+        if (item == length && strncmp(p, name, length) == 0) return true;
+        p += item;
+        if (*p == ',') p++;
+    }
+    return false;
+}
+
+static void usage(void)
+{
+    fprintf(stderr, "Usage: bench [-r runs] [-w warmups] [-f csv|json] [-v variant,...] [-p program,...|all] [-n] "
+        "[-c baselines] [-s baselines] [-t threshold%%] [args...]\n");
+    exit(1);
+}
+
+int main(int argc, const char *argv[])
+{
+    int runs = 10;
+    int warmups = 2;
+    bool json = false;
+    const char *only = NULL;
+    const char *programs = "fib";
+    bool use_counters = true;
+    const char *check_path = NULL;
+    const char *save_path = NULL;
+    double threshold = DEFAULT_REGRESSION_THRESHOLD;
+    uint64_t custom_args[MAX_BENCHMARK_ARGS];
+    size_t custom_arg_count = 0;
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-r") == 0 && i + 1 < argc) {
+            runs = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "-w") == 0 && i + 1 < argc) {
+            warmups = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "-f") == 0 && i + 1 < argc) {
+            const char *format = argv[++i];
+            if (strcmp(format, "json") == 0) {
+                json = true;
+            } else if (strcmp(format, "csv") != 0) {
+                usage();
+            }
+        } else if (strcmp(argv[i], "-v") == 0 && i + 1 < argc) {
+            only = argv[++i];
+        } else if (strcmp(argv[i], "-p") == 0 && i + 1 < argc) {
+            programs = strcmp(argv[i + 1], "all") == 0 ? NULL : argv[i + 1];
+            i++;
+        } else if (strcmp(argv[i], "-n") == 0) {
+            use_counters = false;
+        } else if (strcmp(argv[i], "-c") == 0 && i + 1 < argc) {
+            check_path = argv[++i];
+        } else if (strcmp(argv[i], "-s") == 0 && i + 1 < argc) {
+            save_path = argv[++i];
+        } else if (strcmp(argv[i], "-t") == 0 && i + 1 < argc) {
+            threshold = atof(argv[++i]) / 100;
+        } else if (argv[i][0] != '-' && custom_arg_count < MAX_BENCHMARK_ARGS) {
+            custom_args[custom_arg_count++] = strtoull(argv[i], NULL, 10);
+        } else {
+            usage();
+        }
+    }
+    if (runs < 1 || warmups < 0 || threshold < 0) usage();
+    for (const char *p = programs; p != NULL && *p; ) {
+        size_t length = strcspn(p, ",");
+        bool known = false;
+        for (size_t b = 0; b < BENCHMARK_COUNT; b++) {
+            const char *name = benchmarks[b].program->name;
+            known |= strlen(name) == length && strncmp(name, p, length) == 0;
+        }
+        if (!known) {
+            fprintf(stderr, "ERROR: Unknown program %.*s.\n", (int) length, p);
+            return 1;
+        }
+        p += length;
+        if (*p == ',') p++;
+    }
+    struct baselines check_baselines = { NULL, 0, 0 };
+    struct baselines save_baselines = { NULL, 0, 0 };
+    if (check_path != NULL && !read_baselines(check_path, false, &check_baselines)) return 1;
+    if (save_path != NULL) {
+        if (!read_baselines(save_path, true, &save_baselines)) return 1;
+        if (!can_write(save_path)) {
+            fprintf(stderr, "ERROR: Cannot write %s.\n", save_path);
+            return 1;
+        }
+    }
+
+    struct counters counters = { { -1, -1, -1, -1 } };
+    if (use_counters && !open_counters(&counters)) {
+        fprintf(stderr, "No hardware performance counters available.\n");
+    }
+
+    struct measurement ms[BENCHMARK_COUNT * VARIANT_COUNT];
+    size_t count = 0;
+    for (size_t b = 0; b < BENCHMARK_COUNT; b++) {
+        const struct benchmark *benchmark = benchmarks + b;
+        const struct program *program = benchmark->program;
+        if (!selected(programs, program->name)) continue;
+        const uint64_t *args = benchmark->args;
+        if (custom_arg_count > 0) {
+            if (custom_arg_count != program->functions[0].arity) {
+                fprintf(stderr, "ERROR: %s takes %zu args.\n", program->name, program->functions[0].arity);
+                return 1;
+            }
+            args = custom_args;
+        }
+        size_t first = count;
+        for (size_t i = 0; i < VARIANT_COUNT; i++) {
+            if (!selected(only, variants[i].name)) continue;
+            if (program != &fib_program && variants[i].run_program == NULL) continue;
+            fprintf(stderr, "%s %s...\n", program->name, variants[i].name);
+            measure(variants + i, program, args, runs, warmups, &counters, ms + count);
+            if (args == benchmark->args && ms[count].result != benchmark->expected) {
+                fprintf(stderr, "ERROR: %s computed %llu for %s, expected %llu.\n",
+                    ms[count].variant->name, (unsigned long long) ms[count].result,
+                    program->name, (unsigned long long) benchmark->expected);
+                return 1;
+            }
+            if (count > first && ms[count].result != ms[first].result) {
+                fprintf(stderr, "ERROR: %s computed %llu for %s, %s computed %llu.\n",
+                    ms[count].variant->name, (unsigned long long) ms[count].result, program->name,
+                    ms[first].variant->name, (unsigned long long) ms[first].result);
+                return 1;
+            }
+            count++;
+        }
+    }
+
+    close_counters(&counters);
+
+    if (json) {
+        print_json(ms, count, runs);
+    } else {
+        print_csv(ms, count, runs);
+    }
+    int status = update_baselines(ms, count, runs, check_path, &check_baselines, save_path, &save_baselines,
+        threshold);
+    free_baselines(&check_baselines);
+    free_baselines(&save_baselines);
+    return status;
+}
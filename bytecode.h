@@ -0,0 +1,147 @@
+/*
+    Portable bytecode: the format an upstream compiler would emit.
+
+    This is the instruction set of wordcode2.c and wordcode4.c: word-sized opcodes,
+    each followed by its operands.
+
+        LIT k           push literals[k]
+        LOAD n          push frame slot n
+        CALL f argc     call functions[f] with the top argc stack values as args
+        PRIM p          apply primitive p to the operands on the stack
+        JT offset       pop; jump by offset if true
+        JMP offset      jump by offset
+        RET             return the top of the stack
+        STORE n         pop into frame slot n
+        YIELD           a suspension point: let other scripts run (the engines with a
+                        scheduler, see scheduler.h; the others leave it out)
+
+    Frame slots are numbered from 0, args first, then locals, so LOAD 0 is always
+    the first arg no matter how a particular engine lays out its frames. Locals are
+    not initialized. Jump offsets are relative to the jump instruction itself, as in
+    the original fib_code comments, and may be negative.
+
+    Primitives pop their operands and push their result, if any:
+
+        lessThan        (lhs rhs -- lhs < rhs)
+        subtract        (lhs rhs -- lhs - rhs)
+        add             (lhs rhs -- lhs + rhs)
+        newArray        (size -- array) a zero-filled array of words
+        at              (array index -- value)
+        atPut           (array index value -- )
+        freeArray       (array -- )
+
+    Nothing in here is executable as is by the direct-threaded engines. loader.h
+    translates it into their format.
+ */
+
+#ifndef BYTECODE_H
+#define BYTECODE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define MAYBE_UNUSED __attribute__((__unused__))
+
+typedef uint64_t word_t;
+
+enum opcode {
+    LIT,    // 0
+    LOAD,   // 1
+    CALL,   // 2
+    PRIM,   // 3
+    JT,     // 4
+    JMP,    // 5
+    RET,    // 6
+    STORE,  // 7
+    YIELD   // 8
+};
+
+#define OPCODE_COUNT (YIELD + 1)
+
+enum primitive {
+    PRIM_LESS_THAN,     // 0
+    PRIM_SUBTRACT,      // 1
+    PRIM_ADD,           // 2
+    PRIM_NEW_ARRAY,     // 3
+    PRIM_AT,            // 4
+    PRIM_AT_PUT,        // 5
+    PRIM_FREE_ARRAY     // 6
+};
+
+#define PRIMITIVE_COUNT (PRIM_FREE_ARRAY + 1)
+
+struct primitive_info {
+    const char *name;
+    size_t operand_count; // popped
+    size_t result_count; // pushed
+    bool pure; // no effects, and the results only depend on the operands
+};
+
+MAYBE_UNUSED
+static const struct primitive_info primitive_infos[PRIMITIVE_COUNT] = {
+    [PRIM_LESS_THAN] = { "lessThan", 2, 1, true },
+    [PRIM_SUBTRACT] = { "subtract", 2, 1, true },
+    [PRIM_ADD] = { "add", 2, 1, true },
+    [PRIM_NEW_ARRAY] = { "newArray", 1, 1, false },
+    [PRIM_AT] = { "at", 2, 1, false },
+    [PRIM_AT_PUT] = { "atPut", 3, 0, false },
+    [PRIM_FREE_ARRAY] = { "freeArray", 1, 0, false }
+};
+
+MAYBE_UNUSED
+static const char *opcode_names[] = {
+    "LIT",
+    "LOAD",
+    "CALL",
+    "PRIM",
+    "JT",
+    "JMP",
+    "RET",
+    "STORE",
+    "YIELD"
+};
+
+MAYBE_UNUSED
+static const char *opcode_name(word_t opcode)
+{
+    return opcode < OPCODE_COUNT ? opcode_names[opcode] : "?";
+}
+
+// The number of words taken by an instruction, including the opcode.
+MAYBE_UNUSED
+static size_t opcode_size(word_t opcode)
+{
+    switch (opcode) {
+        case CALL:
+            return 3;
+        case RET:
+        case YIELD:
+            return 1;
+        default:
+            return 2;
+    }
+}
+
+struct bytecode_function {
+    const char *name;
+    size_t arity;
+    size_t locals; // in addition to the args
+    const word_t *code;
+    size_t code_size;
+    // The result only depends on the args, and calls have no effects: only calls of
+    // pure primitives and functions, which the loader checks. Calls can be memoized.
+    bool pure;
+};
+
+struct program {
+    const char *name;
+    const struct bytecode_function *functions; // functions[0] is the entry point
+    size_t function_count;
+    const word_t *literals;
+    size_t literal_count;
+};
+
+#define COUNT_OF(array) (sizeof(array) / sizeof(*(array)))
+
+#endif
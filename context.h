@@ -0,0 +1,56 @@
+/*
+    Reentrant interpreter instances, for running programs on several threads at once.
+
+    An image is a program loaded into threaded code. It is never written once loaded,
+    so any number of threads can run it at the same time. A context owns everything a
+    run writes: its stack and its copy of the interpreter state. Each thread creates
+    its own context (or takes one no other thread is using) and runs images in it.
+
+    Contexts are allocated on cache line boundaries and padded to a whole number of
+    lines, and their stacks are mapped on pages of their own, so two threads running
+    in different contexts never write to the same cache line.
+
+    A stack grows on demand up to its size, past which the run stops with an error
+    instead of corrupting memory: it is guarded by an inaccessible page, with no
+    bounds checks in the interpreter.
+
+    Implemented by reentrant.c; scaling.c measures how throughput scales with the
+    number of threads.
+ */
+
+#ifndef CONTEXT_H
+#define CONTEXT_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define CACHE_LINE_SIZE 64
+
+// The harness links the dispatch-counting build of reentrant.c as well (see harness.h).
+#ifdef COUNT_DISPATCHES
+    #define load_image counted_load_image
+    #define free_image counted_free_image
+    #define new_context counted_new_context
+    #define free_context counted_free_context
+    #define run_image counted_run_image
+#endif
+
+struct program;
+struct image;
+struct context;
+
+// Load 'program', exiting on errors like load_program() does.
+struct image *load_image(const struct program *program);
+void free_image(struct image *image);
+
+// A context with a stack of at most 'stack_size' words: address space is reserved for
+// all of it, but memory only committed as the stack grows.
+struct context *new_context(size_t stack_size);
+void free_context(struct context *context);
+
+// Run the entry function of 'image' on its arity args in 'context', storing its
+// result in 'result'. Returns false if the stack overflowed.
+bool run_image(struct context *context, const struct image *image, const uint64_t *args, uint64_t *result);
+
+#endif
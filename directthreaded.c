@@ -17,6 +17,8 @@
 #include <string.h>
 #include <time.h>
 
+#include "harness.h"
+
 typedef uint64_t word_t;
 
 struct function {
@@ -113,7 +115,7 @@ static prim_handler_t prim_handlers[] = {
     add
 };
 
-#define GOTO_NEXT goto **(interp->ip)++
+#define GOTO_NEXT do { COUNT_DISPATCH(); goto **(interp->ip)++; } while (0)
 #define WORD(x) ((void*) x)
 
 static word_t execute(struct interpreter *interp) {
@@ -202,15 +204,8 @@ RET:
 #define STACK_SIZE 1024
 static word_t stack[STACK_SIZE];
 
-int main(int argc, const char *argv[])
+uint64_t run(uint64_t arg)
 {
-    if (argc != 2) {
-        fprintf(stderr, "A single numeric argument is required.\n");
-        return 1;
-    }
-    int arg = atoi(argv[1]);
-    printf("directthreaded\n");
-
     struct interpreter interp = {
         .bp = stack,
         .sp = stack,
@@ -220,10 +215,24 @@ int main(int argc, const char *argv[])
     push(0, &interp); // no prev. args
     push(arg, &interp); // call arg
 
+    return execute(&interp);
+}
+
+#ifndef HARNESS
+int main(int argc, const char *argv[])
+{
+    if (argc != 2) {
+        fprintf(stderr, "A single numeric argument is required.\n");
+        return 1;
+    }
+    int arg = atoi(argv[1]);
+    printf("directthreaded\n");
+
     clock_t start = clock();
-	word_t result = execute(&interp);
+	word_t result = run(arg);
 	clock_t end = clock();
 	long ms = (end - start) / (CLOCKS_PER_SEC / 1000);
 
     printf("Done in %ld ms; result = %lld\n", ms, result);
-}
\ No newline at end of file
+}
+#endif
@@ -17,6 +17,8 @@
 #include <string.h>
 #include <time.h>
 
+#include "harness.h"
+
 #define MAYBE_UNUSED __attribute__((__unused__))
 
 typedef uint64_t word_t;
@@ -85,7 +87,7 @@ static prim_handler_t prim_handlers[] = {
     add
 };
 
-#define GOTO_NEXT goto *((void*) *ip++)
+#define GOTO_NEXT do { COUNT_DISPATCH(); goto *((void*) *ip++); } while (0)
 #define PUSH(expr) *sp++ = expr
 #define POP() *--sp
 #define FETCH() *ip++
@@ -217,6 +219,12 @@ RET:
     GOTO_NEXT;
 }
 
+uint64_t run(uint64_t arg)
+{
+    return execute(arg);
+}
+
+#ifndef HARNESS
 int main(int argc, const char *argv[])
 {
     if (argc != 2) {
@@ -232,4 +240,5 @@ int main(int argc, const char *argv[])
 	long ms = (end - start) / (CLOCKS_PER_SEC / 1000);
 
     printf("Done in %ld ms; result = %lld\n", ms, result);
-}
\ No newline at end of file
+}
+#endif
@@ -21,6 +21,8 @@
 #include <stdlib.h>
 #include <time.h>
 
+#include "harness.h"
+
 #define MAYBE_UNUSED __attribute__((__unused__))
 
 // #define TRACE
@@ -91,7 +93,7 @@ static prim_handler_t prim_handlers[] = {
     add
 };
 
-#define GOTO_NEXT goto *((void*) *ip++)
+#define GOTO_NEXT do { COUNT_DISPATCH(); goto *((void*) *ip++); } while (0)
 #define PUSH(expr) *sp++ = expr
 #define POP() *--sp
 #define FETCH() *ip++
@@ -232,6 +234,12 @@ RET:
     GOTO_NEXT;
 }
 
+uint64_t run(uint64_t arg)
+{
+    return execute(arg);
+}
+
+#ifndef HARNESS
 int main(int argc, const char *argv[])
 {
     if (argc != 2) {
@@ -248,4 +256,5 @@ int main(int argc, const char *argv[])
 
     printf("Done in %ld ms\n", ms);
     printf("=> %lld\n", result);
-}
\ No newline at end of file
+}
+#endif
@@ -0,0 +1,370 @@
+/*
+    An engine for the instructions of instructions.h, with the dispatch strategy chosen
+    by defining DISPATCH before including this file, and ENGINE_NAME for its output:
+
+        DISPATCH_SWITCH     code words are instruction numbers, dispatched by a switch
+                            in a loop (wordcode3.c)
+        DISPATCH_TABLE      code words are instruction numbers, indexing a table of
+                            functions called in a loop (wordcode4.c)
+        DISPATCH_HANDLER    code words are the functions to call in a loop
+                            (handlercode2.c)
+        DISPATCH_THREADED   code words are label addresses, jumped to by the end of
+                            each instruction (threaded2.c)
+        DISPATCH_TAILCALL   code words are functions, tail-called by the end of each
+                            instruction (tailcall.c)
+
+    The interpreter registers are locals of execute() for the switch and threaded
+    strategies, function arguments for the tail-call strategy, and fields of a struct
+    vm for the others, whose instruction functions leave the loop by a long jump as in
+    handlercode2.c.
+
+    All strategies load the same threaded code (loader.h), superinstructions included;
+    the table and switch strategies get instruction numbers for labels. Defining
+    QUICKEN as well makes PRIM sites quicken themselves (see instructions.h). Each variant
+    file of this family (xswitch.c...) only selects a strategy, and defines the
+    run(), run_program() and main() of any other variant.
+
+    The threaded strategy has two layout options:
+
+        REPLICAS            2 to 4 copies of each instruction marked REPLICATED_ below
+                            (1, one copy, by default); replicate_instructions()
+                            (loader.h) chooses one for each site
+        HOT_COLD_LAYOUT     the instructions marked COLD_ are moved out of line, after
+                            all others, with GCC's cold label attribute, and the labels
+                            of the others aligned on 16 bytes. Clang gets the default
+                            layout.
+ */
+
+#ifndef DISPATCH_H
+#define DISPATCH_H
+
+#include <setjmp.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "bytecode.h"
+#include "harness.h"
+#include "instructions.h"
+#include "loader.h"
+#include "programs.h"
+
+#define DISPATCH_SWITCH 1
+#define DISPATCH_TABLE 2
+#define DISPATCH_HANDLER 3
+#define DISPATCH_THREADED 4
+#define DISPATCH_TAILCALL 5
+
+#if !defined(DISPATCH) || !defined(ENGINE_NAME)
+    #error "Define DISPATCH and ENGINE_NAME before including dispatch.h"
+#endif
+
+#if defined(__has_attribute)
+    #if __has_attribute(musttail)
+        #define MUSTTAIL __attribute__((musttail))
+    #endif
+#endif
+#ifndef MUSTTAIL
+    #define MUSTTAIL
+#endif
+
+#ifndef REPLICAS
+    #define REPLICAS 1
+#endif
+#if REPLICAS < 1 || REPLICAS > 4 || (REPLICAS > 1 && DISPATCH != DISPATCH_THREADED)
+    #error "REPLICAS is 1 to 4, and more than 1 only for DISPATCH_THREADED"
+#endif
+
+/*
+    Marks of instructions, defined as PROBE. HAS(REPLICATED_, name) is 1 for the marked
+    ones, 0 for the others. From the dispatch counts of the benchmark programs:
+    replicated are those run on every iteration of the loops and calls, most of them
+    followed by different instructions at different sites; cold are those whose sites
+    superinstructions replace, or that only initialize variables.
+ */
+#define REPLICATED_LOAD PROBE
+#define REPLICATED_STORE PROBE
+#define REPLICATED_PRIM PROBE
+#define REPLICATED_JT PROBE
+#define REPLICATED_JMP PROBE
+#define REPLICATED_CONST_1 PROBE
+#define REPLICATED_SUB1 PROBE
+#define REPLICATED_ADD1 PROBE
+#define COLD_LIT PROBE
+#define COLD_CONST_0 PROBE
+
+#define PROBE ~, 1
+#define SECOND(a, b, ...) b
+#define IS_PROBE(...) SECOND(__VA_ARGS__, 0, ~)
+#define CONCAT_(a, b) a##b
+#define CONCAT(a, b) CONCAT_(a, b)
+#define HAS(mark, name) IS_PROBE(CONCAT(mark, name))
+
+#define STACK_SIZE (1 << 16) // deep enough for ack(3, 8)
+static word_t stack[STACK_SIZE];
+
+#define FETCH() *IP++
+#define PUSH(expr) *SP++ = (expr)
+#define POP() *--SP
+#define TOP() (((int64_t *) SP)[-1])
+// The instruction word is the one before the operand just fetched (see instructions.h).
+#define QUICKEN_SITE(instruction) (IP[-2] = (word_t) instruction_labels[instruction])
+
+// Where an engine starts running 'entry'.
+#define SET_UP_ENTRY_FRAME() do { \
+        for (size_t i = 0; i < entry->arity; i++) { \
+            PUSH(args[i]); \
+        } \
+        BP = SP; /* the args notionally are in the callee frame */ \
+        PUSH(0); /* no prev. BP */ \
+        PUSH(0); /* no prev. IP */ \
+        PUSH(0); /* no args */ \
+        SP += entry->frame_size; \
+    } while (0)
+
+#if DISPATCH == DISPATCH_SWITCH || DISPATCH == DISPATCH_THREADED
+
+    #define IP ip
+    #define SP sp
+    #define BP bp
+    #define FUNCTIONS functions
+    #define EXIT(value) return (value)
+
+#elif DISPATCH == DISPATCH_TABLE || DISPATCH == DISPATCH_HANDLER
+
+    struct vm {
+        word_t *ip;
+        word_t *sp;
+        word_t *bp;
+        const struct function *functions;
+        word_t result;
+        jmp_buf exit;
+    };
+
+    #define IP (vm->ip)
+    #define SP (vm->sp)
+    #define BP (vm->bp)
+    #define FUNCTIONS (vm->functions)
+    #define EXIT(value) do { vm->result = (value); longjmp(vm->exit, 1); } while (0)
+
+    typedef void (*handler_t)(struct vm *vm);
+
+    static void *const instruction_labels[INSTRUCTION_COUNT]; // defined below, for QUICKEN_SITE()
+    #define DEFINE_HANDLER(name, ...) static void handle_##name(struct vm *vm) { __VA_ARGS__ }
+    INSTRUCTIONS(DEFINE_HANDLER)
+
+#elif DISPATCH == DISPATCH_TAILCALL
+
+    #define IP ip
+    #define SP sp
+    #define BP bp
+    #define FUNCTIONS functions
+    #define EXIT(value) return (value)
+
+    typedef word_t (*handler_t)(word_t *ip, word_t *sp, word_t *bp, const struct function *functions);
+
+    static void *const instruction_labels[INSTRUCTION_COUNT]; // defined below, for QUICKEN_SITE()
+    #define DEFINE_HANDLER(name, ...) \
+        static word_t handle_##name(word_t *ip, word_t *sp, word_t *bp, const struct function *functions) \
+        { \
+            __VA_ARGS__ \
+            COUNT_DISPATCH(); \
+            MUSTTAIL return ((handler_t) *ip)(ip + 1, sp, bp, functions); \
+        }
+    INSTRUCTIONS(DEFINE_HANDLER)
+
+#else
+    #error "Unknown DISPATCH"
+#endif
+
+// Passed to the loader. The threaded strategy sets it up when execute() is called with no functions.
+#if DISPATCH == DISPATCH_SWITCH || DISPATCH == DISPATCH_TABLE
+    // (void *) LIT is NULL, which the loader only takes for "unsupported" for combo instructions.
+    #define NUMBER_LABEL(name, ...) [name] = (void *) (uintptr_t) name,
+    static void *const instruction_labels[INSTRUCTION_COUNT] = { INSTRUCTIONS(NUMBER_LABEL) };
+#elif DISPATCH == DISPATCH_HANDLER || DISPATCH == DISPATCH_TAILCALL
+    #define HANDLER_LABEL(name, ...) [name] = (void *) handle_##name,
+    static void *const instruction_labels[INSTRUCTION_COUNT] = { INSTRUCTIONS(HANDLER_LABEL) };
+#else
+    static void *const *instruction_labels;
+    static void *const *replica_labels; // REPLICAS per instruction, for replicate_instructions()
+#endif
+
+#if DISPATCH == DISPATCH_THREADED
+    // Copies 1 to REPLICAS - 1 of an instruction, made by X(name, copy, body...).
+    #define COPIES_1(X, name, ...)
+    #define COPIES_2(X, name, ...) X(name, 1, __VA_ARGS__)
+    #define COPIES_3(X, name, ...) COPIES_2(X, name, __VA_ARGS__) X(name, 2, __VA_ARGS__)
+    #define COPIES_4(X, name, ...) COPIES_3(X, name, __VA_ARGS__) X(name, 3, __VA_ARGS__)
+    #define COPIES(X, name, ...) CONCAT(COPIES_, REPLICAS)(X, name, __VA_ARGS__)
+
+    #if defined(HOT_COLD_LAYOUT) && defined(__GNUC__) && !defined(__clang__)
+        #define ALIGN_HOT_LABELS
+        #define LABEL_ATTRIBUTES_0
+        #define LABEL_ATTRIBUTES_1 __attribute__((cold))
+    #else
+        #define LABEL_ATTRIBUTES_0
+        #define LABEL_ATTRIBUTES_1
+    #endif
+    #define LABEL_ATTRIBUTES(name) CONCAT(LABEL_ATTRIBUTES_, HAS(COLD_, name))
+#endif
+
+#if DISPATCH == DISPATCH_TABLE
+    #define TABLE_ENTRY(name, ...) [name] = handle_##name,
+    static const handler_t handlers[INSTRUCTION_COUNT] = { INSTRUCTIONS(TABLE_ENTRY) };
+#endif
+
+#if defined(__GNUC__) && !defined(__clang__) && (REPLICAS > 1 || defined(ALIGN_HOT_LABELS))
+    #define EXECUTE_OPTIONS
+    #pragma GCC push_options
+    #if REPLICAS > 1
+        // Cross-jumping would merge the copies of an instruction back into one.
+        #pragma GCC optimize ("no-crossjumping")
+    #endif
+    #ifdef ALIGN_HOT_LABELS
+        // All labels of execute(), but the cold ones are at its end and the others
+        // follow a dispatch: the padding before them is never run.
+        #pragma GCC optimize ("align-labels=16")
+    #endif
+#endif
+
+static word_t execute(const struct function *functions, const struct function *entry, const word_t *args)
+{
+#if DISPATCH == DISPATCH_SWITCH
+
+    word_t *ip = entry->code;
+    word_t *sp = stack;
+    word_t *bp;
+    SET_UP_ENTRY_FRAME();
+
+    #define CASE(name, ...) case name: { __VA_ARGS__ } break;
+    for (;;) {
+        COUNT_DISPATCH();
+        switch (FETCH()) {
+            INSTRUCTIONS(CASE)
+        }
+    }
+
+#elif DISPATCH == DISPATCH_THREADED
+
+    #define LABEL_ADDRESS(name, ...) [name] = &&name,
+    static void *const labels[INSTRUCTION_COUNT] = { INSTRUCTIONS(LABEL_ADDRESS) };
+    #define COPY_ADDRESS(name, copy, ...) &&name##_COPY##copy,
+    #define REPLICA_ADDRESSES_0(name, ...)
+    #define REPLICA_ADDRESSES_1(name, ...) [name] = { &&name, COPIES(COPY_ADDRESS, name, __VA_ARGS__) },
+    #define REPLICA_ADDRESSES(name, ...) CONCAT(REPLICA_ADDRESSES_, HAS(REPLICATED_, name))(name, __VA_ARGS__)
+    static void *const replicas[INSTRUCTION_COUNT][REPLICAS] = { INSTRUCTIONS(REPLICA_ADDRESSES) };
+    if (functions == NULL) {
+        instruction_labels = labels;
+        replica_labels = &replicas[0][0];
+        return 0;
+    }
+
+    word_t *ip = entry->code;
+    word_t *sp = stack;
+    word_t *bp;
+    SET_UP_ENTRY_FRAME();
+
+    #define GOTO_NEXT do { COUNT_DISPATCH(); goto *((void *) *ip++); } while (0)
+    #define COPY(name, copy, ...) name##_COPY##copy: LABEL_ATTRIBUTES(name) { __VA_ARGS__ } GOTO_NEXT;
+    #define REPLICAS_0(name, ...)
+    #define REPLICAS_1(name, ...) COPIES(COPY, name, __VA_ARGS__)
+    #define LABELED(name, ...) \
+        name: LABEL_ATTRIBUTES(name) { __VA_ARGS__ } GOTO_NEXT; \
+        CONCAT(REPLICAS_, HAS(REPLICATED_, name))(name, __VA_ARGS__)
+    GOTO_NEXT;
+    INSTRUCTIONS(LABELED)
+
+#elif DISPATCH == DISPATCH_TABLE || DISPATCH == DISPATCH_HANDLER
+
+    struct vm state = { .ip = entry->code, .sp = stack, .functions = functions };
+    struct vm *vm = &state;
+    SET_UP_ENTRY_FRAME();
+
+    if (setjmp(vm->exit) == 0) {
+        for (;;) {
+            COUNT_DISPATCH();
+        #if DISPATCH == DISPATCH_TABLE
+            handlers[FETCH()](vm);
+        #else
+            ((handler_t) FETCH())(vm);
+        #endif
+        }
+    }
+    return vm->result;
+
+#else
+
+    word_t *ip = entry->code;
+    word_t *sp = stack;
+    word_t *bp;
+    SET_UP_ENTRY_FRAME();
+
+    COUNT_DISPATCH();
+    return ((handler_t) *ip)(ip + 1, sp, bp, functions);
+
+#endif
+}
+
+#ifdef EXECUTE_OPTIONS
+    #pragma GCC pop_options
+#endif
+
+static struct function *load(const struct program *program)
+{
+#if DISPATCH == DISPATCH_THREADED
+    execute(NULL, NULL, NULL);
+#endif
+    struct function *functions = load_program(program, instruction_labels);
+#if REPLICAS > 1
+    replicate_instructions(functions, program->function_count, instruction_labels, replica_labels, REPLICAS);
+#endif
+    return functions;
+}
+
+// Uses the default superinstructions table. The program is loaded on first use, and
+// reloaded when a different one is run.
+uint64_t run_program(const struct program *program, const uint64_t *args)
+{
+    static const struct program *loaded;
+    static struct function *functions;
+    if (program != loaded) {
+        if (functions != NULL) free_program(functions, loaded->function_count);
+        functions = load(program);
+        loaded = program;
+    }
+    return execute(functions, functions, args);
+}
+
+uint64_t run(uint64_t arg)
+{
+    return run_program(&fib_program, &arg);
+}
+
+#ifndef HARNESS
+int main(int argc, const char *argv[])
+{
+    const struct program *program;
+    word_t args[MAX_BENCHMARK_ARGS];
+    if (!parse_program_args(argc, argv, &program, args)) {
+        fprintf(stderr, "Usage: %s <n> | <program> [args...]\n", argv[0]);
+        return 1;
+    }
+    printf("%s\n", ENGINE_NAME);
+
+    struct function *functions = load(program);
+
+    clock_t start = clock();
+    word_t result = execute(functions, functions, args);
+    clock_t end = clock();
+    long ms = (end - start) / (CLOCKS_PER_SEC / 1000);
+
+    printf("Done in %ld ms\n", ms);
+    printf("=> %lld\n", (long long) result);
+}
+#endif
+
+#endif
@@ -0,0 +1,133 @@
+/*
+    Runs many scripts at once on the green threads of threadedgreen.c (scheduler.h).
+
+        green [-w workers] [-n scripts] [-b budget] [-s stack_size] [ticker <n> | <n> | <program> [args...]]
+
+    Spawns 'scripts' scripts (1000 by default), all running the same image (loaded
+    once) on the same args, on a scheduler of 'workers' workers (the number of online
+    CPUs by default) with turns of 'budget' backward jumps and calls and stacks of
+    'stack_size' words. The default script is the ticker of programs.h on 10000,
+    which yields on every iteration; the benchmark programs are only preempted.
+
+    Reports the wall clock time to run all of them, the scripts per second and the
+    number of turns, by cause, as CSV. Results are checked against the expected ones
+    for default args, and against each other.
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "programs.h"
+#include "scheduler.h"
+
+#define DEFAULT_SCRIPTS 1000
+#define DEFAULT_TICKS 10000
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000u + ts.tv_nsec;
+}
+
+static void usage(void)
+{
+    fprintf(stderr, "Usage: green [-w workers] [-n scripts] [-b budget] [-s stack_size] [ticker <n> | <n> | <program> [args...]]\n");
+    exit(1);
+}
+
+int main(int argc, const char *argv[])
+{
+    long workers = sysconf(_SC_NPROCESSORS_ONLN);
+    long scripts = DEFAULT_SCRIPTS;
+    long budget = DEFAULT_BUDGET;
+    long stack_size = DEFAULT_SCRIPT_STACK_SIZE;
+    int i = 1;
+    for (; i + 1 < argc && argv[i][0] == '-'; i += 2) {
+        if (strcmp(argv[i], "-w") == 0) {
+            workers = atol(argv[i + 1]);
+        } else if (strcmp(argv[i], "-n") == 0) {
+            scripts = atol(argv[i + 1]);
+        } else if (strcmp(argv[i], "-b") == 0) {
+            budget = atol(argv[i + 1]);
+        } else if (strcmp(argv[i], "-s") == 0) {
+            stack_size = atol(argv[i + 1]);
+        } else {
+            usage();
+        }
+    }
+    if (workers < 1 || scripts < 1 || budget < 1 || stack_size < 1) usage();
+
+    const struct program *program = &ticker_program;
+    uint64_t args[MAX_BENCHMARK_ARGS] = { DEFAULT_TICKS };
+    if (i < argc && strcmp(argv[i], "ticker") == 0) {
+        if (argc - i > 2) usage();
+        if (argc - i == 2) args[0] = strtoull(argv[i + 1], NULL, 10);
+    } else if (i < argc) {
+        // parse_program_args() expects argv[0] before the program.
+        if (!parse_program_args(argc - i + 1, argv + i - 1, &program, args)) usage();
+    }
+    bool have_expected = program == &ticker_program;
+    uint64_t expected = args[0] * (args[0] - 1) / 2;
+    for (size_t b = 0; b < BENCHMARK_COUNT; b++) {
+        if (benchmarks[b].program == program
+            && memcmp(benchmarks[b].args, args, program->functions[0].arity * sizeof(uint64_t)) == 0)
+        {
+            have_expected = true;
+            expected = benchmarks[b].expected;
+        }
+    }
+
+    struct green_image *image = load_green_image(program);
+    struct scheduler *scheduler = new_scheduler(workers, budget, stack_size);
+    struct script **spawned = malloc(scripts * sizeof(struct script *));
+    if (spawned == NULL) {
+        fprintf(stderr, "ERROR: Out of memory.\n");
+        return 1;
+    }
+    for (long s = 0; s < scripts; s++) {
+        spawned[s] = spawn_script(scheduler, image, args);
+    }
+
+    uint64_t start = now_ns();
+    run_scheduler(scheduler);
+    uint64_t wall_ns = now_ns() - start;
+
+    bool failed = false;
+    bool have_first = false;
+    uint64_t first = 0;
+    for (long s = 0; s < scripts; s++) {
+        uint64_t result;
+        if (script_result(spawned[s], &result) != SCRIPT_DONE) {
+            fprintf(stderr, "ERROR: Script %ld overflowed its stack.\n", s);
+            failed = true;
+            continue;
+        }
+        if (!have_first) {
+            first = result;
+            have_first = true;
+        }
+        if (result != first || (have_expected && result != expected)) {
+            fprintf(stderr, "ERROR: Script %ld returned %llu.\n", s, (unsigned long long) result);
+            failed = true;
+        }
+    }
+
+    struct scheduler_stats stats;
+    get_scheduler_stats(scheduler, &stats);
+    printf("program,workers,scripts,budget,wall_ns,scripts_per_second,turns,yields,preemptions,steals,ns_per_turn\n");
+    printf("%s,%ld,%ld,%ld,%llu,%.1f,%llu,%llu,%llu,%llu,%.1f\n", program->name, workers, scripts, budget,
+        (unsigned long long) wall_ns, scripts * 1e9 / wall_ns, (unsigned long long) stats.turns,
+        (unsigned long long) stats.yields, (unsigned long long) stats.preemptions, (unsigned long long) stats.steals,
+        (double) wall_ns / stats.turns);
+
+    free(spawned);
+    free_scheduler(scheduler);
+    free_green_image(image);
+    return failed;
+}
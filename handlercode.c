@@ -16,6 +16,8 @@
 #include <string.h>
 #include <time.h>
 
+#include "harness.h"
+
 typedef uint64_t word_t;
 
 struct function {
@@ -168,6 +170,7 @@ typedef void (*instr_handler_t)(struct interpreter *interp);
 static word_t execute(struct interpreter *interp) {
     while (true) {
         instr_handler_t handler = (instr_handler_t) fetch(interp);
+        COUNT_DISPATCH();
         if (handler == execute_ret) return pop(interp);
         handler(interp);
     }
@@ -210,15 +213,8 @@ static struct function functions[] = {
 #define STACK_SIZE 1024
 static word_t stack[STACK_SIZE];
 
-int main(int argc, const char *argv[])
+uint64_t run(uint64_t arg)
 {
-    if (argc != 2) {
-        fprintf(stderr, "A single numeric argument is required.\n");
-        return 1;
-    }
-    int arg = atoi(argv[1]);
-    printf("handlercode\n");
-
     struct interpreter interp = {
         .bp = stack,
         .sp = stack,
@@ -228,10 +224,24 @@ int main(int argc, const char *argv[])
     push(0, &interp); // no prev. IP
     push(arg, &interp); // call arg
 
+    return execute(&interp);
+}
+
+#ifndef HARNESS
+int main(int argc, const char *argv[])
+{
+    if (argc != 2) {
+        fprintf(stderr, "A single numeric argument is required.\n");
+        return 1;
+    }
+    int arg = atoi(argv[1]);
+    printf("handlercode\n");
+
   	clock_t start = clock();
-	word_t result = execute(&interp);
+	word_t result = run(arg);
 	clock_t end = clock();
 	long ms = (end - start) / (CLOCKS_PER_SEC / 1000);
 
     printf("Done in %ld ms; result = %lld\n", ms, result);
-}
\ No newline at end of file
+}
+#endif
@@ -19,6 +19,8 @@
 #include <string.h>
 #include <time.h>
 
+#include "harness.h"
+
 typedef uint64_t word_t;
 
 struct function {
@@ -178,6 +180,7 @@ typedef void (*instr_handler_t)(struct interpreter *interp);
 static void execute(struct interpreter *interp) {
     while (true) {
         instr_handler_t handler = (instr_handler_t) fetch(interp);
+        COUNT_DISPATCH();
         handler(interp);
     }
 }
@@ -219,15 +222,8 @@ static struct function functions[] = {
 #define STACK_SIZE 1024
 static word_t stack[STACK_SIZE];
 
-int main(int argc, const char *argv[])
+uint64_t run(uint64_t arg)
 {
-    if (argc != 2) {
-        fprintf(stderr, "A single numeric argument is required.\n");
-        return 1;
-    }
-    int arg = atoi(argv[1]);
-    printf("handlercode2\n");
-
     struct interpreter interp = {
         .bp = stack,
         .sp = stack,
@@ -238,15 +234,28 @@ int main(int argc, const char *argv[])
     push(0, &interp); // no prev. args
     push(arg, &interp); // call arg
 
-    clock_t start;
-    clock_t end;
     if (!setjmp(interp.return_jump)) {
-      	start = clock();
 	    execute(&interp);
     }
     // returning via a jump
-	end = clock();
+    return interp.result;
+}
+
+#ifndef HARNESS
+int main(int argc, const char *argv[])
+{
+    if (argc != 2) {
+        fprintf(stderr, "A single numeric argument is required.\n");
+        return 1;
+    }
+    int arg = atoi(argv[1]);
+    printf("handlercode2\n");
+
+  	clock_t start = clock();
+	word_t result = run(arg);
+	clock_t end = clock();
 	long ms = (end - start) / (CLOCKS_PER_SEC / 1000);
 
-    printf("Done in %ld ms; result = %lld\n", ms, interp.result);
-}
\ No newline at end of file
+    printf("Done in %ld ms; result = %lld\n", ms, result);
+}
+#endif
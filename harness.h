@@ -0,0 +1,40 @@
+/*
+    Glue between the interpreter variants and the benchmark harness (bench.c).
+
+    Every variant defines
+
+        uint64_t run(uint64_t arg);
+
+    which runs its fib_code on 'arg' from a fresh stack and returns the result. The
+    engines that run portable bytecode through loader.h also define
+
+        uint64_t run_program(const struct program *program, const uint64_t *args);
+
+    which runs any program of programs.h on its entry function's arity args.
+
+    Built with HARNESS, a variant leaves out its main() so that bench.c can link all of
+    them; the Makefile renames each run() to run_<variant>, and run_program() to
+    run_program_<variant>. Built with COUNT_DISPATCHES as well, COUNT_DISPATCH() at the
+    dispatch point of the variant counts instruction dispatches in dispatch_count
+    (renamed to dispatch_count_<variant>). Otherwise it expands to nothing and the
+    dispatch code is the same as without the harness.
+ */
+
+#ifndef HARNESS_H
+#define HARNESS_H
+
+#include <stdint.h>
+
+struct program;
+
+uint64_t run(uint64_t arg);
+uint64_t run_program(const struct program *program, const uint64_t *args);
+
+#ifdef COUNT_DISPATCHES
+    uint64_t dispatch_count;
+    #define COUNT_DISPATCH() (dispatch_count++)
+#else
+    #define COUNT_DISPATCH() ((void) 0)
+#endif
+
+#endif
@@ -0,0 +1,236 @@
+/*
+    An on-disk format for programs in the portable bytecode of bytecode.h, for engines
+    that get their program from a file rather than from the initializers of
+    programs.h. Not to be confused with the images of context.h, which are programs
+    loaded into threaded code.
+
+    An image file is made to be mapped read-only, and shared by all the processes
+    running it: nothing is copied out of it but the function table, and the struct
+    program map_image_file() returns points into the mapping for all the rest. All
+    fields are native words, in this order:
+
+        header          struct image_file_header
+        functions       function_count struct image_file_function
+        literals        literal_count words, the literals[] of the program
+        code            the code of the functions, one after the other
+        strings         NUL-terminated names: the program, then the functions
+
+    Offsets are in bytes from the start of the file, sizes in words. The header has
+    a byte order mark, and a version to be bumped on any change to the layout: an
+    image is only run by engines built for the same version and byte order.
+
+    Mapping checks the header and that every table is within the file. It reads
+    neither the code nor the literals: decode_function() (loader.h) validates the
+    code of each function when translating it, so that, with lazy loading, the code
+    of a function that never runs is never paged in either.
+ */
+
+#ifndef IMAGEFILE_H
+#define IMAGEFILE_H
+
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "bytecode.h"
+
+#define IMAGE_FILE_MAGIC 0x004547414d494342ull // "BCIMAGE" as a little-endian word
+#define IMAGE_FILE_BYTE_ORDER 0x0102030405060708ull
+#define IMAGE_FILE_VERSION 2
+
+struct image_file_header {
+    word_t magic;
+    word_t byte_order;
+    word_t version;
+    word_t name; // offset of the program name
+    word_t function_count;
+    word_t functions; // offset of the function table
+    word_t literal_count;
+    word_t literals;
+    word_t strings;
+    word_t size; // of the file
+};
+
+struct image_file_function {
+    word_t name; // offset
+    word_t arity;
+    word_t locals;
+    word_t code; // offset
+    word_t code_size;
+    word_t pure;
+};
+
+// A mapped image. 'program' can be run as any program of programs.h.
+struct mapped_program {
+    struct program program;
+    struct bytecode_function *functions;
+    void *base;
+    size_t size;
+};
+
+static bool write_words(FILE *file, const void *words, size_t count)
+{
+    return fwrite(words, sizeof(word_t), count, file) == count;
+}
+
+// Write 'program' to 'path', returning false on any I/O error.
+MAYBE_UNUSED
+static bool write_image_file(const struct program *program, const char *path)
+{
+    size_t function_count = program->function_count;
+    size_t functions = sizeof(struct image_file_header);
+    size_t literals = functions + function_count * sizeof(struct image_file_function);
+    size_t code = literals + program->literal_count * sizeof(word_t);
+    size_t strings = code;
+    for (size_t i = 0; i < function_count; i++) {
+        strings += program->functions[i].code_size * sizeof(word_t);
+    }
+    size_t string_size = strlen(program->name) + 1;
+    for (size_t i = 0; i < function_count; i++) {
+        string_size += strlen(program->functions[i].name) + 1;
+    }
+
+    struct image_file_header header = {
+        .magic = IMAGE_FILE_MAGIC,
+        .byte_order = IMAGE_FILE_BYTE_ORDER,
+        .version = IMAGE_FILE_VERSION,
+        .name = strings,
+        .function_count = function_count,
+        .functions = functions,
+        .literal_count = program->literal_count,
+        .literals = literals,
+        .strings = strings,
+        .size = strings + string_size
+    };
+    FILE *file = fopen(path, "wb");
+    if (file == NULL) return false;
+    bool ok = write_words(file, &header, sizeof(header) / sizeof(word_t));
+    size_t name = strings + strlen(program->name) + 1;
+    for (size_t i = 0; i < function_count; i++) {
+        const struct bytecode_function *fun = program->functions + i;
+        struct image_file_function record = { name, fun->arity, fun->locals, code, fun->code_size, fun->pure };
+        ok = ok && write_words(file, &record, sizeof(record) / sizeof(word_t));
+        name += strlen(fun->name) + 1;
+        code += fun->code_size * sizeof(word_t);
+    }
+    ok = ok && write_words(file, program->literals, program->literal_count);
+    for (size_t i = 0; i < function_count; i++) {
+        ok = ok && write_words(file, program->functions[i].code, program->functions[i].code_size);
+    }
+    ok = ok && fwrite(program->name, 1, strlen(program->name) + 1, file) == strlen(program->name) + 1;
+    for (size_t i = 0; i < function_count; i++) {
+        const char *fun_name = program->functions[i].name;
+        ok = ok && fwrite(fun_name, 1, strlen(fun_name) + 1, file) == strlen(fun_name) + 1;
+    }
+    return fclose(file) == 0 && ok;
+}
+
+static bool image_file_error(const char *path, const char *message)
+{
+    fprintf(stderr, "ERROR: %s: %s.\n", path, message);
+    return false;
+}
+
+// Whether the 'count' words at byte 'offset' are within the 'size' bytes of the file, and aligned.
+static bool within_image_file(word_t offset, word_t count, size_t size)
+{
+    return offset % sizeof(word_t) == 0 && offset <= size && count <= (size - offset) / sizeof(word_t);
+}
+
+static bool check_image_file(const char *path, const struct image_file_header *header, size_t size)
+{
+    if (size < sizeof(*header) || header->magic != IMAGE_FILE_MAGIC) return image_file_error(path, "Not an image file");
+    if (header->byte_order != IMAGE_FILE_BYTE_ORDER) return image_file_error(path, "Image of another byte order");
+    if (header->version != IMAGE_FILE_VERSION) return image_file_error(path, "Image of another version");
+    if (header->size != size) return image_file_error(path, "Truncated image");
+    if (header->function_count == 0 || header->function_count > size
+        || !within_image_file(header->functions, header->function_count * (sizeof(struct image_file_function) / sizeof(word_t)), size)
+        || !within_image_file(header->literals, header->literal_count, size)
+        || header->strings > size || header->name < header->strings || header->name >= size)
+    {
+        return image_file_error(path, "Corrupt image header");
+    }
+    // Names are NUL-terminated within the file if the string table is.
+    if (((const char *) header)[size - 1] != '\0') return image_file_error(path, "Corrupt string table");
+    const struct image_file_function *records = (const void *) ((const char *) header + header->functions);
+    for (size_t i = 0; i < header->function_count; i++) {
+        const struct image_file_function *record = records + i;
+        if (!within_image_file(record->code, record->code_size, size)
+            || record->name < header->strings || record->name >= size)
+        {
+            return image_file_error(path, "Corrupt function table");
+        }
+    }
+    return true;
+}
+
+// Map the image file at 'path', returning NULL with an error message if it is not valid.
+MAYBE_UNUSED
+static struct mapped_program *map_image_file(const char *path)
+{
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        image_file_error(path, "Cannot open");
+        return NULL;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size == 0) {
+        image_file_error(path, "Cannot map an empty file");
+        close(fd);
+        return NULL;
+    }
+    size_t size = st.st_size;
+    void *base = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd); // the mapping keeps the file
+    if (base == MAP_FAILED) {
+        image_file_error(path, "Cannot map");
+        return NULL;
+    }
+    const struct image_file_header *header = base;
+    if (!check_image_file(path, header, size)) {
+        munmap(base, size);
+        return NULL;
+    }
+
+    const char *bytes = base;
+    const struct image_file_function *records = (const void *) (bytes + header->functions);
+    struct mapped_program *mapped = malloc(sizeof(struct mapped_program));
+    struct bytecode_function *functions = malloc(header->function_count * sizeof(struct bytecode_function));
+    if (mapped == NULL || functions == NULL) {
+        fprintf(stderr, "ERROR: Out of memory mapping %s.\n", path);
+        abort();
+    }
+    for (size_t i = 0; i < header->function_count; i++) {
+        functions[i].name = bytes + records[i].name;
+        functions[i].arity = records[i].arity;
+        functions[i].locals = records[i].locals;
+        functions[i].code = (const word_t *) (bytes + records[i].code);
+        functions[i].code_size = records[i].code_size;
+        functions[i].pure = records[i].pure != 0;
+    }
+    mapped->program.name = bytes + header->name;
+    mapped->program.functions = functions;
+    mapped->program.function_count = header->function_count;
+    mapped->program.literals = (const word_t *) (bytes + header->literals);
+    mapped->program.literal_count = header->literal_count;
+    mapped->functions = functions;
+    mapped->base = base;
+    mapped->size = size;
+    return mapped;
+}
+
+MAYBE_UNUSED
+static void unmap_image_file(struct mapped_program *mapped)
+{
+    munmap(mapped->base, mapped->size);
+    free(mapped->functions);
+    free(mapped);
+}
+
+#endif
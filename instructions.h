@@ -0,0 +1,236 @@
+/*
+    The instructions of loader.h, defined once for every dispatch strategy of dispatch.h.
+
+    INSTRUCTIONS(X) calls X(name, body...) for every instruction the engines implement,
+    the combo instructions included. A body is the code of the instruction, without its
+    dispatch, written in terms of these macros, which each strategy defines:
+
+        IP, SP, BP      the interpreter registers, as lvalues; IP points past the
+                        instruction word, at the operands if any
+        FUNCTIONS       the function table CALL operands index into
+        FETCH()         the next operand
+        PUSH(x), POP()  the stack, growing upwards
+        TOP()           the top of the stack as an int64_t lvalue
+        EXIT(x)         leave the interpreter with result x
+        QUICKEN_SITE(i) with QUICKEN, see below
+
+    The frame layout is that of directthreaded3.c and loader.h: args below BP, then
+    the previous BP, the return IP and the number of args to pop on return, then the
+    locals. Jump offsets are relative to the jump instruction word.
+
+    Adding an instruction here (and to loader.h) adds it to all strategies at once.
+ */
+
+#ifndef INSTRUCTIONS_H
+#define INSTRUCTIONS_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "bytecode.h"
+#include "loader.h"
+
+#define INSTRUCTIONS(X) \
+    X(LIT, \
+        word_t word = FETCH(); \
+        PUSH(word); \
+    ) \
+    X(CONST_0, PUSH(0);) \
+    X(CONST_1, PUSH(1);) \
+    X(CONST_2, PUSH(2);) \
+    X(SUB1, TOP() -= 1;) \
+    X(SUB2, TOP() -= 2;) \
+    X(ADD1, TOP() += 1;) \
+    X(LOAD, \
+        int64_t offset = FETCH(); \
+        PUSH(*(BP + offset)); \
+    ) \
+    X(STORE, \
+        int64_t offset = FETCH(); \
+        *(BP + offset) = POP(); \
+    ) \
+    X(CALL, \
+        const struct function *fun = FUNCTIONS + FETCH(); \
+        word_t args = FETCH(); \
+        word_t *caller_bp = BP; \
+        BP = SP; \
+        PUSH((word_t) caller_bp); \
+        PUSH((word_t) IP); \
+        PUSH(args); /* to pop on return */ \
+        SP += fun->frame_size; \
+        IP = fun->code; \
+    ) \
+    X(PRIM, \
+        word_t primitive = FETCH(); \
+        CALL_PRIMITIVE(primitive); \
+    ) \
+    X(JT, \
+        int64_t offset = FETCH(); \
+        if (POP()) IP = IP + offset - 2; \
+    ) \
+    X(JLT, \
+        int64_t offset = FETCH(); \
+        int64_t rhs = POP(); \
+        if ((int64_t) POP() < rhs) IP = IP + offset - 2; \
+    ) \
+    X(JGE, \
+        int64_t offset = FETCH(); \
+        int64_t rhs = POP(); \
+        if ((int64_t) POP() >= rhs) IP = IP + offset - 2; \
+    ) \
+    X(JLT_CONST, \
+        int64_t rhs = FETCH(); \
+        int64_t offset = FETCH(); \
+        if ((int64_t) POP() < rhs) IP = IP + offset - 3; \
+    ) \
+    X(JGE_CONST, \
+        int64_t rhs = FETCH(); \
+        int64_t offset = FETCH(); \
+        if ((int64_t) POP() >= rhs) IP = IP + offset - 3; \
+    ) \
+    X(JMP, \
+        int64_t offset = FETCH(); \
+        IP = IP + offset - 2; \
+    ) \
+    X(RET, \
+        word_t result = POP(); \
+        SP = BP + FRAME_HEADER_SIZE; \
+        word_t args = POP(); \
+        IP = (word_t *) POP(); \
+        BP = (word_t *) POP(); \
+        SP -= args; \
+        if (IP == NULL) EXIT(result); \
+        PUSH(result); \
+    ) \
+    QUICK_INSTRUCTIONS(X)
+
+/*
+    With QUICKEN, the first run of a PRIM site rewrites its instruction word into that
+    of the quick instruction of its primitive: an inline one for the primitives listed
+    in quick_instructions, QUICK_PRIM calling through the table for the others. From
+    then on, the site no longer goes through PRIM. QUICKEN_SITE(instruction), defined
+    by each strategy, makes the instruction word before the operand just fetched that
+    of 'instruction'.
+
+    Rewriting the code makes it private to one interpreter: it cannot be shared
+    read-only between threads as in reentrant.c.
+ */
+#ifdef QUICKEN
+    #define CALL_PRIMITIVE(primitive) do { \
+            QUICKEN_SITE(quick_instructions[primitive]); \
+            SP = primitives[primitive](SP); \
+        } while (0)
+    #define QUICK_INSTRUCTIONS(X) \
+        X(QUICK_PRIM, \
+            word_t primitive = FETCH(); \
+            SP = primitives[primitive](SP); \
+        ) \
+        X(QUICK_LESS_THAN, \
+            IP++; \
+            int64_t rhs = POP(); \
+            TOP() = TOP() < rhs; \
+        ) \
+        X(QUICK_SUBTRACT, \
+            IP++; \
+            int64_t rhs = POP(); \
+            TOP() -= rhs; \
+        ) \
+        X(QUICK_ADD, \
+            IP++; \
+            int64_t rhs = POP(); \
+            TOP() += rhs; \
+        )
+#else
+    #define CALL_PRIMITIVE(primitive) (SP = primitives[primitive](SP))
+    #define QUICK_INSTRUCTIONS(X)
+#endif
+
+// Primitives take and return the stack pointer, which keeps it in a register in the
+// strategies that have one (see tailcall.c).
+typedef word_t *(*primitive_t)(word_t *sp);
+
+static word_t *lessThan(word_t *sp)
+{
+    int64_t rhs = *(--sp);
+    int64_t lhs = *(--sp);
+    *(sp++) = lhs < rhs;
+    return sp;
+}
+
+static word_t *subtract(word_t *sp)
+{
+    int64_t rhs = *(--sp);
+    int64_t lhs = *(--sp);
+    *(sp++) = lhs - rhs;
+    return sp;
+}
+
+static word_t *add(word_t *sp)
+{
+    int64_t rhs = *(--sp);
+    int64_t lhs = *(--sp);
+    *(sp++) = lhs + rhs;
+    return sp;
+}
+
+static word_t *newArray(word_t *sp)
+{
+    word_t size = *(--sp);
+    word_t *array = calloc(size, sizeof(word_t));
+    if (array == NULL) {
+        fprintf(stderr, "ERROR: Cannot allocate an array of %llu words.\n", (unsigned long long) size);
+        abort();
+    }
+    *(sp++) = (word_t) array;
+    return sp;
+}
+
+static word_t *at(word_t *sp)
+{
+    word_t index = *(--sp);
+    word_t *array = (word_t *) *(--sp);
+    *(sp++) = array[index];
+    return sp;
+}
+
+static word_t *atPut(word_t *sp)
+{
+    word_t value = *(--sp);
+    word_t index = *(--sp);
+    word_t *array = (word_t *) *(--sp);
+    array[index] = value;
+    return sp;
+}
+
+static word_t *freeArray(word_t *sp)
+{
+    free((word_t *) *(--sp));
+    return sp;
+}
+
+static const primitive_t primitives[PRIMITIVE_COUNT] = {
+    [PRIM_LESS_THAN] = lessThan,
+    [PRIM_SUBTRACT] = subtract,
+    [PRIM_ADD] = add,
+    [PRIM_NEW_ARRAY] = newArray,
+    [PRIM_AT] = at,
+    [PRIM_AT_PUT] = atPut,
+    [PRIM_FREE_ARRAY] = freeArray
+};
+
+#ifdef QUICKEN
+// The hot primitives get an instruction of their own; the interpreter only grows for those.
+static const word_t quick_instructions[PRIMITIVE_COUNT] = {
+    [PRIM_LESS_THAN] = QUICK_LESS_THAN,
+    [PRIM_SUBTRACT] = QUICK_SUBTRACT,
+    [PRIM_ADD] = QUICK_ADD,
+    [PRIM_NEW_ARRAY] = QUICK_PRIM,
+    [PRIM_AT] = QUICK_PRIM,
+    [PRIM_AT_PUT] = QUICK_PRIM,
+    [PRIM_FREE_ARRAY] = QUICK_PRIM
+};
+#endif
+
+#endif
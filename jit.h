@@ -0,0 +1,467 @@
+/*
+    A copy-and-patch baseline compiler from portable bytecode to x86-64 machine code.
+
+    Each portable instruction has a stencil: a precompiled machine code sequence with
+    holes for its operands (a literal, a frame offset, a jump displacement...). The
+    compiler copies the stencils of a function's instructions one after the other
+    into executable memory and patches the holes, and that is all: no register
+    allocation, no instruction selection beyond a few fused stencils (LIT k followed
+    by add or subtract becomes a single add/sub of an immediate).
+
+    The machine code keeps the interpreter's stack and frame layout (loader.h), so
+    that compiled and interpreted functions call each other freely:
+
+        rbx     stack pointer, past the top of the stack
+        r12     BP: args below it, 3 header words (not touched by compiled code), locals
+
+    A compiled function is called with the C calling convention, as a native_t, with
+    the stack pointer past its args. It returns its result in rax, leaving the args
+    to the caller. Calls go through a table of entry points, one per function, which
+    holds either the compiled code or a stub calling the interpreter, so they pick up
+    callees compiled later.
+
+    Primitives other than lessThan, subtract and add are C functions taking and
+    returning the stack pointer, called from the compiled code.
+
+    jit_compile_trace() compiles a recorded trace instead of a function (see below).
+
+    Only the x86-64 System V ABI is supported; elsewhere jit_available() is false.
+ */
+
+#ifndef JIT_H
+#define JIT_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "bytecode.h"
+#include "loader.h"
+
+// 'entry' is the address of the entry point table slot the function was called through.
+typedef word_t (*native_t)(word_t *sp, void *entry);
+
+typedef word_t *(*jit_primitive_t)(word_t *sp);
+
+#if defined(__x86_64__) && !defined(_WIN32)
+    #define JIT_SUPPORTED 1
+#else
+    #define JIT_SUPPORTED 0
+#endif
+
+#define MAX_HOLES 2
+#define NO_HOLE (-1)
+
+enum hole_kind {
+    HOLE_IMM32,
+    HOLE_IMM64,
+    HOLE_REL32 // a jump displacement, relative to the end of the hole
+};
+
+struct stencil {
+    const char *name;
+    const uint8_t *code;
+    size_t size;
+    int holes[MAX_HOLES]; // offsets, NO_HOLE if unused
+    enum hole_kind hole_kinds[MAX_HOLES];
+};
+
+#define STENCIL(name, ...) static const uint8_t name##_code[] = { __VA_ARGS__ }
+
+// push rbx; push r12; push r13 (keeps the stack aligned); mov r12, rdi; lea rbx, [rdi + imm32]
+STENCIL(prologue, 0x53, 0x41, 0x54, 0x41, 0x55, 0x49, 0x89, 0xfc, 0x48, 0x8d, 0x9f, 0, 0, 0, 0);
+// mov rax, imm64; mov [rbx], rax; add rbx, 8
+STENCIL(lit, 0x48, 0xb8, 0, 0, 0, 0, 0, 0, 0, 0, 0x48, 0x89, 0x03, 0x48, 0x83, 0xc3, 0x08);
+// mov rax, [r12 + imm32]; mov [rbx], rax; add rbx, 8
+STENCIL(load, 0x49, 0x8b, 0x84, 0x24, 0, 0, 0, 0, 0x48, 0x89, 0x03, 0x48, 0x83, 0xc3, 0x08);
+// sub rbx, 8; mov rax, [rbx]; mov [r12 + imm32], rax
+STENCIL(store, 0x48, 0x83, 0xeb, 0x08, 0x48, 0x8b, 0x03, 0x49, 0x89, 0x84, 0x24, 0, 0, 0, 0);
+// mov rax, [rbx - 8]; add [rbx - 16], rax; sub rbx, 8
+STENCIL(add, 0x48, 0x8b, 0x43, 0xf8, 0x48, 0x01, 0x43, 0xf0, 0x48, 0x83, 0xeb, 0x08);
+// mov rax, [rbx - 8]; sub [rbx - 16], rax; sub rbx, 8
+STENCIL(subtract, 0x48, 0x8b, 0x43, 0xf8, 0x48, 0x29, 0x43, 0xf0, 0x48, 0x83, 0xeb, 0x08);
+// mov rax, [rbx - 8]; cmp [rbx - 16], rax; setl al; movzx eax, al; mov [rbx - 16], rax; sub rbx, 8
+STENCIL(less_than, 0x48, 0x8b, 0x43, 0xf8, 0x48, 0x39, 0x43, 0xf0, 0x0f, 0x9c, 0xc0, 0x0f, 0xb6, 0xc0,
+    0x48, 0x89, 0x43, 0xf0, 0x48, 0x83, 0xeb, 0x08);
+// add qword [rbx - 8], imm32
+STENCIL(add_immediate, 0x48, 0x81, 0x43, 0xf8, 0, 0, 0, 0);
+// sub qword [rbx - 8], imm32
+STENCIL(subtract_immediate, 0x48, 0x81, 0x6b, 0xf8, 0, 0, 0, 0);
+// mov rdi, rbx; mov rax, imm64; call rax; mov rbx, rax
+STENCIL(primitive, 0x48, 0x89, 0xdf, 0x48, 0xb8, 0, 0, 0, 0, 0, 0, 0, 0, 0xff, 0xd0, 0x48, 0x89, 0xc3);
+// mov rdi, rbx; mov rsi, imm64; call [rsi]; sub rbx, imm32; mov [rbx], rax; add rbx, 8
+STENCIL(call, 0x48, 0x89, 0xdf, 0x48, 0xbe, 0, 0, 0, 0, 0, 0, 0, 0, 0xff, 0x16,
+    0x48, 0x81, 0xeb, 0, 0, 0, 0, 0x48, 0x89, 0x03, 0x48, 0x83, 0xc3, 0x08);
+// sub rbx, 8; mov rax, [rbx]; test rax, rax; jnz rel32
+STENCIL(jt, 0x48, 0x83, 0xeb, 0x08, 0x48, 0x8b, 0x03, 0x48, 0x85, 0xc0, 0x0f, 0x85, 0, 0, 0, 0);
+// sub rbx, 8; mov rax, [rbx]; test rax, rax; jz rel32
+STENCIL(jf, 0x48, 0x83, 0xeb, 0x08, 0x48, 0x8b, 0x03, 0x48, 0x85, 0xc0, 0x0f, 0x84, 0, 0, 0, 0);
+// jmp rel32
+STENCIL(jmp, 0xe9, 0, 0, 0, 0);
+// mov rax, [rbx - 8]; pop r13; pop r12; pop rbx; ret
+STENCIL(ret, 0x48, 0x8b, 0x43, 0xf8, 0x41, 0x5d, 0x41, 0x5c, 0x5b, 0xc3);
+// push rbx; push r12; push r13; mov r12, rdi; mov rbx, rsi
+STENCIL(trace_prologue, 0x53, 0x41, 0x54, 0x41, 0x55, 0x49, 0x89, 0xfc, 0x48, 0x89, 0xf3);
+// mov rax, rbx; mov rdx, imm64; pop r13; pop r12; pop rbx; ret
+STENCIL(side_exit, 0x48, 0x89, 0xd8, 0x48, 0xba, 0, 0, 0, 0, 0, 0, 0, 0, 0x41, 0x5d, 0x41, 0x5c, 0x5b, 0xc3);
+
+#define NO_HOLES { NO_HOLE, NO_HOLE }
+#define ONE_HOLE(offset) { offset, NO_HOLE }
+
+static const struct stencil prologue_stencil = { "prologue", prologue_code, sizeof(prologue_code), ONE_HOLE(11), { HOLE_IMM32 } };
+static const struct stencil lit_stencil = { "LIT", lit_code, sizeof(lit_code), ONE_HOLE(2), { HOLE_IMM64 } };
+static const struct stencil load_stencil = { "LOAD", load_code, sizeof(load_code), ONE_HOLE(4), { HOLE_IMM32 } };
+static const struct stencil store_stencil = { "STORE", store_code, sizeof(store_code), ONE_HOLE(11), { HOLE_IMM32 } };
+static const struct stencil add_stencil = { "add", add_code, sizeof(add_code), NO_HOLES, { 0 } };
+static const struct stencil subtract_stencil = { "subtract", subtract_code, sizeof(subtract_code), NO_HOLES, { 0 } };
+static const struct stencil less_than_stencil = { "lessThan", less_than_code, sizeof(less_than_code), NO_HOLES, { 0 } };
+static const struct stencil add_immediate_stencil = {
+    "LIT k; add", add_immediate_code, sizeof(add_immediate_code), ONE_HOLE(4), { HOLE_IMM32 }
+};
+static const struct stencil subtract_immediate_stencil = {
+    "LIT k; subtract", subtract_immediate_code, sizeof(subtract_immediate_code), ONE_HOLE(4), { HOLE_IMM32 }
+};
+static const struct stencil primitive_stencil = { "PRIM", primitive_code, sizeof(primitive_code), ONE_HOLE(5), { HOLE_IMM64 } };
+static const struct stencil call_stencil = {
+    "CALL", call_code, sizeof(call_code), { 5, 18 }, { HOLE_IMM64, HOLE_IMM32 }
+};
+static const struct stencil jt_stencil = { "JT", jt_code, sizeof(jt_code), ONE_HOLE(12), { HOLE_REL32 } };
+static const struct stencil jf_stencil = { "JT not taken", jf_code, sizeof(jf_code), ONE_HOLE(12), { HOLE_REL32 } };
+static const struct stencil jmp_stencil = { "JMP", jmp_code, sizeof(jmp_code), ONE_HOLE(1), { HOLE_REL32 } };
+static const struct stencil ret_stencil = { "RET", ret_code, sizeof(ret_code), NO_HOLES, { 0 } };
+static const struct stencil trace_prologue_stencil = {
+    "trace prologue", trace_prologue_code, sizeof(trace_prologue_code), NO_HOLES, { 0 }
+};
+static const struct stencil side_exit_stencil = { "side exit", side_exit_code, sizeof(side_exit_code), ONE_HOLE(5), { HOLE_IMM64 } };
+
+#define MAX_STENCIL_SIZE sizeof(call_code)
+
+// Executable memory, unmapped by jit_free().
+struct jit_region {
+    void *address;
+    size_t size;
+    struct jit_region *next;
+};
+
+static struct jit_region *jit_regions;
+
+MAYBE_UNUSED
+static bool jit_available(void)
+{
+    return JIT_SUPPORTED;
+}
+
+// Patch hole 'h' of the stencil copied at 'out + at'. A REL32 operand is the offset of the target in 'out'.
+static void patch_hole(uint8_t *out, size_t at, const struct stencil *stencil, int h, int64_t operand)
+{
+    size_t hole = at + stencil->holes[h];
+    if (stencil->hole_kinds[h] == HOLE_IMM64) {
+        memcpy(out + hole, &operand, 8);
+    } else {
+        int32_t value = stencil->hole_kinds[h] == HOLE_REL32 ? (int32_t) (operand - (int64_t) (hole + 4)) : (int32_t) operand;
+        memcpy(out + hole, &value, 4);
+    }
+}
+
+// Copy the stencil to 'out + *size' and patch its holes with 'operands'.
+static void emit_stencil(uint8_t *out, size_t *size, const struct stencil *stencil, const int64_t *operands)
+{
+    memcpy(out + *size, stencil->code, stencil->size);
+    for (int h = 0; h < MAX_HOLES && stencil->holes[h] != NO_HOLE; h++) {
+        patch_hole(out, *size, stencil, h, operands[h]);
+    }
+    *size += stencil->size;
+}
+
+// A jump whose displacement is patched once all instructions have been placed.
+struct native_jump {
+    size_t target_pc; // in the bytecode
+    size_t at; // offset of the copied stencil
+    const struct stencil *stencil;
+};
+
+static bool fits_imm32(int64_t value)
+{
+    return value >= INT32_MIN && value <= INT32_MAX;
+}
+
+/*
+    Compile program->functions[index], returning its entry point, or NULL if executable
+    memory could not be had. 'entries' is the entry point table CALLs go through,
+    'primitives' the C implementations of the primitives.
+ */
+MAYBE_UNUSED
+static native_t jit_compile(
+    const struct program *program,
+    size_t index,
+    native_t *entries,
+    const jit_primitive_t *primitives)
+{
+    if (!JIT_SUPPORTED) return NULL;
+    const struct bytecode_function *fun = program->functions + index;
+    struct decoded *instrs = checked_malloc(fun->code_size * sizeof(struct decoded), fun->name);
+    size_t *native_pcs = checked_malloc(fun->code_size * sizeof(size_t), fun->name); // original PC -> code offset
+    bool *is_target = checked_malloc(fun->code_size * sizeof(bool), fun->name);
+    struct native_jump *jumps = checked_malloc(fun->code_size * sizeof(struct native_jump), fun->name);
+    size_t jump_count = 0;
+    size_t count = decode_function(program, fun, instrs);
+    find_jump_targets(fun, instrs, count, is_target);
+
+    long page = sysconf(_SC_PAGESIZE);
+    size_t capacity = ((count + 1) * MAX_STENCIL_SIZE + page - 1) / page * page;
+    uint8_t *out = mmap(NULL, capacity, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (out == MAP_FAILED) {
+        free(instrs);
+        free(native_pcs);
+        free(is_target);
+        free(jumps);
+        return NULL;
+    }
+
+    size_t size = 0;
+    int64_t operands[MAX_HOLES] = { 0 };
+    operands[0] = (FRAME_HEADER_SIZE + fun->locals) * sizeof(word_t);
+    emit_stencil(out, &size, &prologue_stencil, operands);
+    for (size_t i = 0; i < count; i++) {
+        const struct decoded *instr = instrs + i;
+        const struct decoded *next = i + 1 < count ? instr + 1 : NULL;
+        native_pcs[instr->pc] = size;
+        switch (instr->opcode) {
+            case LIT:
+                if (next && next->opcode == PRIM && !is_target[next->pc] && fits_imm32(instr->operands[0])
+                    && (next->operands[0] == PRIM_ADD || next->operands[0] == PRIM_SUBTRACT))
+                {
+                    operands[0] = instr->operands[0];
+                    emit_stencil(out, &size,
+                        next->operands[0] == PRIM_ADD ? &add_immediate_stencil : &subtract_immediate_stencil,
+                        operands);
+                    i++;
+                    break;
+                }
+                operands[0] = instr->operands[0];
+                emit_stencil(out, &size, &lit_stencil, operands);
+                break;
+            case LOAD:
+            case STORE:
+                operands[0] = frame_offset(fun, instr->operands[0], FRAME_HEADER_SIZE) * (int64_t) sizeof(word_t);
+                emit_stencil(out, &size, instr->opcode == LOAD ? &load_stencil : &store_stencil, operands);
+                break;
+            case CALL:
+                operands[0] = (int64_t) (entries + instr->operands[0]);
+                operands[1] = instr->operands[1] * sizeof(word_t);
+                emit_stencil(out, &size, &call_stencil, operands);
+                break;
+            case PRIM:
+                if (instr->operands[0] == PRIM_ADD) {
+                    emit_stencil(out, &size, &add_stencil, operands);
+                } else if (instr->operands[0] == PRIM_SUBTRACT) {
+                    emit_stencil(out, &size, &subtract_stencil, operands);
+                } else if (instr->operands[0] == PRIM_LESS_THAN) {
+                    emit_stencil(out, &size, &less_than_stencil, operands);
+                } else {
+                    operands[0] = (int64_t) primitives[instr->operands[0]];
+                    emit_stencil(out, &size, &primitive_stencil, operands);
+                }
+                break;
+            case JT:
+            case JMP:
+                jumps[jump_count].target_pc = instr->operands[0];
+                jumps[jump_count].at = size;
+                jumps[jump_count].stencil = instr->opcode == JT ? &jt_stencil : &jmp_stencil;
+                operands[0] = 0;
+                emit_stencil(out, &size, jumps[jump_count].stencil, operands);
+                jump_count++;
+                break;
+            case RET:
+                emit_stencil(out, &size, &ret_stencil, operands);
+                break;
+        }
+    }
+
+    for (size_t j = 0; j < jump_count; j++) {
+        const struct native_jump *jump = jumps + j;
+        patch_hole(out, jump->at, jump->stencil, 0, native_pcs[jump->target_pc]);
+    }
+
+    free(instrs);
+    free(native_pcs);
+    free(is_target);
+    free(jumps);
+    if (mprotect(out, capacity, PROT_READ | PROT_EXEC) != 0) {
+        munmap(out, capacity);
+        return NULL;
+    }
+    struct jit_region *region = checked_malloc(sizeof(struct jit_region), fun->name);
+    region->address = out;
+    region->size = capacity;
+    region->next = jit_regions;
+    jit_regions = region;
+    return (native_t) (void *) out;
+}
+
+/*
+    Traces: the path of one iteration of a loop, as recorded by an interpreter running
+    it, from the loop head to the backward JMP closing it. The steps are the
+    instructions of the threaded code (loader.h) that ran, with their operands as
+    translated. A compiled trace runs the loop until a guard fails:
+
+        - a JT becomes a guard that the condition goes the recorded way; if not, the
+          trace leaves by a side exit to the threaded code of the other way;
+        - a JMP jumps to the next step, which is where it went when recorded, so
+          forward ones leave no code, and the last one jumps back to the first step;
+        - other instructions are their stencils, as for functions.
+
+    Traces hold no calls or returns: the recording is abandoned on those. A trace is
+    called with BP and the stack pointer of the interpreter, and returns the stack
+    pointer and the threaded code IP of the side exit it left by, where the
+    interpreter resumes.
+ */
+struct trace_step {
+    word_t instruction;
+    word_t operand; // the first one, if any
+    bool taken; // JT: the way it went
+    const word_t *exit_ip; // JT: the threaded code of the other way
+};
+
+struct trace_exit {
+    word_t *sp;
+    const word_t *ip;
+};
+
+typedef struct trace_exit (*native_trace_t)(word_t *bp, word_t *sp);
+
+// The jump of a guard to its side exit, patched once the exits are placed.
+struct guard {
+    size_t at;
+    const struct stencil *stencil;
+    const word_t *exit_ip;
+};
+
+/*
+    Compile the 'count' steps of a trace (at most one JT per step) into a loop, or
+    return NULL if executable memory could not be had or a step has no stencil.
+ */
+MAYBE_UNUSED
+static native_trace_t jit_compile_trace(const struct trace_step *steps, size_t count, const jit_primitive_t *primitives)
+{
+    if (!JIT_SUPPORTED) return NULL;
+    long page = sysconf(_SC_PAGESIZE);
+    size_t capacity = (sizeof(trace_prologue_code) + count * (MAX_STENCIL_SIZE + sizeof(side_exit_code)) + sizeof(jmp_code)
+        + page - 1) / page * page;
+    uint8_t *out = mmap(NULL, capacity, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (out == MAP_FAILED) return NULL;
+    struct guard *guards = checked_malloc(count * sizeof(struct guard), "a trace");
+    size_t guard_count = 0;
+
+    size_t size = 0;
+    int64_t operands[MAX_HOLES] = { 0 };
+    emit_stencil(out, &size, &trace_prologue_stencil, operands);
+    size_t loop = size;
+    bool compiled = true;
+    for (size_t i = 0; i < count && compiled; i++) {
+        const struct trace_step *step = steps + i;
+        const struct trace_step *next = i + 1 < count ? step + 1 : NULL;
+        switch (step->instruction) {
+            case LIT:
+                if (next && next->instruction == PRIM && fits_imm32(step->operand)
+                    && (next->operand == PRIM_ADD || next->operand == PRIM_SUBTRACT))
+                {
+                    operands[0] = step->operand;
+                    emit_stencil(out, &size,
+                        next->operand == PRIM_ADD ? &add_immediate_stencil : &subtract_immediate_stencil,
+                        operands);
+                    i++;
+                    break;
+                }
+                operands[0] = step->operand;
+                emit_stencil(out, &size, &lit_stencil, operands);
+                break;
+            case CONST_0:
+            case CONST_1:
+            case CONST_2:
+                operands[0] = step->instruction - CONST_0;
+                emit_stencil(out, &size, &lit_stencil, operands);
+                break;
+            case SUB1:
+            case SUB2:
+                operands[0] = step->instruction == SUB1 ? 1 : 2;
+                emit_stencil(out, &size, &subtract_immediate_stencil, operands);
+                break;
+            case ADD1:
+                operands[0] = 1;
+                emit_stencil(out, &size, &add_immediate_stencil, operands);
+                break;
+            case LOAD:
+            case STORE:
+                operands[0] = (int64_t) step->operand * (int64_t) sizeof(word_t); // BP-relative
+                emit_stencil(out, &size, step->instruction == LOAD ? &load_stencil : &store_stencil, operands);
+                break;
+            case PRIM:
+                if (step->operand == PRIM_ADD) {
+                    emit_stencil(out, &size, &add_stencil, operands);
+                } else if (step->operand == PRIM_SUBTRACT) {
+                    emit_stencil(out, &size, &subtract_stencil, operands);
+                } else if (step->operand == PRIM_LESS_THAN) {
+                    emit_stencil(out, &size, &less_than_stencil, operands);
+                } else {
+                    operands[0] = (int64_t) primitives[step->operand];
+                    emit_stencil(out, &size, &primitive_stencil, operands);
+                }
+                break;
+            case JT:
+                // Leave when the condition goes the other way.
+                guards[guard_count].at = size;
+                guards[guard_count].stencil = step->taken ? &jf_stencil : &jt_stencil;
+                guards[guard_count].exit_ip = step->exit_ip;
+                operands[0] = 0;
+                emit_stencil(out, &size, guards[guard_count].stencil, operands);
+                guard_count++;
+                break;
+            case JMP:
+                break;
+            default:
+                compiled = false;
+                break;
+        }
+    }
+    if (compiled) {
+        size_t at = size;
+        operands[0] = 0;
+        emit_stencil(out, &size, &jmp_stencil, operands);
+        patch_hole(out, at, &jmp_stencil, 0, loop);
+        for (size_t g = 0; g < guard_count; g++) {
+            patch_hole(out, guards[g].at, guards[g].stencil, 0, size);
+            operands[0] = (int64_t) guards[g].exit_ip;
+            emit_stencil(out, &size, &side_exit_stencil, operands);
+        }
+    }
+    free(guards);
+    if (!compiled || mprotect(out, capacity, PROT_READ | PROT_EXEC) != 0) {
+        munmap(out, capacity);
+        return NULL;
+    }
+    struct jit_region *region = checked_malloc(sizeof(struct jit_region), "a trace");
+    region->address = out;
+    region->size = capacity;
+    region->next = jit_regions;
+    jit_regions = region;
+    return (native_trace_t) (void *) out;
+}
+
+// Unmap all compiled code.
+MAYBE_UNUSED
+static void jit_free(void)
+{
+    while (jit_regions != NULL) {
+        struct jit_region *region = jit_regions;
+        jit_regions = region->next;
+        munmap(region->address, region->size);
+        free(region);
+    }
+}
+
+#endif
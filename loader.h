@@ -0,0 +1,830 @@
+/*
+    The loading stage of the direct-threaded engines.
+
+    Translates a program in the portable bytecode of bytecode.h into threaded code,
+    once, before it runs. This is the "preprocessing stage" the header comment of
+    comboinstructions.c refers to. The translation:
+
+        - replaces each opcode with the address of its implementation label,
+          taken from a table the engine provides;
+        - resolves LIT operands to the literal values themselves;
+        - rewrites LOAD and STORE slot numbers into BP-relative offsets of the
+          directthreaded3.c frame layout: args are at negative offsets,
+          locals start after the 3 words of the frame header;
+        - replaces instruction sequences matching a row of the superinstructions
+          table with the combo instruction of that row;
+        - turns PRIMs of primitives with two operands and one result into
+          PRIM_BINARY, for the engines that implement it;
+        - recomputes JT/JMP offsets against the translated code;
+        - links calls of arity 1 to 3 directly, for the engines implementing CALL1 to
+          CALL3, and tail calls: their first operands become the code of the callee
+          and its frame size, so the call does not go through the function table;
+        - turns calls of pure functions of arity 1 to 3 into MEMO_CALL; MEMO_STORE,
+          for the engines implementing them (see memo.h);
+        - leaves out YIELD for the engines not implementing it.
+
+    For the engines with several copies of some instructions, replicate_instructions()
+    then chooses one for each site (see dispatch.h).
+
+    Translated code never grows, so a code vector of the original size is
+    always large enough, except when stack caching makes the loader insert
+    spills (see load_cached_program()), for the RET_FRAME of frames without
+    BP (see load_sp_frame_program()), and for MEMO_STORE.
+
+    load_lazy_program() does the same translation one function at a time, when the
+    function is first called.
+ */
+
+#ifndef LOADER_H
+#define LOADER_H
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "bytecode.h"
+
+// The number of words in a frame header: prev. BP, prev. IP and the number of args to pop.
+#define FRAME_HEADER_SIZE 3
+
+/*
+    Frame layouts. Args come first, in the frame of the callee, then the header, then
+    the locals, then the operand stack:
+
+        FRAME_BP        the header of FRAME_HEADER_SIZE words above; LOAD and STORE
+                        offsets are relative to BP, which points at the header
+        FRAME_COMPACT   prev. BP and prev. IP only: RET finds the number of args to pop
+                        in the last operand of the CALL before the return IP (CALL f, n)
+        FRAME_SP        prev. IP only, and no BP: LOAD and STORE offsets are relative
+                        to SP, from the stack depth at each instruction, and RET becomes
+                        RET_FRAME with the distance from SP to the prev. IP and the arity
+ */
+enum frame_layout {
+    FRAME_BP,
+    FRAME_COMPACT,
+    FRAME_SP
+};
+
+#define COMPACT_FRAME_HEADER_SIZE 2
+#define SP_FRAME_HEADER_SIZE 1
+
+/*
+    Instructions understood by the engines. The portable opcodes come first and keep
+    their values. The rest are combo instructions internal to the engines; the upstream
+    compiler never emits them.
+ */
+enum instruction {
+    CONST_0 = OPCODE_COUNT,
+    CONST_1,
+    CONST_2,
+    SUB1,
+    SUB2,
+    ADD1,
+    // Linked calls: the first operands are the code of the callee and its frame size;
+    // the arity is that of the instruction.
+    CALL1,
+    CALL2,
+    CALL3,
+    TAILCALL, // CALL; RET reusing the frame, linked, with the arity as a third operand
+    RET_FRAME, // FRAME_SP only: RET, knowing where the prev. IP and the args are
+    JLT, // jump if lhs < rhs, popping both
+    JGE, // jump if lhs >= rhs, popping both
+    JLT_CONST, // jump if the popped value < the constant operand
+    JGE_CONST, // jump if the popped value >= the constant operand
+    SPILL, // stack caching only: write the cached top of the stack to memory
+    PRIM_BINARY, // PRIM of a primitive with two operands and one result, called by value
+    // Quickening only: what a PRIM site rewrites itself into when first run. They keep
+    // the primitive operand, so that the code does not change size.
+    QUICK_PRIM, // a primitive without an instruction of its own, called through the table
+    QUICK_LESS_THAN,
+    QUICK_SUBTRACT,
+    QUICK_ADD,
+    LAZY, // lazy loading only: the stub of a function not translated yet, with its index
+    // Memoization only: the CALL of a pure function (CALL operands), looking up the
+    // result before calling, and where the call returns on a miss, to store it.
+    MEMO_CALL,
+    MEMO_STORE,
+    INSTRUCTION_COUNT
+};
+
+#define NO_JUMP (-1)
+
+struct instruction_info {
+    const char *name;
+    size_t operand_count;
+    int jump_operand; // index of the operand holding a jump offset, or NO_JUMP
+};
+
+static const struct instruction_info instruction_infos[INSTRUCTION_COUNT] = {
+    [LIT] = { "LIT", 1, NO_JUMP },
+    [LOAD] = { "LOAD", 1, NO_JUMP },
+    [CALL] = { "CALL", 2, NO_JUMP },
+    [PRIM] = { "PRIM", 1, NO_JUMP },
+    [JT] = { "JT", 1, 0 },
+    [JMP] = { "JMP", 1, 0 },
+    [RET] = { "RET", 0, NO_JUMP },
+    [STORE] = { "STORE", 1, NO_JUMP },
+    [YIELD] = { "YIELD", 0, NO_JUMP },
+    [CONST_0] = { "CONST_0", 0, NO_JUMP },
+    [CONST_1] = { "CONST_1", 0, NO_JUMP },
+    [CONST_2] = { "CONST_2", 0, NO_JUMP },
+    [SUB1] = { "SUB1", 0, NO_JUMP },
+    [SUB2] = { "SUB2", 0, NO_JUMP },
+    [ADD1] = { "ADD1", 0, NO_JUMP },
+    [CALL1] = { "CALL1", 2, NO_JUMP },
+    [CALL2] = { "CALL2", 2, NO_JUMP },
+    [CALL3] = { "CALL3", 2, NO_JUMP },
+    [TAILCALL] = { "TAILCALL", 3, NO_JUMP },
+    [RET_FRAME] = { "RET_FRAME", 2, NO_JUMP },
+    [JLT] = { "JLT", 1, 0 },
+    [JGE] = { "JGE", 1, 0 },
+    [JLT_CONST] = { "JLT_CONST", 2, 1 },
+    [JGE_CONST] = { "JGE_CONST", 2, 1 },
+    [SPILL] = { "SPILL", 0, NO_JUMP },
+    [PRIM_BINARY] = { "PRIM_BINARY", 1, NO_JUMP },
+    [QUICK_PRIM] = { "QUICK_PRIM", 1, NO_JUMP },
+    [QUICK_LESS_THAN] = { "QUICK_LESS_THAN", 1, NO_JUMP },
+    [QUICK_SUBTRACT] = { "QUICK_SUBTRACT", 1, NO_JUMP },
+    [QUICK_ADD] = { "QUICK_ADD", 1, NO_JUMP },
+    [LAZY] = { "LAZY", 1, NO_JUMP },
+    [MEMO_CALL] = { "MEMO_CALL", 2, NO_JUMP },
+    [MEMO_STORE] = { "MEMO_STORE", 0, NO_JUMP }
+};
+
+MAYBE_UNUSED
+static const char *instruction_name(word_t instruction)
+{
+    return instruction < INSTRUCTION_COUNT ? instruction_infos[instruction].name : "?";
+}
+
+/*
+    The superinstruction table. Each row replaces a sequence of portable instructions
+    with a single combo instruction. A pattern element either matches any operand or
+    requires a particular one. Operands are compared after translation, so a LIT
+    pattern operand is the literal value, not its index. An OVER jump element only
+    matches a jump to just past the next element, the negated branch compilers emit
+    for a loop exit (JT over; JMP exit).
+
+    The replacement takes its operands, if any, from the operands of the matched
+    instructions. A jump operand of the replacement must come from a jump operand
+    of the pattern; the loader patches it like any other jump.
+
+    Rows are tried in order and the first match wins, so longer patterns go first.
+    A row is skipped if the engine has no label for its instruction, or if it has been
+    disabled, e.g. by a profile-driven selection.
+ */
+
+#define MAX_PATTERN 4
+#define MAX_OPERANDS 3
+
+struct pattern_element {
+    word_t opcode;
+    bool any_operand;
+    word_t operand;
+    bool over; // a jump to past the next element of the pattern
+};
+
+struct operand_source {
+    size_t element;
+    size_t operand;
+};
+
+struct superinstruction {
+    size_t length;
+    struct pattern_element pattern[MAX_PATTERN];
+    word_t instruction;
+    struct operand_source operands[MAX_OPERANDS];
+};
+
+#define ANY(op) { .opcode = op, .any_operand = true }
+#define ONLY(op, value) { .opcode = op, .operand = value }
+#define OVER(op) { .opcode = op, .any_operand = true, .over = true }
+
+static const struct superinstruction superinstructions[] = {
+    { 2, { ANY(CALL), ANY(RET) }, TAILCALL, { { 0, 0 }, { 0, 1 }, { 0, 1 } } },
+    { 4, { ANY(LIT), ONLY(PRIM, PRIM_LESS_THAN), OVER(JT), ANY(JMP) }, JGE_CONST, { { 0, 0 }, { 3, 0 } } },
+    { 3, { ANY(LIT), ONLY(PRIM, PRIM_LESS_THAN), ANY(JT) }, JLT_CONST, { { 0, 0 }, { 2, 0 } } },
+    { 3, { ONLY(PRIM, PRIM_LESS_THAN), OVER(JT), ANY(JMP) }, JGE, { { 2, 0 } } },
+    { 2, { ONLY(PRIM, PRIM_LESS_THAN), ANY(JT) }, JLT, { { 1, 0 } } },
+    { 2, { ONLY(LIT, 1), ONLY(PRIM, PRIM_SUBTRACT) }, SUB1 },
+    { 2, { ONLY(LIT, 2), ONLY(PRIM, PRIM_SUBTRACT) }, SUB2 },
+    { 2, { ONLY(LIT, 1), ONLY(PRIM, PRIM_ADD) }, ADD1 },
+    { 1, { ONLY(LIT, 0) }, CONST_0 },
+    { 1, { ONLY(LIT, 1) }, CONST_1 },
+    { 1, { ONLY(LIT, 2) }, CONST_2 }
+};
+
+#define SUPERINSTRUCTION_COUNT COUNT_OF(superinstructions)
+
+// Rows the peephole pass must not use, e.g. as chosen by select_superinstructions() of ngrams.h.
+static bool superinstruction_disabled[SUPERINSTRUCTION_COUNT];
+
+/*
+    Stack caching states, for engines keeping the top of the stack in a register
+    only some of the time. Where the cache is empty, the whole stack is in memory;
+    where it is full, the top element is in the register and the rest in memory.
+
+    The state at each instruction is known at load time: every instruction pushing
+    a result leaves the cache full, every other one (STORE, JT, JMP, RET and the
+    primitives without a result) leaves it empty. Functions start with an empty cache
+    and a CALL returns with a full one. Jump targets are entered with an empty cache:
+    JMP spills the cached value, if any, before jumping, and the loader inserts a
+    SPILL where a full cache falls through into a jump target.
+ */
+enum cache_state {
+    CACHE_EMPTY,
+    CACHE_FULL,
+    CACHE_STATE_COUNT
+};
+
+struct function {
+    size_t arity;
+    // In this scheme, args are not counted towards the frame size.
+    // Only local vars would be.
+    size_t frame_size;
+    word_t *code;
+    size_t code_size; // in words
+};
+
+// A validated portable instruction. LIT operands are the literal values, LOAD and STORE
+// operands still the frame slot numbers.
+struct decoded {
+    size_t pc;
+    word_t opcode;
+    word_t operands[MAX_OPERANDS]; // jump operands hold the absolute original target
+};
+
+// A translated jump whose operand still needs patching.
+struct jump {
+    size_t pc;
+    size_t operand_pc;
+};
+
+#define NO_PC ((size_t) -1)
+
+// The callee operands of linked calls, holding the callee index until every function
+// has been translated, and then its code.
+struct links {
+    word_t **operands;
+    size_t count;
+};
+
+#define MAX_LINKED_ARITY 3
+#define MAX_MEMO_ARITY 3
+
+static void load_error(const struct bytecode_function *fun, size_t pc, const char *message)
+{
+    fprintf(stderr, "ERROR: %s at %s:%zu.\n", message, fun->name, pc);
+    abort();
+}
+
+static void *checked_malloc(size_t size, const char *what)
+{
+    void *result = malloc(size);
+    if (result == NULL) {
+        fprintf(stderr, "ERROR: Out of memory loading %s.\n", what);
+        abort();
+    }
+    return result;
+}
+
+// The BP-relative offset the translated LOAD uses to access frame slot 'slot'.
+static int64_t frame_offset(const struct bytecode_function *fun, word_t slot, size_t header_size)
+{
+    if (slot < fun->arity) {
+        return (int64_t) slot - (int64_t) fun->arity;
+    }
+    return (int64_t) header_size + (int64_t) (slot - fun->arity);
+}
+
+// The SP-relative offset of frame slot 'slot' in a FRAME_SP frame, with 'depth' words
+// on the operand stack.
+static int64_t sp_frame_offset(const struct bytecode_function *fun, word_t slot, size_t depth)
+{
+    int64_t locals_start = -(int64_t) (depth + fun->locals);
+    if (slot < fun->arity) {
+        return locals_start - SP_FRAME_HEADER_SIZE - (int64_t) fun->arity + (int64_t) slot;
+    }
+    return locals_start + (int64_t) (slot - fun->arity);
+}
+
+// Validate the function and decode it into 'out', returning the number of instructions.
+static size_t decode_function(
+    const struct program *program,
+    const struct bytecode_function *fun,
+    struct decoded *out)
+{
+    const word_t *in = fun->code;
+    size_t size = fun->code_size;
+    size_t count = 0;
+    for (size_t pc = 0; pc < size; pc += opcode_size(in[pc])) {
+        word_t opcode = in[pc];
+        if (opcode >= OPCODE_COUNT) load_error(fun, pc, "Invalid opcode");
+        if (pc + opcode_size(opcode) > size) load_error(fun, pc, "Truncated instruction");
+        struct decoded *instr = out + count++;
+        instr->pc = pc;
+        instr->opcode = opcode;
+        switch (opcode) {
+            case LIT:
+                if (in[pc + 1] >= program->literal_count) load_error(fun, pc, "Invalid literal");
+                instr->operands[0] = program->literals[in[pc + 1]];
+                break;
+            case LOAD:
+            case STORE:
+                if (in[pc + 1] >= fun->arity + fun->locals) load_error(fun, pc, "Invalid frame slot");
+                instr->operands[0] = in[pc + 1];
+                break;
+            case CALL:
+                if (in[pc + 1] >= program->function_count) load_error(fun, pc, "Invalid function");
+                if (in[pc + 2] != program->functions[in[pc + 1]].arity) load_error(fun, pc, "Arity mismatch");
+                if (fun->pure && !program->functions[in[pc + 1]].pure) load_error(fun, pc, "Pure function calling one that is not");
+                instr->operands[0] = in[pc + 1];
+                instr->operands[1] = in[pc + 2];
+                break;
+            case PRIM:
+                if (in[pc + 1] >= PRIMITIVE_COUNT) load_error(fun, pc, "Invalid primitive");
+                if (fun->pure && !primitive_infos[in[pc + 1]].pure) load_error(fun, pc, "Pure function calling a primitive that is not");
+                instr->operands[0] = in[pc + 1];
+                break;
+            case JT:
+            case JMP:
+                instr->operands[0] = pc + in[pc + 1];
+                if (instr->operands[0] >= size) load_error(fun, pc, "Invalid jump target");
+                break;
+            case RET:
+            case YIELD:
+                break;
+        }
+    }
+    return count;
+}
+
+// Set is_target[pc] for the original PCs jumped to.
+static void find_jump_targets(
+    const struct bytecode_function *fun,
+    const struct decoded *instrs,
+    size_t count,
+    bool *is_target)
+{
+    for (size_t pc = 0; pc < fun->code_size; pc++) {
+        is_target[pc] = false;
+    }
+    for (size_t i = 0; i < count; i++) {
+        if (instrs[i].opcode == JT || instrs[i].opcode == JMP) {
+            is_target[instrs[i].operands[0]] = true;
+        }
+    }
+}
+
+#define NO_DEPTH ((size_t) -1)
+
+static void set_stack_depth(const struct bytecode_function *fun, size_t *depths, size_t pc, size_t depth, bool *changed)
+{
+    if (depths[pc] == NO_DEPTH) {
+        depths[pc] = depth;
+        *changed = true;
+    } else if (depths[pc] != depth) {
+        load_error(fun, pc, "Inconsistent stack depth");
+    }
+}
+
+// Set depths[pc] to the number of words on the operand stack before each instruction,
+// NO_DEPTH where unreachable. Every path to an instruction must give it the same depth.
+static void find_stack_depths(
+    const struct bytecode_function *fun,
+    const struct decoded *instrs,
+    size_t count,
+    size_t *depths)
+{
+    for (size_t pc = 0; pc < fun->code_size; pc++) {
+        depths[pc] = NO_DEPTH;
+    }
+    if (count > 0) depths[0] = 0;
+    bool changed = true;
+    while (changed) { // backward jumps may reach code not reached yet
+        changed = false;
+        for (size_t i = 0; i < count; i++) {
+            const struct decoded *instr = instrs + i;
+            size_t depth = depths[instr->pc];
+            if (depth == NO_DEPTH) continue;
+            size_t pops = 0;
+            size_t pushes = 0;
+            switch (instr->opcode) {
+                case LIT:
+                case LOAD:
+                    pushes = 1;
+                    break;
+                case CALL:
+                    pops = instr->operands[1];
+                    pushes = 1;
+                    break;
+                case PRIM:
+                    pops = primitive_infos[instr->operands[0]].operand_count;
+                    pushes = primitive_infos[instr->operands[0]].result_count;
+                    break;
+                case STORE:
+                case JT:
+                case RET:
+                    pops = 1;
+                    break;
+            }
+            if (depth < pops) load_error(fun, instr->pc, "Stack underflow");
+            depth = depth - pops + pushes;
+            if (instr->opcode == JT || instr->opcode == JMP) {
+                set_stack_depth(fun, depths, instr->operands[0], depth, &changed);
+            }
+            if (instr->opcode != JMP && instr->opcode != RET && i + 1 < count) {
+                set_stack_depth(fun, depths, instrs[i + 1].pc, depth, &changed);
+            }
+        }
+    }
+}
+
+// Return true if the superinstruction matches the instructions at 'at'.
+// Only the first matched instruction may be a jump target.
+static bool matches(
+    const struct superinstruction *super,
+    const struct decoded *instrs,
+    size_t at,
+    size_t count,
+    const bool *is_target)
+{
+    if (at + super->length > count) return false;
+    for (size_t i = 0; i < super->length; i++) {
+        const struct pattern_element *element = super->pattern + i;
+        const struct decoded *instr = instrs + at + i;
+        if (instr->opcode != element->opcode) return false;
+        if (!element->any_operand && instr->operands[0] != element->operand) return false;
+        if (i > 0 && is_target[instr->pc]) return false;
+        if (element->over) {
+            size_t past = at + i + 2; // the instruction after the next element
+            if (i + 1 >= super->length || past >= count || instr->operands[0] != instrs[past].pc) return false;
+        }
+    }
+    return true;
+}
+
+// The cache state after executing the instruction, given that it falls through.
+static enum cache_state cache_state_after(const struct decoded *instr)
+{
+    switch (instr->opcode) {
+        case STORE:
+        case JT:
+        case JMP:
+        case RET:
+            return CACHE_EMPTY;
+        case PRIM:
+            return primitive_infos[instr->operands[0]].result_count > 0 ? CACHE_FULL : CACHE_EMPTY;
+        default:
+            return CACHE_FULL;
+    }
+}
+
+// Engines with a PRIM_BINARY instruction call these primitives with their operands by value.
+static bool is_binary_primitive(word_t primitive)
+{
+    const struct primitive_info *info = primitive_infos + primitive;
+    return info->operand_count == 2 && info->result_count == 1;
+}
+
+static void thread_function(
+    const struct program *program,
+    const struct bytecode_function *fun,
+    void *const *labels,
+    bool cached,
+    enum frame_layout layout,
+    struct links *links,
+    struct function *result)
+{
+    size_t size = fun->code_size;
+    struct decoded *instrs = checked_malloc(size * sizeof(struct decoded), fun->name);
+    size_t *pc_map = checked_malloc(size * sizeof(size_t), fun->name); // original PC -> translated PC
+    bool *is_target = checked_malloc(size * sizeof(bool), fun->name);
+    struct jump *jumps = checked_malloc(size * sizeof(struct jump), fun->name); // jumps to patch
+    size_t jump_count = 0;
+
+    size_t count = decode_function(program, fun, instrs);
+    find_jump_targets(fun, instrs, count, is_target);
+    for (size_t pc = 0; pc < size; pc++) {
+        pc_map[pc] = NO_PC;
+    }
+    size_t *depths = NULL;
+    if (layout == FRAME_SP) {
+        depths = checked_malloc(size * sizeof(size_t), fun->name);
+        find_stack_depths(fun, instrs, count, depths);
+    }
+    size_t grown = 0; // words added by the translation
+    for (size_t i = 0; i < count; i++) {
+        struct decoded *instr = instrs + i;
+        if (layout == FRAME_SP) {
+            // Unreachable code never runs: any depth will do, 1 keeps STORE from underflowing.
+            size_t depth = depths[instr->pc] == NO_DEPTH ? 1 : depths[instr->pc];
+            if (instr->opcode == LOAD) {
+                instr->operands[0] = sp_frame_offset(fun, instr->operands[0], depth);
+            } else if (instr->opcode == STORE) {
+                instr->operands[0] = sp_frame_offset(fun, instr->operands[0], depth - 1); // after the pop
+            } else if (instr->opcode == RET) {
+                instr->operands[0] = depth + fun->locals + SP_FRAME_HEADER_SIZE;
+                instr->operands[1] = fun->arity;
+                grown += instruction_infos[RET_FRAME].operand_count;
+            }
+        } else if (instr->opcode == LOAD || instr->opcode == STORE) {
+            size_t header_size = layout == FRAME_COMPACT ? COMPACT_FRAME_HEADER_SIZE : FRAME_HEADER_SIZE;
+            instr->operands[0] = frame_offset(fun, instr->operands[0], header_size);
+        }
+        if (instr->opcode == CALL && labels[MEMO_CALL] != NULL) grown++; // at most one MEMO_STORE per call
+    }
+    free(depths);
+    // With caching, at most one SPILL per instruction is added.
+    word_t *out = checked_malloc(((cached ? 2 * size : size) + grown) * sizeof(word_t), fun->name);
+
+    size_t out_pc = 0;
+    enum cache_state state = CACHE_EMPTY;
+    for (size_t i = 0; i < count; ) {
+        const struct decoded *first = instrs + i;
+        if (cached && is_target[first->pc] && state == CACHE_FULL) {
+            out[out_pc++] = (word_t) labels[CACHE_FULL * INSTRUCTION_COUNT + SPILL];
+            state = CACHE_EMPTY;
+        }
+        void *const *state_labels = labels + state * INSTRUCTION_COUNT;
+
+        const struct superinstruction *super = NULL;
+        for (size_t s = 0; s < SUPERINSTRUCTION_COUNT; s++) {
+            if (!superinstruction_disabled[s]
+                && state_labels[superinstructions[s].instruction] != NULL
+                && matches(superinstructions + s, instrs, i, count, is_target))
+            {
+                super = superinstructions + s;
+                break;
+            }
+        }
+
+        word_t instruction = super ? super->instruction : first->opcode;
+        if (instruction == PRIM && state_labels[PRIM_BINARY] != NULL && is_binary_primitive(first->operands[0])) {
+            instruction = PRIM_BINARY;
+        }
+        bool memoized = instruction == CALL && state_labels[MEMO_CALL] != NULL
+            && program->functions[first->operands[0]].pure
+            && first->operands[1] >= 1 && first->operands[1] <= MAX_MEMO_ARITY;
+        if (memoized) instruction = MEMO_CALL;
+        bool linked = instruction == CALL && first->operands[1] >= 1 && first->operands[1] <= MAX_LINKED_ARITY
+            && state_labels[CALL1 + first->operands[1] - 1] != NULL;
+        if (linked) instruction = CALL1 + first->operands[1] - 1;
+        linked |= instruction == TAILCALL;
+        if (instruction == RET && layout == FRAME_SP) instruction = RET_FRAME;
+        const struct instruction_info *info = instruction_infos + instruction;
+        pc_map[first->pc] = out_pc;
+        if (instruction == YIELD && state_labels[YIELD] == NULL) {
+            i++; // jumps to it go to the next instruction
+            continue;
+        }
+        if (info->jump_operand != NO_JUMP) {
+            jumps[jump_count].pc = out_pc;
+            jumps[jump_count].operand_pc = out_pc + 1 + info->jump_operand;
+            jump_count++;
+        }
+        out[out_pc++] = (word_t) state_labels[instruction];
+        size_t operands_pc = out_pc;
+        for (size_t k = 0; k < info->operand_count; k++) {
+            const struct decoded *source = first;
+            size_t operand = k;
+            if (super) {
+                source = instrs + i + super->operands[k].element;
+                operand = super->operands[k].operand;
+            }
+            out[out_pc++] = source->operands[operand];
+        }
+        if (linked) {
+            links->operands[links->count++] = out + operands_pc;
+            out[operands_pc + 1] = program->functions[first->operands[0]].locals; // instead of the arity
+        }
+        if (memoized) out[out_pc++] = (word_t) state_labels[MEMO_STORE];
+        i += super ? super->length : 1;
+        // Only the last instruction of a sequence determines the state after it.
+        if (cached) state = cache_state_after(instrs + i - 1);
+    }
+
+    // Jump operands still hold the original target; make them relative to the translated jump.
+    for (size_t j = 0; j < jump_count; j++) {
+        struct jump *jump = jumps + j;
+        word_t target = out[jump->operand_pc];
+        if (pc_map[target] == NO_PC) load_error(fun, target, "Jump into the middle of an instruction");
+        out[jump->operand_pc] = (int64_t) pc_map[target] - (int64_t) jump->pc;
+    }
+
+    free(instrs);
+    free(pc_map);
+    free(is_target);
+    free(jumps);
+    result->arity = fun->arity;
+    result->frame_size = fun->locals;
+    result->code = out;
+    result->code_size = out_pc;
+}
+
+MAYBE_UNUSED
+static void free_program(struct function *functions, size_t count)
+{
+    for (size_t i = 0; i < count; i++) {
+        free(functions[i].code);
+    }
+    free(functions);
+}
+
+static struct function *load_functions(
+    const struct program *program,
+    void *const *labels,
+    bool cached,
+    enum frame_layout layout)
+{
+    struct function *functions = checked_malloc(program->function_count * sizeof(struct function), program->name);
+    size_t max_calls = 0;
+    for (size_t i = 0; i < program->function_count; i++) {
+        max_calls += program->functions[i].code_size / opcode_size(CALL);
+    }
+    struct links links = { checked_malloc((max_calls + 1) * sizeof(word_t *), program->name), 0 };
+    for (size_t i = 0; i < program->function_count; i++) {
+        thread_function(program, program->functions + i, labels, cached, layout, &links, functions + i);
+    }
+    for (size_t i = 0; i < links.count; i++) {
+        *links.operands[i] = (word_t) functions[*links.operands[i]].code;
+    }
+    free(links.operands);
+    return functions;
+}
+
+// Translate all functions of the program, returning the table CALL operands index into.
+// 'labels' maps each instruction to the address of the engine's label implementing it,
+// or to NULL if the engine does not implement it (only allowed for combo instructions).
+MAYBE_UNUSED
+static struct function *load_program(const struct program *program, void *const *labels)
+{
+    return load_functions(program, labels, false, FRAME_BP);
+}
+
+// Like load_program(), for an engine with a two-state stack cache. 'labels' has
+// CACHE_STATE_COUNT * INSTRUCTION_COUNT entries: the labels implementing each
+// instruction with an empty cache, then those implementing it with a full cache.
+MAYBE_UNUSED
+static struct function *load_cached_program(const struct program *program, void *const *labels)
+{
+    return load_functions(program, labels, true, FRAME_BP);
+}
+
+// Like load_program(), for an engine with FRAME_COMPACT frames.
+MAYBE_UNUSED
+static struct function *load_compact_frame_program(const struct program *program, void *const *labels)
+{
+    return load_functions(program, labels, false, FRAME_COMPACT);
+}
+
+// Like load_program(), for an engine with FRAME_SP frames. It must not implement
+// TAILCALL, which needs a BP.
+MAYBE_UNUSED
+static struct function *load_sp_frame_program(const struct program *program, void *const *labels)
+{
+    return load_functions(program, labels, false, FRAME_SP);
+}
+
+// The instruction whose label is 'label', INSTRUCTION_COUNT if none.
+static word_t instruction_of_label(void *const *labels, word_t label)
+{
+    for (word_t i = 0; i < INSTRUCTION_COUNT; i++) {
+        if (labels[i] != NULL && (word_t) labels[i] == label) return i;
+    }
+    return INSTRUCTION_COUNT;
+}
+
+/*
+    Replication, for engines with several copies of the implementation of some
+    instructions: spreads the sites of each such instruction over its copies, so that
+    the indirect branch ending each copy is predicted from the sites of that copy only.
+
+    'replicas' has 'replica_count' entries per instruction: the labels of its copies,
+    the first being that of 'labels', or all NULL if it has just the one. A copy is
+    chosen for each site by the instruction that statically follows it (the target of
+    a JMP): successors get copies in the order they are first seen, round-robin, and
+    the sites of an instruction that have the same successor share a copy, whose
+    branch then has a single target as long as there are no more successors than
+    copies. The assignment is over the whole program, called after load_program().
+ */
+MAYBE_UNUSED
+static void replicate_instructions(
+    struct function *functions,
+    size_t function_count,
+    void *const *labels,
+    void *const *replicas,
+    size_t replica_count)
+{
+    // The copy assigned to each (instruction, successor), INSTRUCTION_COUNT for none (the end of the code).
+    static int8_t copies[INSTRUCTION_COUNT][INSTRUCTION_COUNT + 1];
+    size_t next_copy[INSTRUCTION_COUNT] = { 0 };
+    memset(copies, -1, sizeof(copies));
+    for (size_t f = 0; f < function_count; f++) {
+        struct function *fun = functions + f;
+        // Decode all of the function first: replacing labels hides instructions from the lookup.
+        word_t *instructions = checked_malloc((fun->code_size + 1) * sizeof(word_t), "replication");
+        for (size_t pc = 0; pc < fun->code_size; ) {
+            word_t instruction = instruction_of_label(labels, fun->code[pc]);
+            if (instruction == INSTRUCTION_COUNT) {
+                fprintf(stderr, "ERROR: Not an instruction at %zu of function %zu (threaded code).\n", pc, f);
+                abort();
+            }
+            instructions[pc] = instruction;
+            pc += 1 + instruction_infos[instruction].operand_count;
+        }
+        instructions[fun->code_size] = INSTRUCTION_COUNT;
+        for (size_t pc = 0; pc < fun->code_size; pc += 1 + instruction_infos[instructions[pc]].operand_count) {
+            word_t instruction = instructions[pc];
+            if (replicas[instruction * replica_count] == NULL) continue;
+            size_t next = instruction == JMP
+                ? pc + (int64_t) fun->code[pc + 1]
+                : pc + 1 + instruction_infos[instruction].operand_count;
+            word_t successor = instructions[next];
+            if (copies[instruction][successor] < 0) {
+                copies[instruction][successor] = next_copy[instruction] % replica_count;
+                next_copy[instruction]++;
+            }
+            fun->code[pc] = (word_t) replicas[instruction * replica_count + copies[instruction][successor]];
+        }
+        free(instructions);
+    }
+}
+
+/*
+    Lazy loading, for engines implementing LAZY: load_lazy_program() translates no
+    function up front. Until its first call, the code of a function is a stub of two
+    words, LAZY index, and the calls linked to it go to the stub. The engine's LAZY
+    translates the function with load_lazy_function() and continues in its code.
+
+    Linked calls get the current code of their callee when their caller is translated:
+    the stub, or the translated code if the callee was called first. LAZY may relink
+    the call site it came from (see threadedlazy.c), so that a site goes through the
+    stub only once. Only the functions that run are ever translated, and only their
+    bytecode is ever read.
+ */
+struct lazy_program {
+    const struct program *program;
+    void *const *labels;
+    struct function *functions; // the table CALL operands index into, stubs included
+    word_t *stubs; // two words per function
+    size_t loaded_count;
+};
+
+MAYBE_UNUSED
+static struct lazy_program *load_lazy_program(const struct program *program, void *const *labels)
+{
+    if (labels[LAZY] == NULL) {
+        fprintf(stderr, "ERROR: Lazy loading %s needs a LAZY instruction.\n", program->name);
+        abort();
+    }
+    struct lazy_program *lazy = checked_malloc(sizeof(struct lazy_program), program->name);
+    lazy->program = program;
+    lazy->labels = labels;
+    lazy->functions = checked_malloc(program->function_count * sizeof(struct function), program->name);
+    lazy->stubs = checked_malloc(2 * program->function_count * sizeof(word_t), program->name);
+    lazy->loaded_count = 0;
+    for (size_t i = 0; i < program->function_count; i++) {
+        struct function *fun = lazy->functions + i;
+        word_t *stub = lazy->stubs + 2 * i;
+        stub[0] = (word_t) labels[LAZY];
+        stub[1] = i;
+        // CALL only needs the frame size, which is known without translating.
+        fun->arity = program->functions[i].arity;
+        fun->frame_size = program->functions[i].locals;
+        fun->code = stub;
+        fun->code_size = 2;
+    }
+    return lazy;
+}
+
+// Translate function 'index' if it is still a stub, returning it.
+MAYBE_UNUSED
+static const struct function *load_lazy_function(struct lazy_program *lazy, size_t index)
+{
+    struct function *result = lazy->functions + index;
+    if (result->code != lazy->stubs + 2 * index) return result;
+    const struct bytecode_function *fun = lazy->program->functions + index;
+    struct links links = { checked_malloc((fun->code_size / opcode_size(CALL) + 1) * sizeof(word_t *), fun->name), 0 };
+    thread_function(lazy->program, fun, lazy->labels, false, FRAME_BP, &links, result);
+    for (size_t i = 0; i < links.count; i++) {
+        *links.operands[i] = (word_t) lazy->functions[*links.operands[i]].code;
+    }
+    free(links.operands);
+    lazy->loaded_count++;
+    return result;
+}
+
+MAYBE_UNUSED
+static void free_lazy_program(struct lazy_program *lazy)
+{
+    for (size_t i = 0; i < lazy->program->function_count; i++) {
+        if (lazy->functions[i].code != lazy->stubs + 2 * i) free(lazy->functions[i].code);
+    }
+    free(lazy->functions);
+    free(lazy->stubs);
+    free(lazy);
+}
+
+#endif
@@ -0,0 +1,154 @@
+/*
+    A result cache for calls of pure functions (bytecode.h), for the engines
+    implementing MEMO_CALL and MEMO_STORE (loader.h).
+
+    The loader turns each call of a pure function of arity 1 to MAX_MEMO_ARITY into
+
+        MEMO_CALL f, n      look up the result of f on the top n stack values:
+                            on a hit, pop the args, push the result and skip the
+                            MEMO_STORE; on a miss, push the key to the pending ones
+                            and call f as CALL does, returning to the MEMO_STORE
+        MEMO_STORE          pop the latest pending key, and store the result on the
+                            top of the stack for it
+
+    so that calls of other functions do not go near the cache. Keys are pending while
+    their call runs, and calls nest: the pending keys are a stack.
+
+    The cache is a fixed-size table of MEMO_CACHE_SIZE entries, open addressing with
+    linear probing over a window of MEMO_PROBES entries from the hash of the key. A
+    store takes the first free entry of the window, or evicts its least recently used
+    one; lookups do not look further than the window either. It counts hits, misses
+    and evictions.
+ */
+
+#ifndef MEMO_H
+#define MEMO_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "bytecode.h"
+#include "loader.h"
+
+#define MEMO_CACHE_BITS 12
+#define MEMO_CACHE_SIZE (1 << MEMO_CACHE_BITS)
+#define MEMO_PROBES 4
+#define MEMO_PENDING_SIZE (1 << 14) // deeper than the calls of ack(3, 8)
+
+struct memo_key {
+    word_t function; // index + 1, 0 for free entries
+    word_t args[MAX_MEMO_ARITY]; // unused ones 0
+};
+
+struct memo_entry {
+    struct memo_key key;
+    word_t result;
+    uint64_t used; // the time of the last lookup or store hitting it
+};
+
+struct memo_cache {
+    struct memo_entry entries[MEMO_CACHE_SIZE];
+    struct memo_key pending[MEMO_PENDING_SIZE];
+    size_t pending_count;
+    uint64_t time;
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t evictions;
+};
+
+MAYBE_UNUSED
+static void memo_clear(struct memo_cache *cache)
+{
+    memset(cache->entries, 0, sizeof(cache->entries));
+    cache->pending_count = 0;
+    cache->time = 0;
+    cache->hits = 0;
+    cache->misses = 0;
+    cache->evictions = 0;
+}
+
+static void memo_make_key(struct memo_key *key, word_t function, const word_t *args, size_t arity)
+{
+    memset(key, 0, sizeof(*key));
+    key->function = function + 1;
+    memcpy(key->args, args, arity * sizeof(word_t));
+}
+
+static size_t memo_slot(const struct memo_key *key)
+{
+    uint64_t hash = key->function * 0x9e3779b97f4a7c15u;
+    for (size_t i = 0; i < MAX_MEMO_ARITY; i++) {
+        hash = (hash ^ key->args[i]) * 0x9e3779b97f4a7c15u;
+    }
+    return hash >> (64 - MEMO_CACHE_BITS);
+}
+
+static bool memo_keys_equal(const struct memo_key *a, const struct memo_key *b)
+{
+    return memcmp(a, b, sizeof(*a)) == 0;
+}
+
+/*
+    Look up the call of 'function' on the 'arity' words at 'args', returning true with
+    its result in 'result' on a hit. On a miss, the key becomes pending.
+ */
+MAYBE_UNUSED
+static bool memo_lookup(struct memo_cache *cache, word_t function, const word_t *args, size_t arity, word_t *result)
+{
+    struct memo_key key;
+    memo_make_key(&key, function, args, arity);
+    size_t slot = memo_slot(&key);
+    cache->time++;
+    for (size_t probe = 0; probe < MEMO_PROBES; probe++) {
+        struct memo_entry *entry = cache->entries + ((slot + probe) & (MEMO_CACHE_SIZE - 1));
+        if (entry->key.function == 0) break; // stores take the first free entry
+        if (memo_keys_equal(&entry->key, &key)) {
+            entry->used = cache->time;
+            cache->hits++;
+            *result = entry->result;
+            return true;
+        }
+    }
+    cache->misses++;
+    if (cache->pending_count == MEMO_PENDING_SIZE) {
+        fprintf(stderr, "ERROR: Too many nested memoized calls.\n");
+        abort();
+    }
+    cache->pending[cache->pending_count++] = key;
+    return false;
+}
+
+// Store 'result' for the latest pending key.
+MAYBE_UNUSED
+static void memo_store(struct memo_cache *cache, word_t result)
+{
+    const struct memo_key *key = cache->pending + --cache->pending_count;
+    size_t slot = memo_slot(key);
+    struct memo_entry *victim = NULL;
+    for (size_t probe = 0; probe < MEMO_PROBES; probe++) {
+        struct memo_entry *entry = cache->entries + ((slot + probe) & (MEMO_CACHE_SIZE - 1));
+        // A nested call of the same key may have stored it already.
+        if (entry->key.function == 0 || memo_keys_equal(&entry->key, key)) {
+            victim = entry;
+            break;
+        }
+        if (victim == NULL || entry->used < victim->used) victim = entry;
+    }
+    if (victim->key.function != 0 && !memo_keys_equal(&victim->key, key)) cache->evictions++;
+    victim->key = *key;
+    victim->result = result;
+    victim->used = ++cache->time;
+}
+
+MAYBE_UNUSED
+static void write_memo_counters(const struct memo_cache *cache)
+{
+    uint64_t lookups = cache->hits + cache->misses;
+    printf("Memo: %llu hits, %llu misses (%.1f%% hits), %llu evictions\n",
+        (unsigned long long) cache->hits, (unsigned long long) cache->misses,
+        lookups > 0 ? 100.0 * cache->hits / lookups : 0, (unsigned long long) cache->evictions);
+}
+
+#endif
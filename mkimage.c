@@ -0,0 +1,53 @@
+/*
+    Writes programs of programs.h to image files (imagefile.h), for threadedlazy -i.
+
+        mkimage [-d dir] <program>... | all
+
+    Each program is written to <dir>/<program>.img, the current directory by default.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "imagefile.h"
+#include "programs.h"
+
+static void usage(void)
+{
+    fprintf(stderr, "Usage: mkimage [-d dir] <program>... | all\n");
+    exit(1);
+}
+
+static void write_program(const struct program *program, const char *dir)
+{
+    char path[4096];
+    if (snprintf(path, sizeof(path), "%s/%s.img", dir, program->name) >= (int) sizeof(path)) usage();
+    if (!write_image_file(program, path)) {
+        fprintf(stderr, "ERROR: Cannot write %s.\n", path);
+        exit(1);
+    }
+    printf("%s\n", path);
+}
+
+int main(int argc, const char *argv[])
+{
+    const char *dir = ".";
+    int i = 1;
+    if (i + 1 < argc && strcmp(argv[i], "-d") == 0) {
+        dir = argv[i + 1];
+        i += 2;
+    }
+    if (i == argc) usage();
+    for (; i < argc; i++) {
+        if (strcmp(argv[i], "all") == 0) {
+            for (size_t b = 0; b < BENCHMARK_COUNT; b++) {
+                write_program(benchmarks[b].program, dir);
+            }
+            continue;
+        }
+        const struct benchmark *benchmark = find_benchmark(argv[i]);
+        if (benchmark == NULL) usage();
+        write_program(benchmark->program, dir);
+    }
+}
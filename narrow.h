@@ -0,0 +1,207 @@
+/*
+    A compact threaded code format, for engines where the size of the code matters
+    more than the simplicity of fetching from it.
+
+    Threaded code of loader.h spends a 64-bit word on every instruction and operand.
+    Narrow code is a byte stream instead. Each instruction is:
+
+        - a 32-bit signed offset of the address of its implementation from a base
+          address the engine chooses (typically the label of its first instruction),
+          which is enough for any function;
+        - its operands, packed right after it, each with the width and signedness of
+          narrow_formats[] for that operand of that instruction: 8 bits for frame
+          offsets, primitives and arities, 16 for function indices and jump offsets,
+          32 for literals.
+
+    Jump offsets are in bytes, relative to the end of the jump instruction. Nothing is
+    aligned: operands are read with memcpy(), which compiles to plain (unaligned) loads
+    on x86-64.
+
+    The translation starts from the threaded code of load_program(), superinstructions
+    included, made with instruction numbers for labels, and re-encodes it. An operand
+    that does not fit its width is a load error: the format trades range for size.
+ */
+
+#ifndef NARROW_H
+#define NARROW_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "bytecode.h"
+#include "loader.h"
+
+#define NARROW_HANDLER_SIZE 4 // bytes
+
+// Operand widths in bytes, negative for signed operands.
+#define S8 (-1)
+#define U8 1
+#define S16 (-2)
+#define U16 2
+#define S32 (-4)
+
+struct narrow_format {
+    int8_t widths[MAX_OPERANDS];
+};
+
+// The instructions without an entry have no operands, or are not supported.
+static const struct narrow_format narrow_formats[INSTRUCTION_COUNT] = {
+    [LIT] = { { S32 } },
+    [LOAD] = { { S8 } },
+    [STORE] = { { S8 } },
+    [CALL] = { { U16, U8 } },
+    [PRIM] = { { U8 } },
+    [PRIM_BINARY] = { { U8 } },
+    [JT] = { { S16 } },
+    [JMP] = { { S16 } },
+    [JLT] = { { S16 } },
+    [JGE] = { { S16 } },
+    [JLT_CONST] = { { S16, S16 } },
+    [JGE_CONST] = { { S16, S16 } }
+};
+
+// Reading an operand, 'ip' pointing at it.
+static inline int8_t read_s8(const uint8_t *ip) { return (int8_t) *ip; }
+static inline uint8_t read_u8(const uint8_t *ip) { return *ip; }
+static inline int16_t read_s16(const uint8_t *ip) { int16_t value; memcpy(&value, ip, sizeof(value)); return value; }
+static inline uint16_t read_u16(const uint8_t *ip) { uint16_t value; memcpy(&value, ip, sizeof(value)); return value; }
+static inline int32_t read_s32(const uint8_t *ip) { int32_t value; memcpy(&value, ip, sizeof(value)); return value; }
+
+struct narrow_function {
+    size_t arity;
+    size_t frame_size;
+    const uint8_t *code;
+    size_t code_size; // in bytes
+};
+
+static bool has_narrow_format(word_t instruction)
+{
+    for (size_t k = 0; k < instruction_infos[instruction].operand_count; k++) {
+        if (narrow_formats[instruction].widths[k] == 0) return false;
+    }
+    return true;
+}
+
+static size_t narrow_size(word_t instruction)
+{
+    size_t size = NARROW_HANDLER_SIZE;
+    for (size_t k = 0; k < instruction_infos[instruction].operand_count; k++) {
+        int width = narrow_formats[instruction].widths[k];
+        size += width < 0 ? -width : width;
+    }
+    return size;
+}
+
+static bool fits(int64_t value, int width)
+{
+    if (width < 0) {
+        int64_t limit = (int64_t) 1 << (-8 * width - 1);
+        return value >= -limit && value < limit;
+    }
+    return value >= 0 && (uint64_t) value < (uint64_t) 1 << (8 * width);
+}
+
+static void write_operand(uint8_t *out, int64_t value, int width)
+{
+    uint64_t bits = (uint64_t) value; // little-endian, as the reads expect
+    for (int i = 0; i < (width < 0 ? -width : width); i++) {
+        out[i] = (uint8_t) (bits >> (8 * i));
+    }
+}
+
+static void narrow_error(const struct bytecode_function *fun, size_t pc, const char *message)
+{
+    fprintf(stderr, "ERROR: %s at %s:%zu (threaded code).\n", message, fun->name, pc);
+    abort();
+}
+
+// Re-encode the threaded code of 'wide', made with instruction numbers for labels.
+static void narrow_function(
+    const struct bytecode_function *fun,
+    const struct function *wide,
+    void *const *labels,
+    const void *base,
+    struct narrow_function *result)
+{
+    // Byte offsets of the translated instructions, and the end of the code.
+    size_t *offsets = checked_malloc((wide->code_size + 1) * sizeof(size_t), fun->name);
+    size_t size = 0;
+    for (size_t pc = 0; pc < wide->code_size; pc += 1 + instruction_infos[wide->code[pc]].operand_count) {
+        offsets[pc] = size;
+        size += narrow_size(wide->code[pc]);
+    }
+    offsets[wide->code_size] = size;
+
+    uint8_t *out = checked_malloc(size, fun->name);
+    for (size_t pc = 0; pc < wide->code_size; pc += 1 + instruction_infos[wide->code[pc]].operand_count) {
+        word_t instruction = wide->code[pc];
+        const struct instruction_info *info = instruction_infos + instruction;
+        uint8_t *at = out + offsets[pc];
+        write_operand(at, (const char *) labels[instruction] - (const char *) base, S32);
+        at += NARROW_HANDLER_SIZE;
+        size_t end = offsets[pc] + narrow_size(instruction);
+        for (size_t k = 0; k < info->operand_count; k++) {
+            int width = narrow_formats[instruction].widths[k];
+            int64_t value = (int64_t) wide->code[pc + 1 + k];
+            if ((int) k == info->jump_operand) {
+                // Wide offsets are relative to the jump instruction word.
+                value = (int64_t) offsets[pc + value] - (int64_t) end;
+            }
+            if (!fits(value, width)) narrow_error(fun, pc, "Operand too wide for the narrow format");
+            write_operand(at, value, width);
+            at += width < 0 ? -width : width;
+        }
+    }
+
+    free(offsets);
+    result->arity = wide->arity;
+    result->frame_size = wide->frame_size;
+    result->code = out;
+    result->code_size = size;
+}
+
+/*
+    Translate all functions of the program into narrow code, returning the table CALL
+    operands index into. 'labels' maps each instruction to the address of the engine's
+    label implementing it, or to NULL as for load_program(). Each is encoded relative
+    to 'base', which must be within 2 GiB of all of them. The size of the threaded code
+    the narrow code replaces is added to 'wide_size', in bytes.
+ */
+MAYBE_UNUSED
+static struct narrow_function *load_narrow_program(
+    const struct program *program,
+    void *const *labels,
+    const void *base,
+    size_t *wide_size)
+{
+    void *numbers[INSTRUCTION_COUNT];
+    for (size_t i = 0; i < INSTRUCTION_COUNT; i++) {
+        if (labels[i] != NULL && !has_narrow_format(i)) {
+            fprintf(stderr, "ERROR: No narrow format for %s.\n", instruction_name(i));
+            abort();
+        }
+        numbers[i] = labels[i] != NULL ? (void *) (uintptr_t) i : NULL; // (void *) LIT is NULL, as for the switch engines
+    }
+    struct function *wide = load_program(program, numbers);
+    struct narrow_function *functions = checked_malloc(program->function_count * sizeof(struct narrow_function), program->name);
+    for (size_t i = 0; i < program->function_count; i++) {
+        narrow_function(program->functions + i, wide + i, labels, base, functions + i);
+        *wide_size += wide[i].code_size * sizeof(word_t);
+    }
+    free_program(wide, program->function_count);
+    return functions;
+}
+
+MAYBE_UNUSED
+static void free_narrow_program(struct narrow_function *functions, size_t count)
+{
+    for (size_t i = 0; i < count; i++) {
+        free((void *) functions[i].code);
+    }
+    free(functions);
+}
+
+#endif
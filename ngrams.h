@@ -0,0 +1,279 @@
+/*
+    Dynamic instruction n-gram profiling, and superinstruction selection from the profile.
+
+    An engine built with PROFILE_NGRAMS calls record_ngram() on every dispatch. Only
+    instructions that follow each other in the code vector are counted as a sequence:
+    a taken jump, a call or a return starts a new one, since the peephole pass could
+    never fuse across them anyway. The operand is part of the counted instruction for
+    LIT and PRIM, because superinstruction patterns constrain those (LIT 1 and LIT 2 are
+    as different as PRIM add and PRIM subtract).
+
+    write_ngrams() writes the unigrams, pairs and triples, most frequent first:
+
+        # fib: 67 dispatches
+        <count> <n> <instruction> ...
+        22 3 LIT=2 PRIM=1 CALL
+
+    select_superinstructions() reads one or more such files (a colon-separated list,
+    counts are summed so they can describe a workload mix) and enables the rows of the
+    superinstructions table of loader.h that save the most dispatches, among those the
+    engine has a label for.
+ */
+
+#ifndef NGRAMS_H
+#define NGRAMS_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "bytecode.h"
+#include "loader.h"
+
+#define MAX_NGRAM 3
+#define MAX_NGRAM_ELEMENTS 255
+#define NGRAM_TABLE_SIZE (1 << 16)
+
+struct ngram_element {
+    word_t instruction;
+    word_t operand;
+};
+
+struct ngram {
+    uint32_t key; // up to MAX_NGRAM element IDs, one per byte, oldest first from the low byte
+    uint64_t count;
+};
+
+static bool has_significant_operand(word_t instruction)
+{
+    return instruction == LIT || instruction == PRIM;
+}
+
+// Profiling state. Element IDs start at 1, 0 terminates a key.
+
+static void *const *ngram_labels;
+static struct ngram_element ngram_elements[MAX_NGRAM_ELEMENTS + 1];
+static size_t ngram_element_count;
+static struct ngram ngram_table[NGRAM_TABLE_SIZE];
+static size_t ngram_count;
+static uint64_t ngram_dispatches;
+static uint32_t ngram_history; // IDs of the last MAX_NGRAM - 1 instructions, most recent in the low byte
+static const word_t *ngram_expected_ip;
+
+MAYBE_UNUSED
+static void start_ngrams(void *const *labels)
+{
+    ngram_labels = labels;
+}
+
+static uint32_t ngram_element_id(word_t instruction, word_t operand)
+{
+    if (!has_significant_operand(instruction)) operand = 0;
+    for (size_t id = 1; id <= ngram_element_count; id++) {
+        if (ngram_elements[id].instruction == instruction && ngram_elements[id].operand == operand) {
+            return id;
+        }
+    }
+    if (ngram_element_count == MAX_NGRAM_ELEMENTS) {
+        fprintf(stderr, "ERROR: Too many distinct instructions to profile.\n");
+        abort();
+    }
+    ngram_element_count++;
+    ngram_elements[ngram_element_count].instruction = instruction;
+    ngram_elements[ngram_element_count].operand = operand;
+    return ngram_element_count;
+}
+
+static struct ngram *ngram_entry(uint32_t key)
+{
+    size_t index = (key * 2654435761u) % NGRAM_TABLE_SIZE;
+    while (ngram_table[index].key != 0 && ngram_table[index].key != key) {
+        index = (index + 1) % NGRAM_TABLE_SIZE;
+    }
+    if (ngram_table[index].key == 0) {
+        if (ngram_count == NGRAM_TABLE_SIZE - 1) {
+            fprintf(stderr, "ERROR: N-gram table is full.\n");
+            abort();
+        }
+        ngram_table[index].key = key;
+        ngram_count++;
+    }
+    return ngram_table + index;
+}
+
+// Count the instruction the engine is about to dispatch to at 'ip'.
+MAYBE_UNUSED
+static void record_ngram(const word_t *ip)
+{
+    word_t instruction = 0;
+    while (instruction < INSTRUCTION_COUNT && ngram_labels[instruction] != (void *) *ip) instruction++;
+    if (instruction == INSTRUCTION_COUNT) {
+        fprintf(stderr, "ERROR: Unknown instruction at %p.\n", (void *) ip);
+        abort();
+    }
+    size_t operand_count = instruction_infos[instruction].operand_count;
+    uint32_t id = ngram_element_id(instruction, operand_count > 0 ? ip[1] : 0);
+
+    if (ip != ngram_expected_ip) ngram_history = 0;
+    uint32_t key = id;
+    ngram_entry(key)->count++;
+    for (int n = 2; n <= MAX_NGRAM; n++) {
+        uint32_t previous = (ngram_history >> (8 * (n - 2))) & 0xff;
+        if (previous == 0) break;
+        key = (key << 8) | previous;
+        ngram_entry(key)->count++;
+    }
+    ngram_history = ((ngram_history << 8) | id) & ((1u << (8 * (MAX_NGRAM - 1))) - 1);
+    ngram_expected_ip = ip + 1 + operand_count;
+    ngram_dispatches++;
+}
+
+// Return the number of elements of the key. The oldest instruction is in the low byte.
+static int ngram_length(uint32_t key)
+{
+    int n = 0;
+    while (key != 0) {
+        n++;
+        key >>= 8;
+    }
+    return n;
+}
+
+static int compare_ngrams(const void *a, const void *b)
+{
+    uint64_t lhs = ((const struct ngram *) a)->count;
+    uint64_t rhs = ((const struct ngram *) b)->count;
+    return lhs < rhs ? 1 : lhs > rhs ? -1 : 0;
+}
+
+MAYBE_UNUSED
+static void write_ngrams(FILE *out, const char *program_name, size_t limit)
+{
+    struct ngram *sorted = checked_malloc(ngram_count * sizeof(struct ngram), "n-grams");
+    size_t count = 0;
+    for (size_t i = 0; i < NGRAM_TABLE_SIZE; i++) {
+        if (ngram_table[i].key != 0) sorted[count++] = ngram_table[i];
+    }
+    qsort(sorted, count, sizeof(struct ngram), compare_ngrams);
+
+    fprintf(out, "# %s: %llu dispatches\n", program_name, (unsigned long long) ngram_dispatches);
+    for (size_t i = 0; i < count && i < limit; i++) {
+        int n = ngram_length(sorted[i].key);
+        fprintf(out, "%llu %d", (unsigned long long) sorted[i].count, n);
+        for (int k = 0; k < n; k++) {
+            const struct ngram_element *element = ngram_elements + ((sorted[i].key >> (8 * k)) & 0xff);
+            fprintf(out, " %s", instruction_name(element->instruction));
+            if (has_significant_operand(element->instruction)) {
+                fprintf(out, "=%lld", (long long) element->operand);
+            }
+        }
+        fprintf(out, "\n");
+    }
+    free(sorted);
+}
+
+// Selection
+
+static bool parse_ngram_element(const char *token, struct ngram_element *element)
+{
+    size_t name_length = strcspn(token, "=");
+    for (word_t i = 0; i < INSTRUCTION_COUNT; i++) {
+        const char *name = instruction_infos[i].name;
+        if (strlen(name) == name_length && strncmp(name, token, name_length) == 0) {
+            element->instruction = i;
+            element->operand = token[name_length] == '=' ? (word_t) strtoll(token + name_length + 1, NULL, 10) : 0;
+            return true;
+        }
+    }
+    return false;
+}
+
+static bool pattern_matches_ngram(
+    const struct superinstruction *super,
+    const struct ngram_element *elements,
+    size_t n)
+{
+    if (super->length != n) return false;
+    for (size_t i = 0; i < n; i++) {
+        const struct pattern_element *pattern = super->pattern + i;
+        if (pattern->opcode != elements[i].instruction) return false;
+        if (!pattern->any_operand && pattern->operand != elements[i].operand) return false;
+    }
+    return true;
+}
+
+// Add the counts of the n-grams in 'path' matching each row of the table to 'counts'.
+static void read_ngram_profile(const char *path, uint64_t *counts)
+{
+    FILE *in = fopen(path, "r");
+    if (in == NULL) {
+        fprintf(stderr, "ERROR: Cannot read n-gram profile %s.\n", path);
+        abort();
+    }
+    char line[512];
+    while (fgets(line, sizeof(line), in) != NULL) {
+        if (line[0] == '#') continue;
+        struct ngram_element elements[MAX_NGRAM];
+        char *rest;
+        char *saveptr;
+        uint64_t count = strtoull(line, &rest, 10);
+        size_t n = strtoul(rest, &rest, 10);
+        if (n == 0 || n > MAX_NGRAM) continue;
+        bool valid = true;
+        for (size_t i = 0; i < n && valid; i++) {
+            char *token = strtok_r(i == 0 ? rest : NULL, " \n", &saveptr);
+            valid = token != NULL && parse_ngram_element(token, elements + i);
+        }
+        if (!valid) continue;
+        for (size_t s = 0; s < SUPERINSTRUCTION_COUNT; s++) {
+            if (pattern_matches_ngram(superinstructions + s, elements, n)) counts[s] += count;
+        }
+    }
+    fclose(in);
+}
+
+/*
+    Enable at most 'budget' rows of the superinstructions table, those that save the
+    most dispatches according to the profiles in 'paths': (length - 1) x count. A row of
+    a single instruction saves an operand fetch rather than a dispatch and is weighed as
+    half a dispatch per execution. Rows that never matched, and rows whose instruction
+    has no entry in the engine's 'labels', are disabled and not counted against 'budget'.
+ */
+MAYBE_UNUSED
+static void select_superinstructions(const char *paths, size_t budget, void *const *labels)
+{
+    uint64_t counts[SUPERINSTRUCTION_COUNT] = { 0 };
+    uint64_t scores[SUPERINSTRUCTION_COUNT];
+    char *list = strdup(paths);
+    char *saveptr;
+    for (char *path = strtok_r(list, ":", &saveptr); path != NULL; path = strtok_r(NULL, ":", &saveptr)) {
+        read_ngram_profile(path, counts);
+    }
+    free(list);
+
+    for (size_t s = 0; s < SUPERINSTRUCTION_COUNT; s++) {
+        size_t length = superinstructions[s].length;
+        if (labels[superinstructions[s].instruction] == NULL) {
+            scores[s] = 0;
+        } else {
+            scores[s] = length > 1 ? (length - 1) * counts[s] : counts[s] / 2;
+        }
+        superinstruction_disabled[s] = true;
+    }
+    for (size_t chosen = 0; chosen < budget; chosen++) {
+        size_t best = SUPERINSTRUCTION_COUNT;
+        for (size_t s = 0; s < SUPERINSTRUCTION_COUNT; s++) {
+            if (superinstruction_disabled[s] && scores[s] > 0
+                && (best == SUPERINSTRUCTION_COUNT || scores[s] > scores[best]))
+            {
+                best = s;
+            }
+        }
+        if (best == SUPERINSTRUCTION_COUNT) break;
+        superinstruction_disabled[best] = false;
+    }
+}
+
+#endif
@@ -0,0 +1,120 @@
+/*
+    Hardware performance counters around interpreter runs, via perf_event_open(2).
+
+    Counts user-mode instructions, cycles, branch misses and L1 instruction cache read
+    misses of the calling thread while enabled. Each counter is opened on its own, so a
+    CPU or VM lacking one of them (or not exposing a PMU at all) still gets the others;
+    counters that could not be opened read as unavailable. Values are scaled by
+    time_enabled / time_running in case the kernel had to multiplex them.
+ */
+
+#ifndef PERF_H
+#define PERF_H
+
+#include <linux/perf_event.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+enum counter {
+    COUNTER_INSTRUCTIONS,
+    COUNTER_CYCLES,
+    COUNTER_BRANCH_MISSES,
+    COUNTER_L1I_MISSES,
+    COUNTER_COUNT
+};
+
+static const char *counter_names[COUNTER_COUNT] = {
+    "instructions",
+    "cycles",
+    "branch_misses",
+    "l1i_misses"
+};
+
+struct counters {
+    int fds[COUNTER_COUNT];
+};
+
+struct counter_values {
+    bool available[COUNTER_COUNT];
+    uint64_t values[COUNTER_COUNT];
+};
+
+static int open_counter(uint32_t type, uint64_t config)
+{
+    struct perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = type;
+    attr.config = config;
+    attr.disabled = 1;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+    return syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+}
+
+// Open the counters for the calling thread. Return false if none could be opened.
+static bool open_counters(struct counters *counters)
+{
+    counters->fds[COUNTER_INSTRUCTIONS] = open_counter(PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS);
+    counters->fds[COUNTER_CYCLES] = open_counter(PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES);
+    counters->fds[COUNTER_BRANCH_MISSES] = open_counter(PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES);
+    counters->fds[COUNTER_L1I_MISSES] = open_counter(PERF_TYPE_HW_CACHE,
+        PERF_COUNT_HW_CACHE_L1I
+        | (PERF_COUNT_HW_CACHE_OP_READ << 8)
+        | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16));
+    bool any = false;
+    for (int i = 0; i < COUNTER_COUNT; i++) {
+        any |= counters->fds[i] >= 0;
+    }
+    return any;
+}
+
+static void close_counters(struct counters *counters)
+{
+    for (int i = 0; i < COUNTER_COUNT; i++) {
+        if (counters->fds[i] >= 0) close(counters->fds[i]);
+        counters->fds[i] = -1;
+    }
+}
+
+static void control_counters(struct counters *counters, unsigned long request)
+{
+    for (int i = 0; i < COUNTER_COUNT; i++) {
+        if (counters->fds[i] >= 0) ioctl(counters->fds[i], request, 0);
+    }
+}
+
+static void reset_counters(struct counters *counters)
+{
+    control_counters(counters, PERF_EVENT_IOC_RESET);
+}
+
+static inline void start_counters(struct counters *counters)
+{
+    control_counters(counters, PERF_EVENT_IOC_ENABLE);
+}
+
+static inline void stop_counters(struct counters *counters)
+{
+    control_counters(counters, PERF_EVENT_IOC_DISABLE);
+}
+
+static void read_counters(struct counters *counters, struct counter_values *result)
+{
+    for (int i = 0; i < COUNTER_COUNT; i++) {
+        uint64_t data[3]; // value, time enabled, time running
+        result->available[i] = counters->fds[i] >= 0
+            && read(counters->fds[i], data, sizeof(data)) == sizeof(data)
+            && data[2] > 0;
+        result->values[i] = result->available[i]
+            ? (uint64_t) ((double) data[0] * data[1] / data[2])
+            : 0;
+    }
+}
+
+#endif
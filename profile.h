@@ -0,0 +1,305 @@
+/*
+    Per-instruction and per-function dispatch profiling, for finding out where an
+    engine spends its time.
+
+    An engine built with PROFILE_DISPATCH calls profile_dispatch() on every dispatch,
+    before jumping to the instruction, PROFILE_CALL() on every call (including the
+    call of the entry function) and PROFILE_EXIT() where a run returns. Each thread
+    counts into its own struct profile, so the counters are never shared:
+
+        - exact dispatch counts per instruction, and call counts per function;
+        - one dispatch in PROFILE_SAMPLE_PERIOD is timed with the time stamp counter,
+          from its dispatch to the next one, which makes the cycles of the instruction
+          plus one dispatch. The function of a timed instruction is found from its
+          address in the threaded code, so functions get sampled cycles and dispatches.
+
+    At exit, the counters of all threads are summed and a summary is written to stderr
+    (see write_profile()).
+
+    Without PROFILE_DISPATCH, PROFILE_CALL() and PROFILE_EXIT() expand to nothing and
+    engines do not call profile_dispatch(), so their code is the same as without this
+    file.
+ */
+
+#ifndef PROFILE_H
+#define PROFILE_H
+
+#ifdef PROFILE_DISPATCH
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+    #include <x86intrin.h>
+#endif
+
+#include "bytecode.h"
+#include "loader.h"
+
+#ifndef PROFILE_SAMPLE_PERIOD
+    #define PROFILE_SAMPLE_PERIOD 101 // prime, so that it does not beat with loops
+#endif
+#define PROFILE_LABEL_SLOTS 64 // power of 2, more than INSTRUCTION_COUNT
+_Static_assert(PROFILE_LABEL_SLOTS > INSTRUCTION_COUNT, "PROFILE_LABEL_SLOTS must be more than INSTRUCTION_COUNT");
+_Static_assert((PROFILE_LABEL_SLOTS & (PROFILE_LABEL_SLOTS - 1)) == 0, "PROFILE_LABEL_SLOTS must be a power of 2");
+#define NOT_SAMPLING (-1)
+
+struct profile {
+    uint64_t dispatches[INSTRUCTION_COUNT];
+    uint64_t samples[INSTRUCTION_COUNT];
+    uint64_t cycles[INSTRUCTION_COUNT];
+    uint64_t *calls; // per function
+    uint64_t *function_samples;
+    uint64_t *function_cycles;
+    uint32_t countdown; // dispatches until the next sample
+    int sampled_instruction; // NOT_SAMPLING between samples
+    size_t sampled_function;
+    uint64_t sample_start;
+    struct profile *next;
+};
+
+struct profile_label {
+    const void *label;
+    int instruction;
+};
+
+// What is being profiled, set up once by start_profile().
+static struct profile_label profile_labels[PROFILE_LABEL_SLOTS];
+static const struct program *profiled_program;
+static const struct function *profiled_functions;
+static uint64_t timer_overhead; // the least cycles between two timestamps
+
+// The profiles of all threads, summed at exit.
+static struct profile *profiles;
+static pthread_mutex_t profiles_lock = PTHREAD_MUTEX_INITIALIZER;
+static _Thread_local struct profile *thread_profile;
+
+static uint64_t timestamp(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000u + ts.tv_nsec;
+#endif
+}
+
+static size_t profile_label_slot(const void *label)
+{
+    return (size_t) (((uintptr_t) label * 0x9e3779b97f4a7c15u) >> 58) & (PROFILE_LABEL_SLOTS - 1);
+}
+
+static int profiled_instruction(const void *label)
+{
+    size_t slot = profile_label_slot(label);
+    while (profile_labels[slot].label != label) {
+        if (profile_labels[slot].label == NULL) {
+            fprintf(stderr, "ERROR: Dispatch to an unknown instruction %p.\n", label);
+            abort();
+        }
+        slot = (slot + 1) & (PROFILE_LABEL_SLOTS - 1);
+    }
+    return profile_labels[slot].instruction;
+}
+
+// The function whose threaded code 'ip' points into.
+static size_t profiled_function(const word_t *ip)
+{
+    for (size_t i = 0; i < profiled_program->function_count; i++) {
+        const struct function *fun = profiled_functions + i;
+        if (ip >= fun->code && ip < fun->code + fun->code_size) return i;
+    }
+    fprintf(stderr, "ERROR: Dispatch outside of the threaded code at %p.\n", (const void *) ip);
+    abort();
+}
+
+static struct profile *new_profile(void)
+{
+    size_t count = profiled_program->function_count;
+    struct profile *profile = checked_malloc(sizeof(struct profile), "the profile");
+    memset(profile, 0, sizeof(struct profile));
+    profile->calls = calloc(3 * count, sizeof(uint64_t));
+    if (profile->calls == NULL) {
+        fprintf(stderr, "ERROR: Out of memory for the profile.\n");
+        abort();
+    }
+    profile->function_samples = profile->calls + count;
+    profile->function_cycles = profile->calls + 2 * count;
+    profile->countdown = PROFILE_SAMPLE_PERIOD;
+    profile->sampled_instruction = NOT_SAMPLING;
+    pthread_mutex_lock(&profiles_lock);
+    profile->next = profiles;
+    profiles = profile;
+    pthread_mutex_unlock(&profiles_lock);
+    return profile;
+}
+
+static struct profile *current_profile(void)
+{
+    if (thread_profile == NULL) thread_profile = new_profile();
+    return thread_profile;
+}
+
+// Called with 'ip' at the instruction word about to be dispatched.
+static void profile_dispatch(const word_t *ip)
+{
+    struct profile *profile = current_profile();
+    if (profile->sampled_instruction != NOT_SAMPLING) {
+        uint64_t cycles = timestamp() - profile->sample_start;
+        profile->samples[profile->sampled_instruction]++;
+        profile->cycles[profile->sampled_instruction] += cycles;
+        profile->function_samples[profile->sampled_function]++;
+        profile->function_cycles[profile->sampled_function] += cycles;
+        profile->sampled_instruction = NOT_SAMPLING;
+    }
+    int instruction = profiled_instruction((const void *) *ip);
+    profile->dispatches[instruction]++;
+    if (--profile->countdown == 0) {
+        profile->countdown = PROFILE_SAMPLE_PERIOD;
+        profile->sampled_instruction = instruction;
+        profile->sampled_function = profiled_function(ip);
+        profile->sample_start = timestamp(); // last, so as not to time the profiler
+    }
+}
+
+#define PROFILE_CALL(index) (current_profile()->calls[index]++)
+// Where a run ends, the last instruction dispatching nothing to stop its timing.
+#define PROFILE_EXIT() (current_profile()->sampled_instruction = NOT_SAMPLING)
+
+struct profile_row {
+    const char *name;
+    uint64_t count;
+    uint64_t samples;
+    double estimated_cycles;
+};
+
+static int compare_profile_rows(const void *a, const void *b)
+{
+    double lhs = ((const struct profile_row *) a)->estimated_cycles;
+    double rhs = ((const struct profile_row *) b)->estimated_cycles;
+    return lhs < rhs ? 1 : lhs > rhs ? -1 : 0;
+}
+
+static void write_profile_rows(struct profile_row *rows, size_t count, const char *kind, const char *counted)
+{
+    double total = 0;
+    for (size_t i = 0; i < count; i++) {
+        total += rows[i].estimated_cycles;
+    }
+    qsort(rows, count, sizeof(struct profile_row), compare_profile_rows);
+    fprintf(stderr, "%-16s %14s %10s %14s %10s %7s\n", kind, counted, "samples", "cycles~", "cycles/1", "share");
+    for (size_t i = 0; i < count; i++) {
+        const struct profile_row *row = rows + i;
+        if (row->count == 0) continue;
+        fprintf(stderr, "%-16s %14llu %10llu %14.0f %10.2f %6.1f%%\n", row->name,
+            (unsigned long long) row->count, (unsigned long long) row->samples, row->estimated_cycles,
+            row->estimated_cycles / row->count, total > 0 ? 100 * row->estimated_cycles / total : 0);
+    }
+}
+
+/*
+    Sum the profiles of all threads and write them as two tables, most cycles first:
+
+        # fib: 6038396 dispatches on 1 thread, 1 in 101 timed, timer overhead 38 cycles
+        instruction          dispatches    samples        cycles~   cycles/1   share
+        CALL                     832039       8238       21442744      25.77   29.4%
+        ...
+        function                  calls    samples        cycles~   cycles/1   share
+        fib                      832040      59786      72972811      87.70  100.0%
+
+    Estimated cycles are the mean of the samples times the dispatch count for
+    instructions, and the sum of the samples times the sample period for functions,
+    which only count the instructions of their own code, not those of their callees.
+    Every sample includes the timer overhead, measured once by start_profile(): only
+    the differences between instructions are meaningful where it dominates.
+ */
+static void write_profile(void)
+{
+    size_t function_count = profiled_program->function_count;
+    struct profile_row instructions[INSTRUCTION_COUNT];
+    struct profile_row *functions = checked_malloc(function_count * sizeof(struct profile_row), "the profile");
+    uint64_t instruction_cycles[INSTRUCTION_COUNT] = { 0 };
+    memset(instructions, 0, sizeof(instructions));
+    memset(functions, 0, function_count * sizeof(struct profile_row));
+
+    size_t threads = 0;
+    uint64_t dispatches = 0;
+    pthread_mutex_lock(&profiles_lock);
+    for (const struct profile *profile = profiles; profile != NULL; profile = profile->next) {
+        threads++;
+        for (size_t i = 0; i < INSTRUCTION_COUNT; i++) {
+            instructions[i].count += profile->dispatches[i];
+            instructions[i].samples += profile->samples[i];
+            instruction_cycles[i] += profile->cycles[i];
+            dispatches += profile->dispatches[i];
+        }
+        for (size_t f = 0; f < function_count; f++) {
+            functions[f].count += profile->calls[f];
+            functions[f].samples += profile->function_samples[f];
+            functions[f].estimated_cycles += (double) profile->function_cycles[f] * PROFILE_SAMPLE_PERIOD;
+        }
+    }
+    pthread_mutex_unlock(&profiles_lock);
+    for (size_t i = 0; i < INSTRUCTION_COUNT; i++) {
+        instructions[i].name = instruction_name(i);
+        if (instructions[i].samples > 0) {
+            instructions[i].estimated_cycles
+                = (double) instruction_cycles[i] / instructions[i].samples * instructions[i].count;
+        }
+    }
+    for (size_t f = 0; f < function_count; f++) {
+        functions[f].name = profiled_program->functions[f].name;
+    }
+
+    fprintf(stderr, "# %s: %llu dispatches on %zu thread%s, 1 in %d timed, timer overhead %llu cycles\n",
+        profiled_program->name, (unsigned long long) dispatches, threads, threads == 1 ? "" : "s",
+        PROFILE_SAMPLE_PERIOD, (unsigned long long) timer_overhead);
+    write_profile_rows(instructions, INSTRUCTION_COUNT, "instruction", "dispatches");
+    write_profile_rows(functions, function_count, "function", "calls");
+    free(functions);
+}
+
+/*
+    Profile runs of 'program', loaded into 'functions' with 'labels' (of 'label_count'
+    instructions), writing the summary at exit. The loaded program must stay loaded
+    until then.
+ */
+MAYBE_UNUSED
+static void start_profile(
+    const struct program *program,
+    const struct function *functions,
+    void *const *labels,
+    size_t label_count)
+{
+    for (size_t i = 0; i < label_count; i++) {
+        if (labels[i] == NULL) continue;
+        size_t slot = profile_label_slot(labels[i]);
+        while (profile_labels[slot].label != NULL) slot = (slot + 1) & (PROFILE_LABEL_SLOTS - 1);
+        profile_labels[slot].label = labels[i];
+        profile_labels[slot].instruction = i;
+    }
+    profiled_program = program;
+    profiled_functions = functions;
+    timer_overhead = UINT64_MAX;
+    for (int i = 0; i < 1000; i++) {
+        uint64_t start = timestamp();
+        uint64_t cycles = timestamp() - start;
+        if (cycles < timer_overhead) timer_overhead = cycles;
+    }
+    atexit(write_profile);
+}
+
+#else
+
+#define PROFILE_CALL(index) ((void) 0)
+#define PROFILE_EXIT() ((void) 0)
+
+#endif
+
+#endif
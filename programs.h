@@ -0,0 +1,479 @@
+/*
+    Benchmark programs in the portable bytecode format of bytecode.h.
+ */
+
+#ifndef PROGRAMS_H
+#define PROGRAMS_H
+
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "bytecode.h"
+
+static const word_t fib_literals[] = {
+    2,
+    1
+};
+
+// The same fib_code as in wordcode2.c
+static const word_t fib_code[] = {
+    /*  0 */  LOAD, 0, // arg
+    /*  2 */  LIT, 0, // == 2
+    /*  4 */  PRIM, PRIM_LESS_THAN,
+    /*  6 */  JT, 24, // JT 30 = 6 + 24
+    /*  8 */  LOAD, 0, // arg
+    /* 10 */  LIT, 1, // == 1
+    /* 12 */  PRIM, PRIM_SUBTRACT,
+    /* 14 */  CALL, 0, 1, // fib, 1 arg
+    /* 17 */  LOAD, 0, // arg
+    /* 19 */  LIT, 0, // == 2
+    /* 21 */  PRIM, PRIM_SUBTRACT,
+    /* 23 */  CALL, 0, 1, // fib, 1 arg
+    /* 26 */  PRIM, PRIM_ADD,
+    /* 28 */  JMP, 4, // JMP 32 = 28 + 4
+    /* 30 */  LIT, 1, // == 1
+    /* 32 */  RET
+};
+
+static const struct bytecode_function fib_functions[] = {
+    {
+        .name = "fib",
+        .arity = 1,
+        .locals = 0,
+        .code = fib_code,
+        .code_size = COUNT_OF(fib_code),
+        .pure = true
+    }
+};
+
+MAYBE_UNUSED
+static const struct program fib_program = {
+    .name = "fib",
+    .functions = fib_functions,
+    .function_count = COUNT_OF(fib_functions),
+    .literals = fib_literals,
+    .literal_count = COUNT_OF(fib_literals)
+};
+
+// Takeuchi's function: tak(x, y, z) = y < x ? tak(tak(x - 1, y, z), tak(y - 1, z, x), tak(z - 1, x, y)) : z
+
+static const word_t tak_literals[] = {
+    1
+};
+
+static const word_t tak_code[] = {
+    /*  0 */  LOAD, 1, // y
+    /*  2 */  LOAD, 0, // x
+    /*  4 */  PRIM, PRIM_LESS_THAN,
+    /*  6 */  JT, 5, // JT 11 = 6 + 5
+    /*  8 */  LOAD, 2, // z
+    /* 10 */  RET,
+    /* 11 */  LOAD, 0, // x
+    /* 13 */  LIT, 0, // == 1
+    /* 15 */  PRIM, PRIM_SUBTRACT,
+    /* 17 */  LOAD, 1, // y
+    /* 19 */  LOAD, 2, // z
+    /* 21 */  CALL, 0, 3, // tak, 3 args
+    /* 24 */  LOAD, 1, // y
+    /* 26 */  LIT, 0, // == 1
+    /* 28 */  PRIM, PRIM_SUBTRACT,
+    /* 30 */  LOAD, 2, // z
+    /* 32 */  LOAD, 0, // x
+    /* 34 */  CALL, 0, 3, // tak, 3 args
+    /* 37 */  LOAD, 2, // z
+    /* 39 */  LIT, 0, // == 1
+    /* 41 */  PRIM, PRIM_SUBTRACT,
+    /* 43 */  LOAD, 0, // x
+    /* 45 */  LOAD, 1, // y
+    /* 47 */  CALL, 0, 3, // tak, 3 args
+    /* 50 */  CALL, 0, 3, // tak, 3 args
+    /* 53 */  RET
+};
+
+static const struct bytecode_function tak_functions[] = {
+    {
+        .name = "tak",
+        .arity = 3,
+        .locals = 0,
+        .code = tak_code,
+        .code_size = COUNT_OF(tak_code),
+        .pure = true
+    }
+};
+
+MAYBE_UNUSED
+static const struct program tak_program = {
+    .name = "tak",
+    .functions = tak_functions,
+    .function_count = COUNT_OF(tak_functions),
+    .literals = tak_literals,
+    .literal_count = COUNT_OF(tak_literals)
+};
+
+// Ackermann's function. Recursion depth is about the result, so keep it well under STACK_SIZE / 8.
+
+static const word_t ack_literals[] = {
+    1
+};
+
+static const word_t ack_code[] = {
+    /*  0 */  LOAD, 0, // m
+    /*  2 */  LIT, 0, // == 1
+    /*  4 */  PRIM, PRIM_LESS_THAN,
+    /*  6 */  JT, 31, // JT 37 = 6 + 31
+    /*  8 */  LOAD, 1, // n
+    /* 10 */  LIT, 0, // == 1
+    /* 12 */  PRIM, PRIM_LESS_THAN,
+    /* 14 */  JT, 30, // JT 44 = 14 + 30
+    /* 16 */  LOAD, 0, // m
+    /* 18 */  LIT, 0, // == 1
+    /* 20 */  PRIM, PRIM_SUBTRACT,
+    /* 22 */  LOAD, 0, // m
+    /* 24 */  LOAD, 1, // n
+    /* 26 */  LIT, 0, // == 1
+    /* 28 */  PRIM, PRIM_SUBTRACT,
+    /* 30 */  CALL, 0, 2, // ack, 2 args
+    /* 33 */  CALL, 0, 2, // ack, 2 args
+    /* 36 */  RET,
+    /* 37 */  LOAD, 1, // n
+    /* 39 */  LIT, 0, // == 1
+    /* 41 */  PRIM, PRIM_ADD,
+    /* 43 */  RET,
+    /* 44 */  LOAD, 0, // m
+    /* 46 */  LIT, 0, // == 1
+    /* 48 */  PRIM, PRIM_SUBTRACT,
+    /* 50 */  LIT, 0, // == 1
+    /* 52 */  CALL, 0, 2, // ack, 2 args
+    /* 55 */  RET
+};
+
+static const struct bytecode_function ack_functions[] = {
+    {
+        .name = "ack",
+        .arity = 2,
+        .locals = 0,
+        .code = ack_code,
+        .code_size = COUNT_OF(ack_code),
+        .pure = true
+    }
+};
+
+MAYBE_UNUSED
+static const struct program ack_program = {
+    .name = "ack",
+    .functions = ack_functions,
+    .function_count = COUNT_OF(ack_functions),
+    .literals = ack_literals,
+    .literal_count = COUNT_OF(ack_literals)
+};
+
+// The sum of 0 .. n - 1 in a counted loop.
+
+static const word_t loop_literals[] = {
+    0,
+    1
+};
+
+static const word_t loop_code[] = {
+    /*  0 */  LIT, 0, // == 0
+    /*  2 */  STORE, 1, // sum
+    /*  4 */  LIT, 0, // == 0
+    /*  6 */  STORE, 2, // i
+    /*  8 */  LOAD, 2, // i
+    /* 10 */  LOAD, 0, // n
+    /* 12 */  PRIM, PRIM_LESS_THAN,
+    /* 14 */  JT, 5, // JT 19 = 14 + 5
+    /* 16 */  LOAD, 1, // sum
+    /* 18 */  RET,
+    /* 19 */  LOAD, 1, // sum
+    /* 21 */  LOAD, 2, // i
+    /* 23 */  PRIM, PRIM_ADD,
+    /* 25 */  STORE, 1, // sum
+    /* 27 */  LOAD, 2, // i
+    /* 29 */  LIT, 1, // == 1
+    /* 31 */  PRIM, PRIM_ADD,
+    /* 33 */  STORE, 2, // i
+    /* 35 */  JMP, -27 // JMP 8 = 35 - 27
+};
+
+static const struct bytecode_function loop_functions[] = {
+    {
+        .name = "loop",
+        .arity = 1,
+        .locals = 2,
+        .code = loop_code,
+        .code_size = COUNT_OF(loop_code)
+    }
+};
+
+MAYBE_UNUSED
+static const struct program loop_program = {
+    .name = "loop",
+    .functions = loop_functions,
+    .function_count = COUNT_OF(loop_functions),
+    .literals = loop_literals,
+    .literal_count = COUNT_OF(loop_literals)
+};
+
+// The sum of i + j for all 0 <= i, j < n, in two nested loops.
+
+static const word_t nested_literals[] = {
+    0,
+    1
+};
+
+static const word_t nested_code[] = {
+    /*  0 */  LIT, 0, // == 0
+    /*  2 */  STORE, 1, // sum
+    /*  4 */  LIT, 0, // == 0
+    /*  6 */  STORE, 2, // i
+    /*  8 */  LOAD, 2, // i
+    /* 10 */  LOAD, 0, // n
+    /* 12 */  PRIM, PRIM_LESS_THAN,
+    /* 14 */  JT, 5, // JT 19 = 14 + 5
+    /* 16 */  LOAD, 1, // sum
+    /* 18 */  RET,
+    /* 19 */  LIT, 0, // == 0
+    /* 21 */  STORE, 3, // j
+    /* 23 */  LOAD, 3, // j
+    /* 25 */  LOAD, 0, // n
+    /* 27 */  PRIM, PRIM_LESS_THAN,
+    /* 29 */  JT, 12, // JT 41 = 29 + 12
+    /* 31 */  LOAD, 2, // i
+    /* 33 */  LIT, 1, // == 1
+    /* 35 */  PRIM, PRIM_ADD,
+    /* 37 */  STORE, 2, // i
+    /* 39 */  JMP, -31, // JMP 8 = 39 - 31
+    /* 41 */  LOAD, 1, // sum
+    /* 43 */  LOAD, 2, // i
+    /* 45 */  PRIM, PRIM_ADD,
+    /* 47 */  LOAD, 3, // j
+    /* 49 */  PRIM, PRIM_ADD,
+    /* 51 */  STORE, 1, // sum
+    /* 53 */  LOAD, 3, // j
+    /* 55 */  LIT, 1, // == 1
+    /* 57 */  PRIM, PRIM_ADD,
+    /* 59 */  STORE, 3, // j
+    /* 61 */  JMP, -38 // JMP 23 = 61 - 38
+};
+
+static const struct bytecode_function nested_functions[] = {
+    {
+        .name = "nested",
+        .arity = 1,
+        .locals = 3,
+        .code = nested_code,
+        .code_size = COUNT_OF(nested_code)
+    }
+};
+
+MAYBE_UNUSED
+static const struct program nested_program = {
+    .name = "nested",
+    .functions = nested_functions,
+    .function_count = COUNT_OF(nested_functions),
+    .literals = nested_literals,
+    .literal_count = COUNT_OF(nested_literals)
+};
+
+// The number of primes below n, using the sieve of Eratosthenes.
+
+static const word_t sieve_literals[] = {
+    0,
+    1,
+    2
+};
+
+static const word_t sieve_code[] = {
+    /*  0 */  LOAD, 0, // n
+    /*  2 */  PRIM, PRIM_NEW_ARRAY,
+    /*  4 */  STORE, 1, // flags
+    /*  6 */  LIT, 0, // == 0
+    /*  8 */  STORE, 2, // count
+    /* 10 */  LIT, 2, // == 2
+    /* 12 */  STORE, 3, // i
+    /* 14 */  LOAD, 3, // i
+    /* 16 */  LOAD, 0, // n
+    /* 18 */  PRIM, PRIM_LESS_THAN,
+    /* 20 */  JT, 9, // JT 29 = 20 + 9
+    /* 22 */  LOAD, 1, // flags
+    /* 24 */  PRIM, PRIM_FREE_ARRAY,
+    /* 26 */  LOAD, 2, // count
+    /* 28 */  RET,
+    /* 29 */  LOAD, 1, // flags
+    /* 31 */  LOAD, 3, // i
+    /* 33 */  PRIM, PRIM_AT,
+    /* 35 */  JT, 46, // JT 81 = 35 + 46
+    /* 37 */  LOAD, 2, // count
+    /* 39 */  LIT, 1, // == 1
+    /* 41 */  PRIM, PRIM_ADD,
+    /* 43 */  STORE, 2, // count
+    /* 45 */  LOAD, 3, // i
+    /* 47 */  LOAD, 3, // i
+    /* 49 */  PRIM, PRIM_ADD,
+    /* 51 */  STORE, 4, // j
+    /* 53 */  LOAD, 4, // j
+    /* 55 */  LOAD, 0, // n
+    /* 57 */  PRIM, PRIM_LESS_THAN,
+    /* 59 */  JT, 4, // JT 63 = 59 + 4
+    /* 61 */  JMP, 20, // JMP 81 = 61 + 20
+    /* 63 */  LOAD, 1, // flags
+    /* 65 */  LOAD, 4, // j
+    /* 67 */  LIT, 1, // == 1
+    /* 69 */  PRIM, PRIM_AT_PUT,
+    /* 71 */  LOAD, 4, // j
+    /* 73 */  LOAD, 3, // i
+    /* 75 */  PRIM, PRIM_ADD,
+    /* 77 */  STORE, 4, // j
+    /* 79 */  JMP, -26, // JMP 53 = 79 - 26
+    /* 81 */  LOAD, 3, // i
+    /* 83 */  LIT, 1, // == 1
+    /* 85 */  PRIM, PRIM_ADD,
+    /* 87 */  STORE, 3, // i
+    /* 89 */  JMP, -75 // JMP 14 = 89 - 75
+};
+
+static const struct bytecode_function sieve_functions[] = {
+    {
+        .name = "sieve",
+        .arity = 1,
+        .locals = 4,
+        .code = sieve_code,
+        .code_size = COUNT_OF(sieve_code)
+    }
+};
+
+MAYBE_UNUSED
+static const struct program sieve_program = {
+    .name = "sieve",
+    .functions = sieve_functions,
+    .function_count = COUNT_OF(sieve_functions),
+    .literals = sieve_literals,
+    .literal_count = COUNT_OF(sieve_literals)
+};
+
+// A script for the schedulers of scheduler.h, not a benchmark: the sum of 0 .. n - 1,
+// yielding on every iteration. Engines without a scheduler leave the YIELD out.
+
+static const word_t ticker_literals[] = {
+    0,
+    1
+};
+
+static const word_t ticker_code[] = {
+    /*  0 */  LIT, 0, // == 0
+    /*  2 */  STORE, 1, // sum
+    /*  4 */  LIT, 0, // == 0
+    /*  6 */  STORE, 2, // i
+    /*  8 */  LOAD, 2, // i
+    /* 10 */  LOAD, 0, // n
+    /* 12 */  PRIM, PRIM_LESS_THAN,
+    /* 14 */  JT, 5, // JT 19 = 14 + 5
+    /* 16 */  LOAD, 1, // sum
+    /* 18 */  RET,
+    /* 19 */  LOAD, 1, // sum
+    /* 21 */  LOAD, 2, // i
+    /* 23 */  PRIM, PRIM_ADD,
+    /* 25 */  STORE, 1, // sum
+    /* 27 */  LOAD, 2, // i
+    /* 29 */  LIT, 1, // == 1
+    /* 31 */  PRIM, PRIM_ADD,
+    /* 33 */  STORE, 2, // i
+    /* 35 */  YIELD,
+    /* 36 */  JMP, -28 // JMP 8 = 36 - 28
+};
+
+static const struct bytecode_function ticker_functions[] = {
+    {
+        .name = "ticker",
+        .arity = 1,
+        .locals = 2,
+        .code = ticker_code,
+        .code_size = COUNT_OF(ticker_code)
+    }
+};
+
+MAYBE_UNUSED
+static const struct program ticker_program = {
+    .name = "ticker",
+    .functions = ticker_functions,
+    .function_count = COUNT_OF(ticker_functions),
+    .literals = ticker_literals,
+    .literal_count = COUNT_OF(ticker_literals)
+};
+
+/*
+    The benchmark suite: each program with the args it is run with by default
+    and the expected result for those args.
+ */
+
+#define MAX_BENCHMARK_ARGS 3
+
+struct benchmark {
+    const struct program *program;
+    word_t args[MAX_BENCHMARK_ARGS];
+    word_t expected;
+};
+
+MAYBE_UNUSED
+static const struct benchmark benchmarks[] = {
+    { &fib_program, { 27 }, 317811 },
+    { &tak_program, { 24, 16, 8 }, 9 },
+    { &ack_program, { 3, 8 }, 2045 },
+    { &loop_program, { 10000000 }, 49999995000000 },
+    { &nested_program, { 3000 }, 26991000000 },
+    { &sieve_program, { 1000000 }, 78498 }
+};
+
+#define BENCHMARK_COUNT COUNT_OF(benchmarks)
+
+MAYBE_UNUSED
+static const struct benchmark *find_benchmark(const char *name)
+{
+    for (size_t i = 0; i < BENCHMARK_COUNT; i++) {
+        if (strcmp(benchmarks[i].program->name, name) == 0) return benchmarks + i;
+    }
+    return NULL;
+}
+
+// Parse 'text' as a whole decimal number. Return false if it is empty or not a number.
+MAYBE_UNUSED
+static bool parse_word(const char *text, word_t *word)
+{
+    char *end;
+    *word = strtoull(text, &end, 10);
+    return end != text && *end == '\0';
+}
+
+/*
+    Parse the command line of an engine: either a single number, to run fib on it,
+    or the name of a benchmark program followed by either all or none of its args.
+    Return false if the command line is not valid.
+ */
+MAYBE_UNUSED
+static bool parse_program_args(int argc, const char *argv[], const struct program **program, word_t *args)
+{
+    if (argc < 2) return false;
+    word_t number;
+    if (parse_word(argv[1], &number) && argc == 2) {
+        *program = &fib_program;
+        args[0] = number;
+        return true;
+    }
+    const struct benchmark *benchmark = find_benchmark(argv[1]);
+    if (benchmark == NULL) return false;
+    size_t arity = benchmark->program->functions[0].arity;
+    *program = benchmark->program;
+    if (argc == 2) {
+        memcpy(args, benchmark->args, arity * sizeof(word_t));
+        return true;
+    }
+    if ((size_t) argc - 2 != arity) return false;
+    for (size_t i = 0; i < arity; i++) {
+        if (!parse_word(argv[i + 2], args + i)) return false;
+    }
+    return true;
+}
+
+#endif
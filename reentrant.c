@@ -0,0 +1,577 @@
+/*
+    Derived from tailcall.c:
+
+        Reentrant: the interpreter has no mutable state outside of a context (see
+        context.h), so any number of threads can run programs at the same time, each
+        in its own context, sharing the images of loaded programs.
+
+        tailcall.c already keeps the whole interpreter state in the handler arguments,
+        so the only change is that the stack belongs to the context instead of being a
+        static array. The instruction labels are function addresses, the same for all
+        threads, and loaded code is only read.
+
+        run_program() for the harness runs in a single context of its own, so unlike
+        the other entry points it is not reentrant.
+
+        Stacks still have no bounds checks in the handlers. Each is a range of address
+        space mapped with mmap(), as big as the context's stack size, of which only the
+        first INITIAL_STACK_BYTES are accessible at first, followed by a guard page. A
+        SIGSEGV handler grows the accessible part when the stack runs into the rest, and
+        aborts the run when it runs into the guard page, making run_image() return false.
+        Growing needs no copying, the stack never moving. The loader makes sure no frame
+        is big enough to jump over the guard page.
+
+        Built with PROFILE_DISPATCH (the reentrant_dispatch_profile target), it counts
+        dispatches and samples cycles per instruction and function, per thread, and
+        writes the totals to stderr at exit (see profile.h).
+
+    Observations (GCC 12, Clang was not available):
+
+        - Same single-thread performance as tailcall.
+        - scaling could only be run on a single-CPU machine, where throughput stays flat
+          from 1 to 4 threads: time-slicing the contexts costs nothing measurable.
+          The per-core scaling is yet to be measured on a multi-core machine.
+        - The guard page leaves the handlers instruction for instruction the same as
+          those of tailcall. ack(3, 12) grows its stack to ~300 KiB; with
+          VM_STACK_SIZE=10000 (words) in the environment, ack(3, 8) stops with an error.
+
+ */
+
+#include <pthread.h>
+#include <setjmp.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "bytecode.h"
+#include "context.h"
+#include "harness.h"
+#include "loader.h"
+#include "profile.h"
+#include "programs.h"
+
+// #define TRACE
+
+#if defined(__has_attribute)
+    #if __has_attribute(musttail)
+        #define MUSTTAIL __attribute__((musttail))
+    #endif
+#endif
+#ifndef MUSTTAIL
+    #define MUSTTAIL
+#endif
+
+#define STACK_SIZE (1 << 24) // the most a stack can grow to by default, in words
+#define INITIAL_STACK_BYTES (64 * 1024)
+
+typedef word_t *(*prim_handler_t)(word_t *sp);
+
+static word_t *lessThan(word_t *sp)
+{
+    int64_t rhs = *(--sp);
+    int64_t lhs = *(--sp);
+    bool result = lhs < rhs;
+    #ifdef TRACE
+        printf("%lld < %lld => %s\n", (long long) lhs, (long long) rhs, result ? "true" : "false");
+    #endif
+    *(sp++) = result;
+    return sp;
+}
+
+static word_t *subtract(word_t *sp)
+{
+    int64_t rhs = *(--sp);
+    int64_t lhs = *(--sp);
+    int64_t result = lhs - rhs;
+    #ifdef TRACE
+        printf("%lld - %lld => %lld\n", (long long) lhs, (long long) rhs, (long long) result);
+    #endif
+    *(sp++) = result;
+    return sp;
+}
+
+static word_t *add(word_t *sp)
+{
+    int64_t rhs = *(--sp);
+    int64_t lhs = *(--sp);
+    int64_t result = lhs + rhs;
+    #ifdef TRACE
+        printf("%lld + %lld => %lld\n", (long long) lhs, (long long) rhs, (long long) result);
+    #endif
+    *(sp++) = result;
+    return sp;
+}
+
+static word_t *newArray(word_t *sp)
+{
+    word_t size = *(--sp);
+    word_t *array = calloc(size, sizeof(word_t));
+    if (array == NULL) {
+        fprintf(stderr, "ERROR: Cannot allocate an array of %llu words.\n", (unsigned long long) size);
+        abort();
+    }
+    #ifdef TRACE
+        printf("newArray %llu => %p\n", (unsigned long long) size, (void *) array);
+    #endif
+    *(sp++) = (word_t) array;
+    return sp;
+}
+
+static word_t *at(word_t *sp)
+{
+    word_t index = *(--sp);
+    word_t *array = (word_t *) *(--sp);
+    #ifdef TRACE
+        printf("%p at %llu => %llu\n", (void *) array, (unsigned long long) index, (unsigned long long) array[index]);
+    #endif
+    *(sp++) = array[index];
+    return sp;
+}
+
+static word_t *atPut(word_t *sp)
+{
+    word_t value = *(--sp);
+    word_t index = *(--sp);
+    word_t *array = (word_t *) *(--sp);
+    #ifdef TRACE
+        printf("%p at %llu put %llu\n", (void *) array, (unsigned long long) index, (unsigned long long) value);
+    #endif
+    array[index] = value;
+    return sp;
+}
+
+static word_t *freeArray(word_t *sp)
+{
+    free((word_t *) *(--sp));
+    return sp;
+}
+
+static const prim_handler_t prim_handlers[] = {
+    [PRIM_LESS_THAN] = lessThan,
+    [PRIM_SUBTRACT] = subtract,
+    [PRIM_ADD] = add,
+    [PRIM_NEW_ARRAY] = newArray,
+    [PRIM_AT] = at,
+    [PRIM_AT_PUT] = atPut,
+    [PRIM_FREE_ARRAY] = freeArray
+};
+
+// 'ip' points past the instruction word, at the operands if any.
+typedef word_t (*handler_t)(word_t *ip, word_t *sp, word_t *bp, const struct function *functions);
+
+#define HANDLER(name) static word_t handle_##name(word_t *ip, word_t *sp, word_t *bp, const struct function *functions)
+#ifdef PROFILE_DISPATCH
+    #define NEXT() do { \
+            profile_dispatch(ip); \
+            COUNT_DISPATCH(); \
+            MUSTTAIL return ((handler_t) *ip)(ip + 1, sp, bp, functions); \
+        } while (0)
+#else
+    #define NEXT() do { \
+            COUNT_DISPATCH(); \
+            MUSTTAIL return ((handler_t) *ip)(ip + 1, sp, bp, functions); \
+        } while (0)
+#endif
+#define PUSH(expr) *sp++ = expr
+#define POP() *--sp
+#define FETCH() *ip++
+
+HANDLER(LIT)
+{
+    word_t word = FETCH();
+    #ifdef TRACE
+        printf("LIT %lld\n", (long long) word);
+    #endif
+    PUSH(word);
+    NEXT();
+}
+
+HANDLER(CONST_0)
+{
+    PUSH(0);
+    NEXT();
+}
+
+HANDLER(CONST_1)
+{
+    PUSH(1);
+    NEXT();
+}
+
+HANDLER(CONST_2)
+{
+    PUSH(2);
+    NEXT();
+}
+
+HANDLER(SUB1)
+{
+    *((int64_t *)(sp - 1)) -= 1;
+    NEXT();
+}
+
+HANDLER(SUB2)
+{
+    *((int64_t *)(sp - 1)) -= 2;
+    NEXT();
+}
+
+HANDLER(ADD1)
+{
+    *((int64_t *)(sp - 1)) += 1;
+    NEXT();
+}
+
+HANDLER(LOAD)
+{
+    int64_t offset = FETCH();
+    #ifdef TRACE
+        printf("LOAD %lld\n", (long long) offset);
+    #endif
+    PUSH(*(bp + offset));
+    NEXT();
+}
+
+HANDLER(STORE)
+{
+    int64_t offset = FETCH();
+    #ifdef TRACE
+        printf("STORE %lld\n", (long long) offset);
+    #endif
+    *(bp + offset) = POP();
+    NEXT();
+}
+
+HANDLER(CALL)
+{
+    const struct function *fun = functions + FETCH(); // function ID
+    PROFILE_CALL(fun - functions);
+    word_t word = FETCH();
+    #ifdef TRACE
+        printf("CALL %lld\n", (long long) word);
+    #endif
+
+    // push frame
+    word_t *words = bp;
+    bp = sp;
+    PUSH((word_t) words);
+    PUSH((word_t) ip);
+    PUSH(word); // args to pop later
+
+    sp += fun->frame_size;
+    ip = fun->code;
+    NEXT();
+}
+
+HANDLER(PRIM)
+{
+    word_t word = FETCH();
+    #ifdef TRACE
+        printf("PRIM %lld\n", (long long) word);
+    #endif
+    sp = prim_handlers[word](sp);
+    NEXT();
+}
+
+HANDLER(JT)
+{
+    int64_t offset = FETCH();
+    word_t word = POP();
+    #ifdef TRACE
+        printf("JT %lld (%lld)\n", (long long) offset, (long long) word);
+    #endif
+    if (word) {
+        ip = ip + offset - 2;
+    }
+    NEXT();
+}
+
+HANDLER(JMP)
+{
+    int64_t offset = FETCH();
+    #ifdef TRACE
+        printf("JMP %lld\n", (long long) offset);
+    #endif
+    ip = ip + offset - 2;
+    NEXT();
+}
+
+HANDLER(RET)
+{
+    word_t word = POP();
+    #ifdef TRACE
+        printf("RET %lld\n", (long long) word);
+    #endif
+
+    // pop_frame
+    sp = bp + 3;
+    word_t word2 = POP(); // args to pop
+    ip = (word_t *) POP();
+    bp = (word_t *) POP();
+    sp -= word2;
+
+    if (ip == NULL) {
+        PROFILE_EXIT();
+        return word;
+    }
+    PUSH(word);
+    NEXT();
+}
+
+// Passed to the loader.
+static void *const instruction_labels[INSTRUCTION_COUNT] = {
+    [LIT] = (void *) handle_LIT,
+    [LOAD] = (void *) handle_LOAD,
+    [CALL] = (void *) handle_CALL,
+    [PRIM] = (void *) handle_PRIM,
+    [JT] = (void *) handle_JT,
+    [JMP] = (void *) handle_JMP,
+    [RET] = (void *) handle_RET,
+    [STORE] = (void *) handle_STORE,
+    [CONST_0] = (void *) handle_CONST_0,
+    [CONST_1] = (void *) handle_CONST_1,
+    [CONST_2] = (void *) handle_CONST_2,
+    [SUB1] = (void *) handle_SUB1,
+    [SUB2] = (void *) handle_SUB2,
+    [ADD1] = (void *) handle_ADD1
+};
+
+struct image {
+    const struct program *program;
+    struct function *functions;
+};
+
+struct context {
+    word_t *stack;
+    size_t stack_size; // the most words the stack can grow to
+    size_t committed; // bytes readable and writable from 'stack' on
+    size_t reserved; // bytes from 'stack' to the guard page
+    size_t guard; // bytes of the guard page
+    sigjmp_buf overflow; // where to go on hitting the guard page
+};
+
+// The context running on this thread, for the SIGSEGV handler.
+static _Thread_local struct context *running_context;
+
+static struct sigaction previous_action;
+static pthread_once_t handler_installed = PTHREAD_ONCE_INIT;
+
+// Round 'size' up to a whole number of cache lines.
+static size_t cache_lines(size_t size)
+{
+    return (size + CACHE_LINE_SIZE - 1) / CACHE_LINE_SIZE * CACHE_LINE_SIZE;
+}
+
+static size_t pages(size_t size)
+{
+    size_t page = sysconf(_SC_PAGESIZE);
+    return (size + page - 1) / page * page;
+}
+
+static void *checked_aligned_alloc(size_t size, const char *what)
+{
+    void *memory = aligned_alloc(CACHE_LINE_SIZE, cache_lines(size));
+    if (memory == NULL) {
+        fprintf(stderr, "ERROR: Out of memory for %s.\n", what);
+        exit(1);
+    }
+    return memory;
+}
+
+/*
+    Stack accesses past the committed part of the running context's stack fault here:
+    in the reserved part, the committed part doubles (or more, to cover the address)
+    and the faulting access is retried; in the guard page, the run is abandoned with
+    a long jump to run_image(). Faults anywhere else are none of ours, and go to
+    whatever handled them before.
+ */
+static void handle_segv(int signo, siginfo_t *info, void *ucontext)
+{
+    struct context *context = running_context;
+    uint8_t *address = info->si_addr;
+    uint8_t *base = context ? (uint8_t *) context->stack : NULL;
+    if (context != NULL && address >= base + context->committed && address < base + context->reserved) {
+        size_t committed = context->committed * 2;
+        while (base + committed <= address) committed *= 2;
+        committed = pages(committed);
+        if (committed > context->reserved) committed = context->reserved;
+        if (mprotect(base + context->committed, committed - context->committed, PROT_READ | PROT_WRITE) == 0) {
+            context->committed = committed;
+            return;
+        }
+        siglongjmp(context->overflow, 1); // out of memory: as good as an overflow
+    }
+    if (context != NULL && address >= base + context->reserved && address < base + context->reserved + context->guard) {
+        siglongjmp(context->overflow, 1);
+    }
+    if (previous_action.sa_flags & SA_SIGINFO) {
+        previous_action.sa_sigaction(signo, info, ucontext);
+    } else if (previous_action.sa_handler != SIG_DFL && previous_action.sa_handler != SIG_IGN) {
+        previous_action.sa_handler(signo);
+    } else {
+        // Returning retries the access, which faults again, this time fatally.
+        sigaction(signo, &previous_action, NULL);
+    }
+}
+
+static void install_handler(void)
+{
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_sigaction = handle_segv;
+    action.sa_flags = SA_SIGINFO;
+    sigemptyset(&action.sa_mask);
+    if (sigaction(SIGSEGV, &action, &previous_action) != 0) {
+        fprintf(stderr, "ERROR: Cannot install the stack overflow handler.\n");
+        exit(1);
+    }
+}
+
+struct image *load_image(const struct program *program)
+{
+    struct image *image = checked_malloc(sizeof(struct image), program->name);
+    image->program = program;
+    image->functions = load_program(program, instruction_labels);
+    // A frame bigger than the guard page could skip over it.
+    size_t guard = pages(1);
+    for (size_t i = 0; i < program->function_count; i++) {
+        if ((FRAME_HEADER_SIZE + image->functions[i].frame_size) * sizeof(word_t) >= guard) {
+            load_error(program->functions + i, 0, "Frame too big for the stack guard page");
+        }
+    }
+    return image;
+}
+
+void free_image(struct image *image)
+{
+    free_program(image->functions, image->program->function_count);
+    free(image);
+}
+
+struct context *new_context(size_t stack_size)
+{
+    pthread_once(&handler_installed, install_handler);
+    struct context *context = checked_aligned_alloc(sizeof(struct context), "a context");
+    context->stack_size = stack_size;
+    context->reserved = pages(stack_size * sizeof(word_t));
+    context->guard = pages(1);
+    context->committed = context->reserved < INITIAL_STACK_BYTES ? context->reserved : pages(INITIAL_STACK_BYTES);
+    // Reserve the whole stack and its guard page, then commit the initial part.
+    void *stack = mmap(NULL, context->reserved + context->guard, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (stack == MAP_FAILED || mprotect(stack, context->committed, PROT_READ | PROT_WRITE) != 0) {
+        fprintf(stderr, "ERROR: Cannot map a stack of %zu words.\n", stack_size);
+        exit(1);
+    }
+    context->stack = stack;
+    return context;
+}
+
+void free_context(struct context *context)
+{
+    munmap(context->stack, context->reserved + context->guard);
+    free(context);
+}
+
+bool run_image(struct context *context, const struct image *image, const uint64_t *args, uint64_t *result)
+{
+    const struct function *functions = image->functions;
+    const struct function *entry = functions;
+    word_t *ip = entry->code;
+    word_t *sp = context->stack;
+    word_t *bp;
+
+    running_context = context;
+    if (sigsetjmp(context->overflow, 1) != 0) {
+        running_context = NULL;
+        return false;
+    }
+
+    for (size_t i = 0; i < entry->arity; i++) {
+        PUSH(args[i]);
+    }
+    bp = sp; // the args notionally are in the callee frame
+    PUSH(0); // no prev. BP
+    PUSH(0); // no prev. IP
+    PUSH(0); // no args
+    sp += entry->frame_size;
+    PROFILE_CALL(entry - functions);
+
+    #ifdef PROFILE_DISPATCH
+        profile_dispatch(ip);
+    #endif
+    COUNT_DISPATCH();
+    *result = ((handler_t) *ip)(ip + 1, sp, bp, functions);
+    running_context = NULL;
+    return true;
+}
+
+// Uses the default superinstructions table. The program is loaded on first use, and
+// reloaded when a different one is run.
+uint64_t run_program(const struct program *program, const uint64_t *args)
+{
+    static struct context *context;
+    static struct image *image;
+    if (context == NULL) context = new_context(STACK_SIZE);
+    if (image == NULL || image->program != program) {
+        if (image != NULL) free_image(image);
+        image = load_image(program);
+    }
+    uint64_t result;
+    if (!run_image(context, image, args, &result)) {
+        fprintf(stderr, "ERROR: %s overflowed its stack of %d words.\n", program->name, STACK_SIZE);
+        exit(1);
+    }
+    return result;
+}
+
+uint64_t run(uint64_t arg)
+{
+    return run_program(&fib_program, &arg);
+}
+
+#ifndef HARNESS
+int main(int argc, const char *argv[])
+{
+    const struct program *program;
+    word_t args[MAX_BENCHMARK_ARGS];
+    if (!parse_program_args(argc, argv, &program, args)) {
+        fprintf(stderr, "Usage: %s <n> | <program> [args...]\n", argv[0]);
+        return 1;
+    }
+    #ifdef PROFILE_DISPATCH
+        printf("reentrant (dispatch profile)\n");
+    #else
+        printf("reentrant\n");
+    #endif
+
+    const char *stack_size = getenv("VM_STACK_SIZE");
+    size_t size = stack_size ? strtoull(stack_size, NULL, 10) : STACK_SIZE;
+    struct image *image = load_image(program);
+    struct context *context = new_context(size);
+#ifdef PROFILE_DISPATCH
+    start_profile(program, image->functions, instruction_labels, INSTRUCTION_COUNT);
+#endif
+
+    clock_t start = clock();
+    word_t result;
+    bool done = run_image(context, image, args, &result);
+    clock_t end = clock();
+    long ms = (end - start) / (CLOCKS_PER_SEC / 1000);
+    if (!done) {
+        fprintf(stderr, "ERROR: Stack overflow (%zu words) after %ld ms.\n", size, ms);
+        return 1;
+    }
+
+    printf("Done in %ld ms\n", ms);
+    printf("=> %lld\n", (long long) result);
+
+    free_context(context);
+    free_image(image);
+}
+#endif
@@ -0,0 +1,321 @@
+/*
+    Derived from threaded.c:
+
+        A register machine instead of a stack machine. The loader (regloader.h)
+        translates the same portable stack bytecode into three-address instructions
+        naming frame slots, so fib's
+
+            LOAD 0; LIT 2; PRIM lessThan; JT 30
+
+        becomes
+
+            R_LT_RK t0, r0, 2; R_JT t0, 30
+
+        There is no stack pointer any more, only BP pointing at register 0 of the
+        frame. Frames overlap: a callee's frame starts at the caller's register
+        holding its first arg, and its result replaces that arg, so args are neither
+        copied nor popped. Return addresses and caller BPs live on a separate return
+        stack instead of in a frame header.
+
+        Primitives other than lessThan, subtract and add, which have three-address
+        instructions, go through R_PRIM and take their operands from consecutive
+        registers, leaving the result in the first one.
+
+    Observations (GCC 12, Clang was not available):
+
+        - fib(27): 5.0 dispatches per call instead of 7.3 with comboinstructions2
+          (threaded2) and 8.0 with threaded, and 5.3 ns per call instead of 11.4 ns:
+          2x faster than comboinstructions2. Instructions are fatter but none of
+          them moves a stack pointer.
+        - 1.5-3x faster than tos2 on the other programs; loop and nested dispatch
+          2.4x less, since arithmetic results are computed straight into locals.
+
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "bytecode.h"
+#include "harness.h"
+#include "programs.h"
+#include "regloader.h"
+
+// #define TRACE
+
+#define STACK_SIZE (1 << 16) // deep enough for ack(3, 8)
+static word_t stack[STACK_SIZE];
+
+struct return_frame {
+    word_t *ip;
+    word_t *bp;
+};
+
+static struct return_frame return_stack[STACK_SIZE];
+
+typedef void (*prim_handler_t)(word_t *operands);
+
+static void lessThan(word_t *operands)
+{
+    operands[0] = (int64_t) operands[0] < (int64_t) operands[1];
+}
+
+static void subtract(word_t *operands)
+{
+    operands[0] = (int64_t) operands[0] - (int64_t) operands[1];
+}
+
+static void add(word_t *operands)
+{
+    operands[0] = (int64_t) operands[0] + (int64_t) operands[1];
+}
+
+static void newArray(word_t *operands)
+{
+    word_t size = operands[0];
+    word_t *array = calloc(size, sizeof(word_t));
+    if (array == NULL) {
+        fprintf(stderr, "ERROR: Cannot allocate an array of %llu words.\n", (unsigned long long) size);
+        abort();
+    }
+    #ifdef TRACE
+        printf("newArray %llu => %p\n", (unsigned long long) size, (void *) array);
+    #endif
+    operands[0] = (word_t) array;
+}
+
+static void at(word_t *operands)
+{
+    word_t *array = (word_t *) operands[0];
+    word_t index = operands[1];
+    #ifdef TRACE
+        printf("%p at %llu => %llu\n", (void *) array, (unsigned long long) index, (unsigned long long) array[index]);
+    #endif
+    operands[0] = array[index];
+}
+
+static void atPut(word_t *operands)
+{
+    word_t *array = (word_t *) operands[0];
+    word_t index = operands[1];
+    word_t value = operands[2];
+    #ifdef TRACE
+        printf("%p at %llu put %llu\n", (void *) array, (unsigned long long) index, (unsigned long long) value);
+    #endif
+    array[index] = value;
+}
+
+static void freeArray(word_t *operands)
+{
+    free((word_t *) operands[0]);
+}
+
+static prim_handler_t prim_handlers[] = {
+    [PRIM_LESS_THAN] = lessThan,
+    [PRIM_SUBTRACT] = subtract,
+    [PRIM_ADD] = add,
+    [PRIM_NEW_ARRAY] = newArray,
+    [PRIM_AT] = at,
+    [PRIM_AT_PUT] = atPut,
+    [PRIM_FREE_ARRAY] = freeArray
+};
+
+#define GOTO_NEXT do { COUNT_DISPATCH(); goto *((void*) *ip++); } while (0)
+#define FETCH() *ip++
+#define R(operand) bp[operand]
+
+// Set up by calling execute() with no functions. Passed to the loader.
+static void *const *instruction_labels;
+
+static word_t execute(const struct function *functions, const struct function *entry, const word_t *args)
+{
+    static void *const labels[REGISTER_INSTRUCTION_COUNT] = {
+        [R_MOV] = &&R_MOV,
+        [R_MOVK] = &&R_MOVK,
+        [R_ADD_RR] = &&R_ADD_RR,
+        [R_ADD_RK] = &&R_ADD_RK,
+        [R_SUB_RR] = &&R_SUB_RR,
+        [R_SUB_RK] = &&R_SUB_RK,
+        [R_LT_RR] = &&R_LT_RR,
+        [R_LT_RK] = &&R_LT_RK,
+        [R_JT] = &&R_JT,
+        [R_JMP] = &&R_JMP,
+        [R_CALL] = &&R_CALL,
+        [R_RET] = &&R_RET,
+        [R_PRIM] = &&R_PRIM
+    };
+
+    if (functions == NULL) {
+        instruction_labels = labels;
+        return 0;
+    }
+
+    // Interpreter state
+
+    word_t *ip = entry->code;
+    word_t *bp = stack;
+    struct return_frame *rsp = return_stack;
+
+    word_t dst;
+    word_t word;
+    const struct function *fun;
+    int64_t offset;
+
+    // Initial setup
+
+    for (size_t i = 0; i < entry->arity; i++) {
+        bp[i] = args[i];
+    }
+    rsp->ip = NULL;
+    rsp->bp = NULL;
+    rsp++;
+    GOTO_NEXT;
+
+R_MOV:
+    dst = FETCH();
+    R(dst) = R(FETCH());
+    GOTO_NEXT;
+
+R_MOVK:
+    dst = FETCH();
+    R(dst) = FETCH();
+    GOTO_NEXT;
+
+R_ADD_RR:
+    dst = FETCH();
+    word = R(FETCH());
+    R(dst) = (int64_t) word + (int64_t) R(FETCH());
+    GOTO_NEXT;
+
+R_ADD_RK:
+    dst = FETCH();
+    word = R(FETCH());
+    R(dst) = (int64_t) word + (int64_t) FETCH();
+    GOTO_NEXT;
+
+R_SUB_RR:
+    dst = FETCH();
+    word = R(FETCH());
+    R(dst) = (int64_t) word - (int64_t) R(FETCH());
+    GOTO_NEXT;
+
+R_SUB_RK:
+    dst = FETCH();
+    word = R(FETCH());
+    R(dst) = (int64_t) word - (int64_t) FETCH();
+    GOTO_NEXT;
+
+R_LT_RR:
+    dst = FETCH();
+    word = R(FETCH());
+    R(dst) = (int64_t) word < (int64_t) R(FETCH());
+    GOTO_NEXT;
+
+R_LT_RK:
+    dst = FETCH();
+    word = R(FETCH());
+    #ifdef TRACE
+        printf("R_LT_RK %lld < %lld\n", (long long) word, (long long) *ip);
+    #endif
+    R(dst) = (int64_t) word < (int64_t) FETCH();
+    GOTO_NEXT;
+
+R_JT:
+    word = R(FETCH());
+    offset = FETCH();
+    #ifdef TRACE
+        printf("R_JT %lld (%lld)\n", (long long) offset, (long long) word);
+    #endif
+    if (word) {
+        ip = ip + offset - 3;
+    }
+    GOTO_NEXT;
+
+R_JMP:
+    offset = FETCH();
+    #ifdef TRACE
+        printf("R_JMP %lld\n", (long long) offset);
+    #endif
+    ip = ip + offset - 2;
+    GOTO_NEXT;
+
+R_CALL:
+    fun = functions + FETCH(); // function ID
+    word = FETCH(); // register of the first arg
+    #ifdef TRACE
+        printf("R_CALL %lld\n", (long long) word);
+    #endif
+    rsp->ip = ip;
+    rsp->bp = bp;
+    rsp++;
+    bp += word;
+    ip = fun->code;
+    GOTO_NEXT;
+
+R_RET:
+    word = R(FETCH());
+    #ifdef TRACE
+        printf("R_RET %lld\n", (long long) word);
+    #endif
+    R(0) = word; // where the caller expects the result
+    rsp--;
+    ip = rsp->ip;
+    bp = rsp->bp;
+
+    if (ip == NULL) return word;
+    GOTO_NEXT;
+
+R_PRIM:
+    word = FETCH();
+    #ifdef TRACE
+        printf("R_PRIM %lld\n", (long long) word);
+    #endif
+    prim_handlers[word](bp + FETCH());
+    GOTO_NEXT;
+}
+
+// The program is loaded on first use, and reloaded when a different one is run.
+uint64_t run_program(const struct program *program, const uint64_t *args)
+{
+    static const struct program *loaded;
+    static struct function *functions;
+    if (program != loaded) {
+        if (functions != NULL) free_program(functions, loaded->function_count);
+        execute(NULL, NULL, NULL);
+        functions = load_register_program(program, instruction_labels);
+        loaded = program;
+    }
+    return execute(functions, functions, args);
+}
+
+uint64_t run(uint64_t arg)
+{
+    return run_program(&fib_program, &arg);
+}
+
+#ifndef HARNESS
+int main(int argc, const char *argv[])
+{
+    const struct program *program;
+    word_t args[MAX_BENCHMARK_ARGS];
+    if (!parse_program_args(argc, argv, &program, args)) {
+        fprintf(stderr, "Usage: %s <n> | <program> [args...]\n", argv[0]);
+        return 1;
+    }
+    printf("registervm\n");
+
+    execute(NULL, NULL, NULL);
+    struct function *functions = load_register_program(program, instruction_labels);
+
+    clock_t start = clock();
+    word_t result = execute(functions, functions, args);
+    clock_t end = clock();
+    long ms = (end - start) / (CLOCKS_PER_SEC / 1000);
+
+    printf("Done in %ld ms\n", ms);
+    printf("=> %lld\n", (long long) result);
+}
+#endif
@@ -0,0 +1,428 @@
+/*
+    The loading stage of the register-machine engine (registervm.c).
+
+    Translates a program in the portable stack bytecode of bytecode.h into threaded
+    register code, in which instructions name the frame slots ("registers") they read
+    and write instead of going through the stack:
+
+        R_MOV dst, src              r[dst] = r[src]
+        R_MOVK dst, k               r[dst] = k
+        R_ADD_RR dst, a, b          r[dst] = r[a] + r[b]
+        R_ADD_RK dst, a, k          r[dst] = r[a] + k
+        R_SUB_RR, R_SUB_RK          the same for subtract
+        R_LT_RR, R_LT_RK            the same for lessThan
+        R_JT a, offset              jump by offset if r[a]
+        R_JMP offset                jump by offset
+        R_CALL f, base              call functions[f] on the args in r[base]...,
+                                    leaving the result in r[base]
+        R_RET a                     return r[a]
+        R_PRIM p, base              apply primitive p to r[base]..., leaving its
+                                    result, if any, in r[base]
+
+    Each frame holds the args, then the locals, then one temporary register per
+    stack slot the function can use (the stack depth is the same at every pass
+    through an instruction, so this is known at load time). A stack value at depth
+    d lives in temporary register d. The translator delays the pushes of LOAD and
+    LIT, keeping track of which register or constant each stack slot stands for, so
+    that the instruction consuming it can name it directly:
+
+        LOAD 0; LIT 2; PRIM lessThan; JT 30    =>    R_LT_RK t0, r0, 2; R_JT t0, 30
+
+    A value is only copied into its temporary register where it has to be: for a
+    call (the args of a callee are the first registers of its frame, which starts
+    at the caller's temporary register holding the first arg, so there is no
+    copying at the call itself), a generic primitive, a STORE to a slot a delayed
+    LOAD still refers to, and at jumps and jump targets, where the paths meeting
+    must agree on where the stack values are. An arithmetic result that is stored
+    right away is computed straight into the local.
+
+    Jump offsets are relative to the jump instruction, as in loader.h.
+ */
+
+#ifndef REGLOADER_H
+#define REGLOADER_H
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "bytecode.h"
+#include "loader.h"
+
+enum register_instruction {
+    R_MOV,
+    R_MOVK,
+    R_ADD_RR,
+    R_ADD_RK,
+    R_SUB_RR,
+    R_SUB_RK,
+    R_LT_RR,
+    R_LT_RK,
+    R_JT,
+    R_JMP,
+    R_CALL,
+    R_RET,
+    R_PRIM,
+    REGISTER_INSTRUCTION_COUNT
+};
+
+static const struct instruction_info register_instruction_infos[REGISTER_INSTRUCTION_COUNT] = {
+    [R_MOV] = { "R_MOV", 2, NO_JUMP },
+    [R_MOVK] = { "R_MOVK", 2, NO_JUMP },
+    [R_ADD_RR] = { "R_ADD_RR", 3, NO_JUMP },
+    [R_ADD_RK] = { "R_ADD_RK", 3, NO_JUMP },
+    [R_SUB_RR] = { "R_SUB_RR", 3, NO_JUMP },
+    [R_SUB_RK] = { "R_SUB_RK", 3, NO_JUMP },
+    [R_LT_RR] = { "R_LT_RR", 3, NO_JUMP },
+    [R_LT_RK] = { "R_LT_RK", 3, NO_JUMP },
+    [R_JT] = { "R_JT", 2, 1 },
+    [R_JMP] = { "R_JMP", 1, 0 },
+    [R_CALL] = { "R_CALL", 2, NO_JUMP },
+    [R_RET] = { "R_RET", 1, NO_JUMP },
+    [R_PRIM] = { "R_PRIM", 2, NO_JUMP }
+};
+
+// What a stack slot stands for during translation.
+enum value_kind {
+    IN_TEMPORARY, // in the temporary register of its depth
+    IN_REGISTER, // delayed LOAD of the register in 'value'
+    CONSTANT // delayed LIT of 'value'
+};
+
+struct stack_value {
+    enum value_kind kind;
+    word_t value;
+};
+
+#define NO_DEPTH ((size_t) -1)
+
+struct register_translation {
+    const struct bytecode_function *fun;
+    void *const *labels;
+    word_t *code;
+    size_t code_size;
+    size_t code_capacity;
+    struct stack_value *stack;
+    size_t depth;
+};
+
+static void emit(struct register_translation *t, word_t word)
+{
+    if (t->code_size == t->code_capacity) {
+        t->code_capacity *= 2;
+        t->code = realloc(t->code, t->code_capacity * sizeof(word_t));
+        if (t->code == NULL) {
+            fprintf(stderr, "ERROR: Out of memory loading %s.\n", t->fun->name);
+            abort();
+        }
+    }
+    t->code[t->code_size++] = word;
+}
+
+static word_t temporary(const struct register_translation *t, size_t depth)
+{
+    return t->fun->arity + t->fun->locals + depth;
+}
+
+static void emit_instruction(struct register_translation *t, word_t instruction, word_t a, word_t b, word_t c)
+{
+    word_t operands[] = { a, b, c };
+    emit(t, (word_t) t->labels[instruction]);
+    for (size_t k = 0; k < register_instruction_infos[instruction].operand_count; k++) {
+        emit(t, operands[k]);
+    }
+}
+
+static void push_value(struct register_translation *t, enum value_kind kind, word_t value)
+{
+    t->stack[t->depth].kind = kind;
+    t->stack[t->depth].value = value;
+    t->depth++;
+}
+
+// Copy the value at 'depth' into its temporary register.
+static void materialize(struct register_translation *t, size_t depth)
+{
+    struct stack_value *value = t->stack + depth;
+    if (value->kind == IN_REGISTER) {
+        emit_instruction(t, R_MOV, temporary(t, depth), value->value, 0);
+    } else if (value->kind == CONSTANT) {
+        emit_instruction(t, R_MOVK, temporary(t, depth), value->value, 0);
+    }
+    value->kind = IN_TEMPORARY;
+}
+
+static void materialize_all(struct register_translation *t)
+{
+    for (size_t d = 0; d < t->depth; d++) {
+        materialize(t, d);
+    }
+}
+
+// Materialize the delayed LOADs of 'reg', before it is written.
+static void materialize_loads(struct register_translation *t, word_t reg)
+{
+    for (size_t d = 0; d < t->depth; d++) {
+        if (t->stack[d].kind == IN_REGISTER && t->stack[d].value == reg) materialize(t, d);
+    }
+}
+
+// The register holding the value at 'depth', which must not be a constant.
+static word_t value_register(const struct register_translation *t, size_t depth)
+{
+    const struct stack_value *value = t->stack + depth;
+    return value->kind == IN_REGISTER ? value->value : temporary(t, depth);
+}
+
+// The register holding the value at the top of the stack, materializing it if it is a constant.
+static word_t top_register(struct register_translation *t)
+{
+    if (t->stack[t->depth - 1].kind == CONSTANT) materialize(t, t->depth - 1);
+    return value_register(t, t->depth - 1);
+}
+
+// Translate lessThan, subtract or add into a three-address instruction writing to 'dst'.
+static void translate_arithmetic(struct register_translation *t, word_t primitive, word_t dst)
+{
+    static const word_t rr[] = { [PRIM_LESS_THAN] = R_LT_RR, [PRIM_SUBTRACT] = R_SUB_RR, [PRIM_ADD] = R_ADD_RR };
+    size_t lhs = t->depth - 2;
+    size_t rhs = t->depth - 1;
+    if (t->stack[lhs].kind == CONSTANT && t->stack[rhs].kind != CONSTANT && primitive == PRIM_ADD) {
+        lhs = t->depth - 1;
+        rhs = t->depth - 2;
+    }
+    if (t->stack[lhs].kind == CONSTANT) materialize(t, lhs);
+    word_t a = value_register(t, lhs);
+    bool constant = t->stack[rhs].kind == CONSTANT;
+    word_t b = constant ? t->stack[rhs].value : value_register(t, rhs);
+    t->depth -= 2;
+    materialize_loads(t, dst);
+    emit_instruction(t, rr[primitive] + constant, dst, a, b); // the RK form follows the RR one
+}
+
+// The number of stack values the instruction pops, and pushes.
+static void stack_effect(const struct decoded *instr, size_t *pops, size_t *pushes)
+{
+    *pops = 1;
+    *pushes = 0;
+    switch (instr->opcode) {
+        case LIT:
+        case LOAD:
+            *pops = 0;
+            *pushes = 1;
+            break;
+        case CALL:
+            *pops = instr->operands[1];
+            *pushes = 1;
+            break;
+        case PRIM:
+            *pops = primitive_infos[instr->operands[0]].operand_count;
+            *pushes = primitive_infos[instr->operands[0]].result_count;
+            break;
+        case JMP:
+        case YIELD:
+            *pops = 0;
+            break;
+    }
+}
+
+/*
+    Compute the stack depth before each instruction into 'depths', NO_DEPTH for
+    unreachable ones, and return the maximum depth. Every path to an instruction
+    must arrive with the same depth.
+ */
+static size_t compute_depths(
+    const struct bytecode_function *fun,
+    const struct decoded *instrs,
+    size_t count,
+    size_t *depths)
+{
+    size_t *index_of = checked_malloc(fun->code_size * sizeof(size_t), fun->name); // PC -> instruction index
+    size_t *work = checked_malloc(count * sizeof(size_t), fun->name);
+    size_t work_count = 0;
+    size_t max_depth = 0;
+    for (size_t i = 0; i < count; i++) {
+        index_of[instrs[i].pc] = i;
+        depths[i] = NO_DEPTH;
+    }
+    depths[0] = 0;
+    work[work_count++] = 0;
+    while (work_count > 0) {
+        size_t i = work[--work_count];
+        const struct decoded *instr = instrs + i;
+        size_t pops, pushes;
+        stack_effect(instr, &pops, &pushes);
+        if (depths[i] < pops) load_error(fun, instr->pc, "Stack underflow");
+        size_t depth = depths[i] - pops + pushes;
+        if (depth > max_depth) max_depth = depth;
+        size_t successors[2];
+        size_t successor_count = 0;
+        if (instr->opcode != JMP && instr->opcode != RET && i + 1 < count) successors[successor_count++] = i + 1;
+        if (instr->opcode == JT || instr->opcode == JMP) successors[successor_count++] = index_of[instr->operands[0]];
+        for (size_t k = 0; k < successor_count; k++) {
+            size_t next = successors[k];
+            if (depths[next] == NO_DEPTH) {
+                depths[next] = depth;
+                work[work_count++] = next;
+            } else if (depths[next] != depth) {
+                load_error(fun, instrs[next].pc, "Inconsistent stack depth");
+            }
+        }
+    }
+    free(index_of);
+    free(work);
+    return max_depth;
+}
+
+static void translate_register_function(
+    const struct program *program,
+    const struct bytecode_function *fun,
+    void *const *labels,
+    struct function *result)
+{
+    size_t size = fun->code_size;
+    struct decoded *instrs = checked_malloc(size * sizeof(struct decoded), fun->name);
+    size_t *pc_map = checked_malloc(size * sizeof(size_t), fun->name); // original PC -> translated PC
+    bool *is_target = checked_malloc(size * sizeof(bool), fun->name);
+    size_t *depths = checked_malloc(size * sizeof(size_t), fun->name); // per instruction
+    struct jump *jumps = checked_malloc(size * sizeof(struct jump), fun->name); // jumps to patch
+    size_t jump_count = 0;
+
+    struct register_translation t = {
+        .fun = fun,
+        .labels = labels,
+        .code = checked_malloc(2 * size * sizeof(word_t), fun->name),
+        .code_capacity = 2 * size,
+    };
+
+    size_t count = decode_function(program, fun, instrs);
+    find_jump_targets(fun, instrs, count, is_target);
+    size_t max_depth = compute_depths(fun, instrs, count, depths);
+    t.stack = checked_malloc((max_depth + 1) * sizeof(struct stack_value), fun->name);
+    for (size_t pc = 0; pc < size; pc++) {
+        pc_map[pc] = NO_PC;
+    }
+
+    bool reachable = true; // from the previous instruction
+    for (size_t i = 0; i < count; i++) {
+        const struct decoded *instr = instrs + i;
+        if (depths[i] == NO_DEPTH) {
+            reachable = false;
+            continue; // dead code
+        }
+        if (is_target[instr->pc] || !reachable) {
+            // Paths meet here, with the stack values in their temporary registers.
+            if (reachable) materialize_all(&t);
+            t.depth = depths[i];
+            for (size_t d = 0; d < t.depth; d++) t.stack[d].kind = IN_TEMPORARY;
+        }
+        pc_map[instr->pc] = t.code_size;
+        reachable = true;
+
+        switch (instr->opcode) {
+            case LIT:
+                push_value(&t, CONSTANT, instr->operands[0]);
+                break;
+            case LOAD:
+                push_value(&t, IN_REGISTER, instr->operands[0]);
+                break;
+            case STORE: {
+                struct stack_value value = t.stack[--t.depth];
+                materialize_loads(&t, instr->operands[0]);
+                if (value.kind == CONSTANT) {
+                    emit_instruction(&t, R_MOVK, instr->operands[0], value.value, 0);
+                } else {
+                    word_t src = value.kind == IN_REGISTER ? value.value : temporary(&t, t.depth);
+                    if (src != instr->operands[0]) emit_instruction(&t, R_MOV, instr->operands[0], src, 0);
+                }
+                break;
+            }
+            case PRIM: {
+                word_t primitive = instr->operands[0];
+                if (primitive == PRIM_LESS_THAN || primitive == PRIM_SUBTRACT || primitive == PRIM_ADD) {
+                    const struct decoded *next = instr + 1;
+                    if (i + 1 < count && next->opcode == STORE && !is_target[next->pc]) {
+                        translate_arithmetic(&t, primitive, next->operands[0]);
+                        pc_map[next->pc] = t.code_size;
+                        i++;
+                    } else {
+                        translate_arithmetic(&t, primitive, temporary(&t, t.depth - 2));
+                        push_value(&t, IN_TEMPORARY, 0);
+                    }
+                    break;
+                }
+                const struct primitive_info *info = primitive_infos + primitive;
+                size_t base = t.depth - info->operand_count;
+                for (size_t d = base; d < t.depth; d++) materialize(&t, d);
+                emit_instruction(&t, R_PRIM, primitive, temporary(&t, base), 0);
+                t.depth = base;
+                if (info->result_count > 0) push_value(&t, IN_TEMPORARY, 0);
+                break;
+            }
+            case CALL: {
+                size_t base = t.depth - instr->operands[1];
+                for (size_t d = base; d < t.depth; d++) materialize(&t, d);
+                emit_instruction(&t, R_CALL, instr->operands[0], temporary(&t, base), 0);
+                t.depth = base;
+                push_value(&t, IN_TEMPORARY, 0);
+                // The callee's frame starts at the args, it needs no room in this one.
+                break;
+            }
+            case JT: {
+                word_t condition = top_register(&t);
+                t.depth--;
+                materialize_all(&t);
+                jumps[jump_count].pc = t.code_size;
+                jumps[jump_count].operand_pc = t.code_size + 2;
+                jump_count++;
+                emit_instruction(&t, R_JT, condition, instr->operands[0], 0);
+                break;
+            }
+            case JMP:
+                materialize_all(&t);
+                jumps[jump_count].pc = t.code_size;
+                jumps[jump_count].operand_pc = t.code_size + 1;
+                jump_count++;
+                emit_instruction(&t, R_JMP, instr->operands[0], 0, 0);
+                reachable = false;
+                break;
+            case RET:
+                emit_instruction(&t, R_RET, top_register(&t), 0, 0);
+                reachable = false;
+                break;
+        }
+    }
+
+    // Jump operands still hold the original target; make them relative to the translated jump.
+    for (size_t j = 0; j < jump_count; j++) {
+        struct jump *jump = jumps + j;
+        word_t target = t.code[jump->operand_pc];
+        if (pc_map[target] == NO_PC) load_error(fun, target, "Jump into the middle of an instruction");
+        t.code[jump->operand_pc] = (int64_t) pc_map[target] - (int64_t) jump->pc;
+    }
+
+    free(instrs);
+    free(pc_map);
+    free(is_target);
+    free(depths);
+    free(jumps);
+    free(t.stack);
+    result->arity = fun->arity;
+    result->frame_size = fun->arity + fun->locals + max_depth; // registers
+    result->code = t.code;
+    result->code_size = t.code_size;
+}
+
+// Translate all functions of the program into register code, returning the table
+// R_CALL operands index into. 'labels' maps each register instruction to its label.
+MAYBE_UNUSED
+static struct function *load_register_program(const struct program *program, void *const *labels)
+{
+    struct function *functions = checked_malloc(program->function_count * sizeof(struct function), program->name);
+    for (size_t i = 0; i < program->function_count; i++) {
+        translate_register_function(program, program->functions + i, labels, functions + i);
+    }
+    return functions;
+}
+
+#endif
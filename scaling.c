@@ -0,0 +1,162 @@
+/*
+    Measures how the throughput of reentrant.c scales with the number of threads.
+
+        scaling [-t threads] [-r runs] [<n> | <program> [args...]]
+
+    For each thread count from 1 to 'threads' (the number of online CPUs by default),
+    starts that many threads, each creating its own context and then, once all of them
+    are ready, running the same image (shared, loaded once) 'runs' times. The wall
+    clock time from the start to the last thread finishing gives the throughput in
+    runs per second, reported as CSV with the speedup over one thread and the parallel
+    efficiency (speedup divided by threads). Results are checked against the expected
+    ones for default args, and against each other.
+
+    Contexts are cache-line aligned and stacks page-aligned (context.h), and so are the
+    per-thread records of this file, so the only memory threads share is read-only.
+ */
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "context.h"
+#include "programs.h"
+
+#define STACK_SIZE (1 << 16) // deep enough for ack(3, 8)
+
+struct worker {
+    _Alignas(CACHE_LINE_SIZE) pthread_t thread;
+    const struct image *image;
+    const uint64_t *args;
+    int runs;
+    pthread_barrier_t *ready;
+    bool failed; // results differed between runs, or the stack overflowed
+    uint64_t result;
+};
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000u + ts.tv_nsec;
+}
+
+static void *work(void *arg)
+{
+    struct worker *worker = arg;
+    struct context *context = new_context(STACK_SIZE);
+    pthread_barrier_wait(worker->ready);
+    for (int i = 0; i < worker->runs; i++) {
+        uint64_t result;
+        worker->failed |= !run_image(context, worker->image, worker->args, &result);
+        worker->failed |= i > 0 && result != worker->result;
+        worker->result = result;
+    }
+    free_context(context);
+    return NULL;
+}
+
+// Run 'threads' workers, returning the wall clock time in nanoseconds and their common result in 'result'.
+static uint64_t measure(
+    const struct image *image,
+    const uint64_t *args,
+    int threads,
+    int runs,
+    uint64_t *result)
+{
+    struct worker *workers = aligned_alloc(CACHE_LINE_SIZE, threads * sizeof(struct worker));
+    if (workers == NULL) {
+        fprintf(stderr, "ERROR: Out of memory.\n");
+        exit(1);
+    }
+    pthread_barrier_t ready;
+    pthread_barrier_init(&ready, NULL, threads + 1);
+    for (int t = 0; t < threads; t++) {
+        struct worker *worker = workers + t;
+        memset(worker, 0, sizeof(*worker));
+        worker->image = image;
+        worker->args = args;
+        worker->runs = runs;
+        worker->ready = &ready;
+        if (pthread_create(&worker->thread, NULL, work, worker) != 0) {
+            fprintf(stderr, "ERROR: Cannot start thread %d.\n", t);
+            exit(1);
+        }
+    }
+
+    pthread_barrier_wait(&ready);
+    uint64_t start = now_ns();
+    for (int t = 0; t < threads; t++) {
+        pthread_join(workers[t].thread, NULL);
+    }
+    uint64_t end = now_ns();
+
+    pthread_barrier_destroy(&ready);
+    *result = workers[0].result;
+    for (int t = 0; t < threads; t++) {
+        if (workers[t].failed || workers[t].result != *result) {
+            fprintf(stderr, "ERROR: Different results or stack overflows on %d threads.\n", threads);
+            exit(1);
+        }
+    }
+    free(workers);
+    return end - start;
+}
+
+static void usage(void)
+{
+    fprintf(stderr, "Usage: scaling [-t threads] [-r runs] [<n> | <program> [args...]]\n");
+    exit(1);
+}
+
+int main(int argc, const char *argv[])
+{
+    int max_threads = (int) sysconf(_SC_NPROCESSORS_ONLN);
+    int runs = 10;
+    int i = 1;
+    for (; i < argc && argv[i][0] == '-'; i++) {
+        if (strcmp(argv[i], "-t") == 0 && i + 1 < argc) {
+            max_threads = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "-r") == 0 && i + 1 < argc) {
+            runs = atoi(argv[++i]);
+        } else {
+            usage();
+        }
+    }
+    if (max_threads < 1 || runs < 1) usage();
+
+    const struct program *program = &fib_program;
+    uint64_t args[MAX_BENCHMARK_ARGS];
+    memcpy(args, find_benchmark(program->name)->args, sizeof(args));
+    // parse_program_args() takes the program name as the first arg after argv[0].
+    if (i < argc && !parse_program_args(argc - i + 1, argv + i - 1, &program, args)) usage();
+    const struct benchmark *benchmark = find_benchmark(program->name);
+    bool default_args = memcmp(args, benchmark->args, program->functions[0].arity * sizeof(uint64_t)) == 0;
+
+    struct image *image = load_image(program);
+    printf("program,args,threads,runs_per_thread,wall_ns,runs_per_second,speedup,efficiency\n");
+    double single = 0;
+    for (int threads = 1; threads <= max_threads; threads++) {
+        uint64_t result;
+        uint64_t ns = measure(image, args, threads, runs, &result);
+        if (default_args && result != benchmark->expected) {
+            fprintf(stderr, "ERROR: Computed %llu for %s, expected %llu.\n",
+                (unsigned long long) result, program->name, (unsigned long long) benchmark->expected);
+            return 1;
+        }
+        double throughput = (double) threads * runs * 1e9 / ns;
+        if (threads == 1) single = throughput;
+        printf("%s,", program->name);
+        for (size_t a = 0; a < program->functions[0].arity; a++) {
+            printf("%s%llu", a > 0 ? " " : "", (unsigned long long) args[a]);
+        }
+        printf(",%d,%d,%llu,%.1f,%.3f,%.3f\n", threads, runs, (unsigned long long) ns,
+            throughput, throughput / single, throughput / single / threads);
+    }
+    free_image(image);
+}
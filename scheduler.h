@@ -0,0 +1,89 @@
+/*
+    Green threads: many scripts running concurrently on a few OS threads.
+
+    A script is a run of the entry function of a loaded program, with its own stack.
+    Scripts are lightweight: a script is a small struct and a stack, and switching
+    between scripts saves and restores three interpreter registers, with no system
+    call. A scheduler runs its scripts on 'worker_count' OS threads, its workers, one
+    per core.
+
+    Scripts are suspended only at suspension points of the code:
+
+        - YIELD (bytecode.h) suspends the script until its next turn;
+        - preemption: each turn of a script has a budget of backward jumps and calls,
+          the instructions every loop and recursion goes through, and the script is
+          suspended when the budget runs out. Straight-line code is not checked.
+
+    Each worker has a queue of runnable scripts: it runs the script at the front for a
+    turn, and puts it back at the end if it is suspended. A worker whose queue is empty
+    steals from the queue of another worker, at random, so that the workers stay busy
+    while there are more runnable scripts than workers.
+
+    Implemented by threadedgreen.c; green.c runs thousands of scripts on it.
+ */
+
+#ifndef SCHEDULER_H
+#define SCHEDULER_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// The harness links the dispatch-counting build of threadedgreen.c as well (see harness.h).
+#ifdef COUNT_DISPATCHES
+    #define load_green_image counted_load_green_image
+    #define free_green_image counted_free_green_image
+    #define new_scheduler counted_new_scheduler
+    #define free_scheduler counted_free_scheduler
+    #define spawn_script counted_spawn_script
+    #define run_scheduler counted_run_scheduler
+    #define script_result counted_script_result
+    #define get_scheduler_stats counted_get_scheduler_stats
+#endif
+
+#define DEFAULT_SCRIPT_STACK_SIZE (1 << 14) // words, enough for ack(3, 8)
+#define DEFAULT_BUDGET 10000 // backward jumps and calls per turn
+
+struct program;
+struct green_image;
+struct scheduler;
+struct script;
+
+enum script_status {
+    SCRIPT_RUNNABLE,
+    SCRIPT_DONE,
+    SCRIPT_STACK_OVERFLOW // stopped: its stack was too small for a call
+};
+
+struct scheduler_stats {
+    uint64_t turns; // of all scripts
+    uint64_t yields; // turns ended by YIELD
+    uint64_t preemptions; // turns ended by the budget
+    uint64_t steals; // scripts taken from the queue of another worker
+};
+
+// Load 'program', exiting on errors like load_program() does. Images are only read
+// once loaded: all scripts of all schedulers can share one.
+struct green_image *load_green_image(const struct program *program);
+void free_green_image(struct green_image *image);
+
+// A scheduler with 'worker_count' workers giving each script turns of 'budget'
+// backward jumps and calls, and stacks of 'stack_size' words.
+struct scheduler *new_scheduler(size_t worker_count, uint64_t budget, size_t stack_size);
+// Frees its scripts as well.
+void free_scheduler(struct scheduler *scheduler);
+
+// A script running the entry function of 'image' on its arity args, queued on the
+// workers in turn. Only while the scheduler is not running.
+struct script *spawn_script(struct scheduler *scheduler, const struct green_image *image, const uint64_t *args);
+
+// Run until all scripts are done or stopped, the calling thread being the first worker.
+void run_scheduler(struct scheduler *scheduler);
+
+// The status of 'script', with its result in 'result' once done.
+enum script_status script_result(const struct script *script, uint64_t *result);
+
+// The totals of all workers since the scheduler was created.
+void get_scheduler_stats(const struct scheduler *scheduler, struct scheduler_stats *stats);
+
+#endif
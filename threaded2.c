@@ -0,0 +1,411 @@
+/*
+    Derived from threaded.c:
+
+        Implements the combo instructions of comboinstructions2.c (CONST_0/1/2, SUB1, SUB2)
+        plus ADD1. They are not in the code vector to begin with: the loader's peephole pass
+        matches the portable instruction sequences in the superinstructions table of loader.h
+        and emits the fused form, recomputing jump offsets. Adding a superinstruction means
+        adding a row to that table and a label here.
+
+        Translated fib is instruction for instruction the hand-written fib_code of
+        comboinstructions2.c.
+
+        Built with PROFILE_NGRAMS (the threaded2_profile target), the engine runs the
+        portable instructions unfused and writes the dynamic unigram, pair and triple
+        counts to <program>.ngrams, most frequent first (see ngrams.h). Running the
+        regular build with SUPERINSTRUCTION_PROFILE set to one or more such files
+        (colon-separated) enables only the table rows that save the most dispatches
+        for that workload, at most SUPERINSTRUCTION_BUDGET of them.
+
+        Built with PROFILE_DISPATCH (the threaded2_dispatch_profile target), it writes
+        dispatch counts and sampled cycles per instruction and function to stderr at
+        exit (see profile.h).
+
+    Observations (Clang):
+
+        - Same performance as comboinstructions2.
+
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "bytecode.h"
+#include "harness.h"
+#include "loader.h"
+#include "ngrams.h"
+#include "profile.h"
+#include "programs.h"
+
+// #define TRACE
+
+#define STACK_SIZE (1 << 16) // deep enough for ack(3, 8)
+static word_t stack[STACK_SIZE];
+
+MAYBE_UNUSED
+static void print_stack(word_t *sp)
+{
+    printf("--- stack %p ---\n", sp);
+    for (word_t *entry = stack; entry < sp; entry++) {
+        printf("  %lld\n", (long long) *entry);
+    }
+    printf("------\n");
+}
+
+typedef void (*prim_handler_t)(word_t **spp);
+
+static void lessThan(word_t **spp)
+{
+    int64_t rhs = *(--*spp);
+    int64_t lhs = *(--*spp);
+    bool result = lhs < rhs;
+    #ifdef TRACE
+        printf("%lld < %lld => %s\n", (long long) lhs, (long long) rhs, result ? "true" : "false");
+    #endif
+    *((*spp)++) = result;
+}
+
+static void subtract(word_t **spp)
+{
+    int64_t rhs = *(--*spp);
+    int64_t lhs = *(--*spp);
+    int64_t result = lhs - rhs;
+    #ifdef TRACE
+        printf("%lld - %lld => %lld\n", (long long) lhs, (long long) rhs, (long long) result);
+    #endif
+    *((*spp)++) = result;
+}
+
+static void add(word_t **spp)
+{
+    int64_t rhs = *(--*spp);
+    int64_t lhs = *(--*spp);
+    int64_t result = lhs + rhs;
+    #ifdef TRACE
+        printf("%lld + %lld => %lld\n", (long long) lhs, (long long) rhs, (long long) result);
+    #endif
+    *((*spp)++) = result;
+}
+
+static void newArray(word_t **spp)
+{
+    word_t size = *(--*spp);
+    word_t *array = calloc(size, sizeof(word_t));
+    if (array == NULL) {
+        fprintf(stderr, "ERROR: Cannot allocate an array of %llu words.\n", (unsigned long long) size);
+        abort();
+    }
+    #ifdef TRACE
+        printf("newArray %llu => %p\n", (unsigned long long) size, (void *) array);
+    #endif
+    *((*spp)++) = (word_t) array;
+}
+
+static void at(word_t **spp)
+{
+    word_t index = *(--*spp);
+    word_t *array = (word_t *) *(--*spp);
+    #ifdef TRACE
+        printf("%p at %llu => %llu\n", (void *) array, (unsigned long long) index, (unsigned long long) array[index]);
+    #endif
+    *((*spp)++) = array[index];
+}
+
+static void atPut(word_t **spp)
+{
+    word_t value = *(--*spp);
+    word_t index = *(--*spp);
+    word_t *array = (word_t *) *(--*spp);
+    #ifdef TRACE
+        printf("%p at %llu put %llu\n", (void *) array, (unsigned long long) index, (unsigned long long) value);
+    #endif
+    array[index] = value;
+}
+
+static void freeArray(word_t **spp)
+{
+    free((word_t *) *(--*spp));
+}
+
+static prim_handler_t prim_handlers[] = {
+    [PRIM_LESS_THAN] = lessThan,
+    [PRIM_SUBTRACT] = subtract,
+    [PRIM_ADD] = add,
+    [PRIM_NEW_ARRAY] = newArray,
+    [PRIM_AT] = at,
+    [PRIM_AT_PUT] = atPut,
+    [PRIM_FREE_ARRAY] = freeArray
+};
+
+#if defined(PROFILE_NGRAMS)
+    #define GOTO_NEXT do { record_ngram(ip); COUNT_DISPATCH(); goto *((void*) *ip++); } while (0)
+#elif defined(PROFILE_DISPATCH)
+    #define GOTO_NEXT do { profile_dispatch(ip); COUNT_DISPATCH(); goto *((void*) *ip++); } while (0)
+#else
+    #define GOTO_NEXT do { COUNT_DISPATCH(); goto *((void*) *ip++); } while (0)
+#endif
+#define PUSH(expr) *sp++ = expr
+#define POP() *--sp
+#define FETCH() *ip++
+
+// Set up by calling execute() with no functions. Passed to the loader.
+static void *const *instruction_labels;
+
+static word_t execute(const struct function *functions, const struct function *entry, const word_t *args)
+{
+    static void *const labels[INSTRUCTION_COUNT] = {
+        [LIT] = &&LIT,
+        [LOAD] = &&LOAD,
+        [CALL] = &&CALL,
+        [PRIM] = &&PRIM,
+        [JT] = &&JT,
+        [JMP] = &&JMP,
+        [RET] = &&RET,
+        [STORE] = &&STORE,
+        [CONST_0] = &&CONST_0,
+        [CONST_1] = &&CONST_1,
+        [CONST_2] = &&CONST_2,
+        [SUB1] = &&SUB1,
+        [SUB2] = &&SUB2,
+        [ADD1] = &&ADD1
+    };
+
+    if (functions == NULL) {
+        instruction_labels = labels;
+        return 0;
+    }
+
+    // Interpreter state
+
+    word_t *ip = entry->code;
+    word_t *sp = stack;
+    word_t *bp;
+
+    word_t word;
+    word_t word2;
+    word_t *words;
+    const struct function *fun;
+    int64_t offset;
+
+    // Initial setup
+
+    for (size_t i = 0; i < entry->arity; i++) {
+        PUSH(args[i]);
+    }
+    bp = sp; // the args notionally are in the callee frame
+    PUSH(0); // no prev. BP
+    PUSH(0); // no prev. IP
+    PUSH(0); // no args
+    sp += entry->frame_size;
+    PROFILE_CALL(entry - functions);
+    GOTO_NEXT;
+
+LIT:
+    word = FETCH();
+    #ifdef TRACE
+        printf("LIT %lld\n", (long long) word);
+    #endif
+    PUSH(word);
+    GOTO_NEXT;
+
+CONST_0:
+    PUSH(0);
+    GOTO_NEXT;
+
+CONST_1:
+    PUSH(1);
+    GOTO_NEXT;
+
+CONST_2:
+    PUSH(2);
+    GOTO_NEXT;
+
+SUB1:
+    *((int64_t *)(sp - 1)) -= 1;
+    GOTO_NEXT;
+
+SUB2:
+    *((int64_t *)(sp - 1)) -= 2;
+    GOTO_NEXT;
+
+ADD1:
+    *((int64_t *)(sp - 1)) += 1;
+    GOTO_NEXT;
+
+LOAD:
+    offset = FETCH();
+    #ifdef TRACE
+        printf("LOAD %lld\n", (long long) offset);
+    #endif
+    PUSH(*(bp + offset));
+    GOTO_NEXT;
+
+STORE:
+    offset = FETCH();
+    #ifdef TRACE
+        printf("STORE %lld\n", (long long) offset);
+    #endif
+    *(bp + offset) = POP();
+    GOTO_NEXT;
+
+CALL:
+    fun = functions + FETCH(); // function ID
+    PROFILE_CALL(fun - functions);
+    word = FETCH();
+    #ifdef TRACE
+        printf("CALL %lld\n", (long long) word);
+    #endif
+
+    // push frame
+    words = bp;
+    bp = sp;
+    PUSH((word_t) words);
+    PUSH((word_t) ip);
+    PUSH(word); // args to pop later
+
+    sp += fun->frame_size;
+    ip = fun->code;
+    GOTO_NEXT;
+
+PRIM:
+    word = FETCH();
+    #ifdef TRACE
+        printf("PRIM %lld\n", (long long) word);
+    #endif
+    prim_handlers[word](&sp);
+    GOTO_NEXT;
+
+JT:
+    offset = FETCH();
+    word = POP();
+    #ifdef TRACE
+        printf("JT %lld (%lld)\n", (long long) offset, (long long) word);
+    #endif
+    if (word) {
+        ip = ip + offset - 2;
+    }
+    GOTO_NEXT;
+
+JMP:
+    offset = FETCH();
+    #ifdef TRACE
+        printf("JMP %lld\n", (long long) offset);
+    #endif
+    ip = ip + offset - 2;
+    GOTO_NEXT;
+
+RET:
+    word = POP();
+    #ifdef TRACE
+        printf("RET %lld\n", (long long) word);
+    #endif
+
+    // pop_frame
+    sp = bp + 3;
+    word2 = POP(); // args to pop
+    ip = (word_t *) POP();
+    bp = (word_t *) POP();
+    sp -= word2;
+
+    if (ip == NULL) {
+        PROFILE_EXIT();
+        return word;
+    }
+    PUSH(word);
+    GOTO_NEXT;
+}
+
+// Uses the default superinstructions table. The program is loaded on first use, and
+// reloaded when a different one is run.
+uint64_t run_program(const struct program *program, const uint64_t *args)
+{
+    static const struct program *loaded;
+    static struct function *functions;
+    if (program != loaded) {
+        if (functions != NULL) free_program(functions, loaded->function_count);
+        execute(NULL, NULL, NULL);
+        functions = load_program(program, instruction_labels);
+        loaded = program;
+    }
+    return execute(functions, functions, args);
+}
+
+uint64_t run(uint64_t arg)
+{
+    return run_program(&fib_program, &arg);
+}
+
+#ifndef HARNESS
+MAYBE_UNUSED
+static void print_superinstructions(void)
+{
+    printf("superinstructions:");
+    for (size_t s = 0; s < SUPERINSTRUCTION_COUNT; s++) {
+        if (!superinstruction_disabled[s] && instruction_labels[superinstructions[s].instruction] != NULL) {
+            printf(" %s", instruction_name(superinstructions[s].instruction));
+        }
+    }
+    printf("\n");
+}
+
+int main(int argc, const char *argv[])
+{
+    const struct program *program;
+    word_t args[MAX_BENCHMARK_ARGS];
+    if (!parse_program_args(argc, argv, &program, args)) {
+        fprintf(stderr, "Usage: %s <n> | <program> [args...]\n", argv[0]);
+        return 1;
+    }
+
+    execute(NULL, NULL, NULL);
+#ifdef PROFILE_NGRAMS
+    printf("threaded2 (n-gram profile)\n");
+    // Profile the portable instructions, not what the current table would make of them.
+    for (size_t s = 0; s < SUPERINSTRUCTION_COUNT; s++) superinstruction_disabled[s] = true;
+    start_ngrams(instruction_labels);
+#else
+    #ifdef PROFILE_DISPATCH
+        printf("threaded2 (dispatch profile)\n");
+    #else
+        printf("threaded2\n");
+    #endif
+    const char *profile = getenv("SUPERINSTRUCTION_PROFILE");
+    if (profile != NULL) {
+        const char *budget = getenv("SUPERINSTRUCTION_BUDGET");
+        select_superinstructions(profile, budget ? strtoul(budget, NULL, 10) : SUPERINSTRUCTION_COUNT,
+            instruction_labels);
+        print_superinstructions();
+    }
+#endif
+    struct function *functions = load_program(program, instruction_labels);
+#ifdef PROFILE_DISPATCH
+    start_profile(program, functions, instruction_labels, INSTRUCTION_COUNT);
+#endif
+
+    clock_t start = clock();
+    word_t result = execute(functions, functions, args);
+    clock_t end = clock();
+    long ms = (end - start) / (CLOCKS_PER_SEC / 1000);
+
+    printf("Done in %ld ms\n", ms);
+    printf("=> %lld\n", (long long) result);
+
+#ifdef PROFILE_NGRAMS
+    char path[256];
+    snprintf(path, sizeof(path), "%s.ngrams", program->name);
+    FILE *out = fopen(path, "w");
+    if (out == NULL) {
+        fprintf(stderr, "ERROR: Cannot write %s.\n", path);
+        return 1;
+    }
+    write_ngrams(out, program->name, SIZE_MAX);
+    fclose(out);
+    write_ngrams(stdout, program->name, 10);
+    printf("Wrote %s\n", path);
+#endif
+}
+#endif
@@ -0,0 +1,788 @@
+/*
+    Derived from threadedlink.c:
+
+        Green threads (see scheduler.h). execute() runs one turn of a script instead
+        of a whole run: the interpreter registers are loaded from the script's struct
+        and stored back into it at suspension points, where execute() returns to the
+        scheduler, which calls it again on the same registers for the next turn.
+
+        The suspension points are YIELD, and the budget check of backward jumps
+        (taken jumps with a negative offset: JMP, and the fused JGE and JGE_CONST of
+        loop exits, which also jump backward) and calls, at the entry of the callee:
+        a loop cannot run forever without reaching one, nor can a recursion. The
+        budget is a local counter decremented there, not a check per instruction.
+
+        Stacks are per script, small, and no stack grows: a call checks that the
+        stack has room for the biggest frame of the program (its header, locals and
+        operands, at most one per instruction of its function), and stops the script
+        with SCRIPT_STACK_OVERFLOW otherwise. Images are only read, and the
+        instruction labels are the same for all threads, as in reentrant.c.
+
+        Each worker queue is a list under a mutex: turns are many dispatches long,
+        so taking the lock once per turn does not show. An idle worker steals the
+        script at the front of another queue, trying the others from a random one,
+        and spins with sched_yield() while none has any.
+
+        run_program() for the harness runs the script on its own, without a
+        scheduler, through turns of DEFAULT_BUDGET.
+
+    Observations (GCC 12, Clang was not available):
+
+        - 5-20% slower than threadedlink (the same on tak) with the same dispatches:
+          the budget is a register the loops and calls decrement and test, and the
+          registers are reloaded from the script after a call of execute(). The
+          calls need one more compare, for the stack.
+        - green runs 1000 tickers of 10000 iterations (10 million turns, each a yield
+          and 12 dispatches) in 0.3-0.45 s: 30-45 ns per turn and switch. 10000
+          scripts take 0.04 s over 100 iterations, stacks included (each 128 KiB of
+          address space, of which they touch one page).
+        - On this single-CPU machine, 4 workers are 0-45% slower than 1, time-sliced
+          by the OS, and steal a few hundred scripts at the end of the run. The
+          scaling over cores is yet to be measured on a multi-core machine.
+ */
+
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "bytecode.h"
+#include "harness.h"
+#include "loader.h"
+#include "programs.h"
+#include "scheduler.h"
+
+// #define TRACE
+
+#define CACHE_LINE_SIZE 64
+#define HARNESS_STACK_SIZE (1 << 16) // deep enough for ack(3, 8)
+
+// Two operands and one result (primitive_infos), by value.
+typedef word_t (*binary_primitive_t)(word_t lhs, word_t rhs);
+// Any other arity: take the stack pointer and return the new one.
+typedef word_t *(*stack_primitive_t)(word_t *sp);
+
+static word_t lessThan(word_t lhs, word_t rhs)
+{
+    bool result = (int64_t) lhs < (int64_t) rhs;
+    #ifdef TRACE
+        printf("%lld < %lld => %s\n", (long long) lhs, (long long) rhs, result ? "true" : "false");
+    #endif
+    return result;
+}
+
+static word_t subtract(word_t lhs, word_t rhs)
+{
+    int64_t result = (int64_t) lhs - (int64_t) rhs;
+    #ifdef TRACE
+        printf("%lld - %lld => %lld\n", (long long) lhs, (long long) rhs, (long long) result);
+    #endif
+    return result;
+}
+
+static word_t add(word_t lhs, word_t rhs)
+{
+    int64_t result = (int64_t) lhs + (int64_t) rhs;
+    #ifdef TRACE
+        printf("%lld + %lld => %lld\n", (long long) lhs, (long long) rhs, (long long) result);
+    #endif
+    return result;
+}
+
+static word_t *newArray(word_t *sp)
+{
+    word_t size = *(--sp);
+    word_t *array = calloc(size, sizeof(word_t));
+    if (array == NULL) {
+        fprintf(stderr, "ERROR: Cannot allocate an array of %llu words.\n", (unsigned long long) size);
+        abort();
+    }
+    #ifdef TRACE
+        printf("newArray %llu => %p\n", (unsigned long long) size, (void *) array);
+    #endif
+    *(sp++) = (word_t) array;
+    return sp;
+}
+
+static word_t at(word_t array, word_t index)
+{
+    #ifdef TRACE
+        printf("%p at %llu => %llu\n", (void *) array, (unsigned long long) index,
+            (unsigned long long) ((word_t *) array)[index]);
+    #endif
+    return ((word_t *) array)[index];
+}
+
+static word_t *atPut(word_t *sp)
+{
+    word_t value = *(--sp);
+    word_t index = *(--sp);
+    word_t *array = (word_t *) *(--sp);
+    #ifdef TRACE
+        printf("%p at %llu put %llu\n", (void *) array, (unsigned long long) index, (unsigned long long) value);
+    #endif
+    array[index] = value;
+    return sp;
+}
+
+static word_t *freeArray(word_t *sp)
+{
+    free((word_t *) *(--sp));
+    return sp;
+}
+
+// Indexed by primitive, each primitive in the table of its signature.
+static const binary_primitive_t binary_primitives[PRIMITIVE_COUNT] = {
+    [PRIM_LESS_THAN] = lessThan,
+    [PRIM_SUBTRACT] = subtract,
+    [PRIM_ADD] = add,
+    [PRIM_AT] = at
+};
+
+static const stack_primitive_t stack_primitives[PRIMITIVE_COUNT] = {
+    [PRIM_NEW_ARRAY] = newArray,
+    [PRIM_AT_PUT] = atPut,
+    [PRIM_FREE_ARRAY] = freeArray
+};
+
+#define GOTO_NEXT do { COUNT_DISPATCH(); goto *((void*) *ip++); } while (0)
+#define PUSH(expr) *sp++ = expr
+#define POP() *--sp
+#define FETCH() *ip++
+
+// Set up by calling execute() with no script. Passed to the loader.
+static void *const *instruction_labels;
+
+// Why a turn ended.
+enum turn_end {
+    TURN_DONE,
+    TURN_YIELDED,
+    TURN_PREEMPTED,
+    TURN_STACK_OVERFLOW
+};
+
+struct green_image {
+    const struct program *program;
+    struct function *functions;
+    size_t max_frame; // the most words a frame can take, operands included
+};
+
+struct script {
+    // The interpreter registers between turns
+    word_t *ip;
+    word_t *sp;
+    word_t *bp;
+    word_t *stack;
+    word_t *stack_limit; // a call does not start a frame past it: max_frame words below the end
+    const struct green_image *image;
+    enum script_status status;
+    word_t result;
+    struct script *next; // in a queue
+    struct script *next_spawned; // of the same scheduler, for freeing them
+};
+
+#define SUSPEND(reason) do { \
+        script->ip = ip; \
+        script->sp = sp; \
+        script->bp = bp; \
+        return reason; \
+    } while (0)
+#define PREEMPTION_POINT() do { if (--budget == 0) SUSPEND(TURN_PREEMPTED); } while (0)
+// A taken jump, 'length' words long.
+#define JUMP(offset, length) do { \
+        ip = ip + (offset) - (length); \
+        if ((offset) < 0) PREEMPTION_POINT(); \
+    } while (0)
+
+// Run a turn of 'script' of at most 'budget' backward jumps and calls (at least 1).
+// Set up by calling it with no script.
+static enum turn_end execute(struct script *script, uint64_t budget)
+{
+    static void *const labels[INSTRUCTION_COUNT] = {
+        [LIT] = &&LIT,
+        [LOAD] = &&LOAD,
+        [CALL] = &&CALL,
+        [CALL1] = &&CALL1,
+        [CALL2] = &&CALL2,
+        [CALL3] = &&CALL3,
+        [PRIM] = &&PRIM,
+        [PRIM_BINARY] = &&PRIM_BINARY,
+        [JT] = &&JT,
+        [JMP] = &&JMP,
+        [JLT] = &&JLT,
+        [JGE] = &&JGE,
+        [JLT_CONST] = &&JLT_CONST,
+        [JGE_CONST] = &&JGE_CONST,
+        [RET] = &&RET,
+        [STORE] = &&STORE,
+        [YIELD] = &&YIELD,
+        [CONST_0] = &&CONST_0,
+        [CONST_1] = &&CONST_1,
+        [CONST_2] = &&CONST_2,
+        [SUB1] = &&SUB1,
+        [SUB2] = &&SUB2,
+        [ADD1] = &&ADD1
+    };
+
+    if (script == NULL) {
+        instruction_labels = labels;
+        return TURN_DONE;
+    }
+
+    // Interpreter state
+
+    const struct function *functions = script->image->functions;
+    word_t *ip = script->ip;
+    word_t *sp = script->sp;
+    word_t *bp = script->bp;
+    word_t *stack_limit = script->stack_limit;
+
+    word_t word;
+    word_t word2;
+    word_t *words;
+    const struct function *fun;
+    int64_t offset;
+
+    GOTO_NEXT;
+
+LIT:
+    word = FETCH();
+    #ifdef TRACE
+        printf("LIT %lld\n", (long long) word);
+    #endif
+    PUSH(word);
+    GOTO_NEXT;
+
+CONST_0:
+    PUSH(0);
+    GOTO_NEXT;
+
+CONST_1:
+    PUSH(1);
+    GOTO_NEXT;
+
+CONST_2:
+    PUSH(2);
+    GOTO_NEXT;
+
+SUB1:
+    *((int64_t *)(sp - 1)) -= 1;
+    GOTO_NEXT;
+
+SUB2:
+    *((int64_t *)(sp - 1)) -= 2;
+    GOTO_NEXT;
+
+ADD1:
+    *((int64_t *)(sp - 1)) += 1;
+    GOTO_NEXT;
+
+LOAD:
+    offset = FETCH();
+    #ifdef TRACE
+        printf("LOAD %lld\n", (long long) offset);
+    #endif
+    PUSH(*(bp + offset));
+    GOTO_NEXT;
+
+STORE:
+    offset = FETCH();
+    #ifdef TRACE
+        printf("STORE %lld\n", (long long) offset);
+    #endif
+    *(bp + offset) = POP();
+    GOTO_NEXT;
+
+YIELD:
+    #ifdef TRACE
+        printf("YIELD\n");
+    #endif
+    SUSPEND(TURN_YIELDED);
+
+// With the args pushed: stop if the frame of the callee may not fit, at the call.
+#define CHECK_STACK() do { \
+        if (sp > stack_limit) { \
+            ip -= 1; \
+            SUSPEND(TURN_STACK_OVERFLOW); \
+        } \
+    } while (0)
+
+CALL:
+    CHECK_STACK();
+    fun = functions + FETCH(); // function ID
+    word = FETCH();
+    #ifdef TRACE
+        printf("CALL %lld\n", (long long) word);
+    #endif
+
+    // push frame
+    words = bp;
+    bp = sp;
+    PUSH((word_t) words);
+    PUSH((word_t) ip);
+    PUSH(word); // args to pop later
+
+    sp += fun->frame_size;
+    ip = fun->code;
+    PREEMPTION_POINT();
+    GOTO_NEXT;
+
+// A linked call of 'arity' args.
+#define LINKED_CALL(arity) \
+    do { \
+        CHECK_STACK(); \
+        words = (word_t *) FETCH(); /* callee code */ \
+        word = FETCH(); /* frame size */ \
+        word2 = (word_t) bp; \
+        bp = sp; \
+        PUSH(word2); \
+        PUSH((word_t) ip); \
+        PUSH(arity); /* args to pop later */ \
+        sp += word; \
+        ip = words; \
+        PREEMPTION_POINT(); \
+    } while (0)
+
+CALL1:
+    #ifdef TRACE
+        printf("CALL1\n");
+    #endif
+    LINKED_CALL(1);
+    GOTO_NEXT;
+
+CALL2:
+    #ifdef TRACE
+        printf("CALL2\n");
+    #endif
+    LINKED_CALL(2);
+    GOTO_NEXT;
+
+CALL3:
+    #ifdef TRACE
+        printf("CALL3\n");
+    #endif
+    LINKED_CALL(3);
+    GOTO_NEXT;
+
+PRIM:
+    word = FETCH();
+    #ifdef TRACE
+        printf("PRIM %lld\n", (long long) word);
+    #endif
+    sp = stack_primitives[word](sp);
+    GOTO_NEXT;
+
+PRIM_BINARY:
+    word = FETCH();
+    #ifdef TRACE
+        printf("PRIM_BINARY %lld\n", (long long) word);
+    #endif
+    word2 = POP(); // rhs
+    *(sp - 1) = binary_primitives[word](*(sp - 1), word2);
+    GOTO_NEXT;
+
+JT:
+    offset = FETCH();
+    word = POP();
+    #ifdef TRACE
+        printf("JT %lld (%lld)\n", (long long) offset, (long long) word);
+    #endif
+    if (word) {
+        JUMP(offset, 2);
+    }
+    GOTO_NEXT;
+
+JLT:
+    offset = FETCH();
+    word2 = POP(); // rhs
+    word = POP();
+    #ifdef TRACE
+        printf("JLT %lld (%lld < %lld)\n", (long long) offset, (long long) word, (long long) word2);
+    #endif
+    if ((int64_t) word < (int64_t) word2) {
+        JUMP(offset, 2);
+    }
+    GOTO_NEXT;
+
+JGE:
+    offset = FETCH();
+    word2 = POP(); // rhs
+    word = POP();
+    #ifdef TRACE
+        printf("JGE %lld (%lld >= %lld)\n", (long long) offset, (long long) word, (long long) word2);
+    #endif
+    if ((int64_t) word >= (int64_t) word2) {
+        JUMP(offset, 2);
+    }
+    GOTO_NEXT;
+
+JLT_CONST:
+    word2 = FETCH(); // rhs
+    offset = FETCH();
+    word = POP();
+    #ifdef TRACE
+        printf("JLT_CONST %lld %lld (%lld)\n", (long long) word2, (long long) offset, (long long) word);
+    #endif
+    if ((int64_t) word < (int64_t) word2) {
+        JUMP(offset, 3);
+    }
+    GOTO_NEXT;
+
+JGE_CONST:
+    word2 = FETCH(); // rhs
+    offset = FETCH();
+    word = POP();
+    #ifdef TRACE
+        printf("JGE_CONST %lld %lld (%lld)\n", (long long) word2, (long long) offset, (long long) word);
+    #endif
+    if ((int64_t) word >= (int64_t) word2) {
+        JUMP(offset, 3);
+    }
+    GOTO_NEXT;
+
+JMP:
+    offset = FETCH();
+    #ifdef TRACE
+        printf("JMP %lld\n", (long long) offset);
+    #endif
+    JUMP(offset, 2);
+    GOTO_NEXT;
+
+RET:
+    word = POP();
+    #ifdef TRACE
+        printf("RET %lld\n", (long long) word);
+    #endif
+
+    // pop_frame
+    sp = bp + 3;
+    word2 = POP(); // args to pop
+    ip = (word_t *) POP();
+    bp = (word_t *) POP();
+    sp -= word2;
+
+    if (ip == NULL) {
+        script->result = word;
+        SUSPEND(TURN_DONE);
+    }
+    PUSH(word);
+    GOTO_NEXT;
+}
+
+struct green_image *load_green_image(const struct program *program)
+{
+    struct green_image *image = checked_malloc(sizeof(struct green_image), program->name);
+    execute(NULL, 0);
+    image->program = program;
+    image->functions = load_program(program, instruction_labels);
+    // Each instruction pushes at most one operand, and there are fewer than code words.
+    image->max_frame = 0;
+    for (size_t i = 0; i < program->function_count; i++) {
+        const struct bytecode_function *fun = program->functions + i;
+        size_t frame = FRAME_HEADER_SIZE + fun->locals + fun->code_size;
+        if (frame > image->max_frame) image->max_frame = frame;
+    }
+    return image;
+}
+
+void free_green_image(struct green_image *image)
+{
+    free_program(image->functions, image->program->function_count);
+    free(image);
+}
+
+// Set up 'script' to run the entry function of 'image' on 'args' in 'stack'. False if
+// the stack cannot even hold its frame.
+static bool start_script(struct script *script, const struct green_image *image, const uint64_t *args, word_t *stack, size_t stack_size)
+{
+    const struct function *entry = image->functions;
+    memset(script, 0, sizeof(*script));
+    script->image = image;
+    script->stack = stack;
+    if (entry->arity + image->max_frame > stack_size) {
+        script->status = SCRIPT_STACK_OVERFLOW;
+        return false;
+    }
+    script->stack_limit = stack + stack_size - image->max_frame;
+    word_t *sp = stack;
+    for (size_t i = 0; i < entry->arity; i++) {
+        *sp++ = args[i];
+    }
+    script->bp = sp; // the args notionally are in the callee frame
+    *sp++ = 0; // no prev. BP
+    *sp++ = 0; // no prev. IP
+    *sp++ = 0; // no args
+    script->sp = sp + entry->frame_size;
+    script->ip = entry->code;
+    script->status = SCRIPT_RUNNABLE;
+    return true;
+}
+
+struct worker {
+    pthread_mutex_t lock;
+    struct script *head; // the queue of runnable scripts
+    struct script *tail;
+    struct scheduler *scheduler;
+    uint64_t random; // the state of the xorshift choosing whom to steal from
+    struct scheduler_stats stats;
+    pthread_t thread;
+} __attribute__((aligned(CACHE_LINE_SIZE)));
+
+struct scheduler {
+    struct worker *workers;
+    size_t worker_count;
+    uint64_t budget;
+    size_t stack_size;
+    struct script *spawned; // all scripts, latest first
+    size_t spawned_count;
+    atomic_size_t remaining; // scripts runnable
+};
+
+static void *checked_aligned_malloc(size_t size, const char *what)
+{
+    void *memory = aligned_alloc(CACHE_LINE_SIZE, (size + CACHE_LINE_SIZE - 1) / CACHE_LINE_SIZE * CACHE_LINE_SIZE);
+    if (memory == NULL) {
+        fprintf(stderr, "ERROR: Out of memory allocating %s.\n", what);
+        abort();
+    }
+    return memory;
+}
+
+struct scheduler *new_scheduler(size_t worker_count, uint64_t budget, size_t stack_size)
+{
+    if (worker_count == 0 || budget == 0) {
+        fprintf(stderr, "ERROR: A scheduler needs a worker and a budget.\n");
+        abort();
+    }
+    struct scheduler *scheduler = checked_aligned_malloc(sizeof(struct scheduler), "a scheduler");
+    scheduler->workers = checked_aligned_malloc(worker_count * sizeof(struct worker), "the workers");
+    scheduler->worker_count = worker_count;
+    scheduler->budget = budget;
+    scheduler->stack_size = stack_size;
+    scheduler->spawned = NULL;
+    scheduler->spawned_count = 0;
+    atomic_init(&scheduler->remaining, 0);
+    for (size_t i = 0; i < worker_count; i++) {
+        struct worker *worker = scheduler->workers + i;
+        memset(worker, 0, sizeof(*worker));
+        pthread_mutex_init(&worker->lock, NULL);
+        worker->scheduler = scheduler;
+        worker->random = 0x9e3779b97f4a7c15u * (i + 1);
+    }
+    return scheduler;
+}
+
+void free_scheduler(struct scheduler *scheduler)
+{
+    for (struct script *script = scheduler->spawned; script != NULL; ) {
+        struct script *next = script->next_spawned;
+        free(script->stack);
+        free(script);
+        script = next;
+    }
+    for (size_t i = 0; i < scheduler->worker_count; i++) {
+        pthread_mutex_destroy(&scheduler->workers[i].lock);
+    }
+    free(scheduler->workers);
+    free(scheduler);
+}
+
+static void push_script(struct worker *worker, struct script *script)
+{
+    script->next = NULL;
+    pthread_mutex_lock(&worker->lock);
+    if (worker->tail != NULL) {
+        worker->tail->next = script;
+    } else {
+        worker->head = script;
+    }
+    worker->tail = script;
+    pthread_mutex_unlock(&worker->lock);
+}
+
+static struct script *pop_script(struct worker *worker)
+{
+    pthread_mutex_lock(&worker->lock);
+    struct script *script = worker->head;
+    if (script != NULL) {
+        worker->head = script->next;
+        if (worker->head == NULL) worker->tail = NULL;
+    }
+    pthread_mutex_unlock(&worker->lock);
+    return script;
+}
+
+struct script *spawn_script(struct scheduler *scheduler, const struct green_image *image, const uint64_t *args)
+{
+    struct script *script = checked_malloc(sizeof(struct script), image->program->name);
+    // Only the part of the stack a script uses is ever touched, and so committed.
+    word_t *stack = checked_malloc(scheduler->stack_size * sizeof(word_t), "a script stack");
+    if (start_script(script, image, args, stack, scheduler->stack_size)) {
+        push_script(scheduler->workers + scheduler->spawned_count % scheduler->worker_count, script);
+        atomic_fetch_add(&scheduler->remaining, 1);
+    }
+    script->next_spawned = scheduler->spawned;
+    scheduler->spawned = script;
+    scheduler->spawned_count++;
+    return script;
+}
+
+static struct script *steal_script(struct worker *worker)
+{
+    struct scheduler *scheduler = worker->scheduler;
+    size_t count = scheduler->worker_count;
+    worker->random ^= worker->random << 13;
+    worker->random ^= worker->random >> 7;
+    worker->random ^= worker->random << 17;
+    size_t first = worker->random % count;
+    for (size_t i = 0; i < count; i++) {
+        struct worker *victim = scheduler->workers + (first + i) % count;
+        if (victim == worker) continue;
+        struct script *script = pop_script(victim);
+        if (script != NULL) {
+            worker->stats.steals++;
+            return script;
+        }
+    }
+    return NULL;
+}
+
+static void *run_worker(void *arg)
+{
+    struct worker *worker = arg;
+    struct scheduler *scheduler = worker->scheduler;
+    while (atomic_load_explicit(&scheduler->remaining, memory_order_acquire) > 0) {
+        struct script *script = pop_script(worker);
+        if (script == NULL) script = steal_script(worker);
+        if (script == NULL) {
+            sched_yield(); // the last scripts are running on other workers
+            continue;
+        }
+        worker->stats.turns++;
+        switch (execute(script, scheduler->budget)) {
+            case TURN_YIELDED:
+                worker->stats.yields++;
+                push_script(worker, script);
+                break;
+            case TURN_PREEMPTED:
+                worker->stats.preemptions++;
+                push_script(worker, script);
+                break;
+            case TURN_DONE:
+                script->status = SCRIPT_DONE;
+                atomic_fetch_sub_explicit(&scheduler->remaining, 1, memory_order_release);
+                break;
+            case TURN_STACK_OVERFLOW:
+                script->status = SCRIPT_STACK_OVERFLOW;
+                atomic_fetch_sub_explicit(&scheduler->remaining, 1, memory_order_release);
+                break;
+        }
+    }
+    return NULL;
+}
+
+void run_scheduler(struct scheduler *scheduler)
+{
+    for (size_t i = 1; i < scheduler->worker_count; i++) {
+        if (pthread_create(&scheduler->workers[i].thread, NULL, run_worker, scheduler->workers + i) != 0) {
+            fprintf(stderr, "ERROR: Cannot start worker %zu.\n", i);
+            abort();
+        }
+    }
+    run_worker(scheduler->workers);
+    for (size_t i = 1; i < scheduler->worker_count; i++) {
+        pthread_join(scheduler->workers[i].thread, NULL);
+    }
+}
+
+enum script_status script_result(const struct script *script, uint64_t *result)
+{
+    if (script->status == SCRIPT_DONE) *result = script->result;
+    return script->status;
+}
+
+void get_scheduler_stats(const struct scheduler *scheduler, struct scheduler_stats *stats)
+{
+    memset(stats, 0, sizeof(*stats));
+    for (size_t i = 0; i < scheduler->worker_count; i++) {
+        const struct scheduler_stats *worker = &scheduler->workers[i].stats;
+        stats->turns += worker->turns;
+        stats->yields += worker->yields;
+        stats->preemptions += worker->preemptions;
+        stats->steals += worker->steals;
+    }
+}
+
+// Uses the default superinstructions table. The program is loaded on first use, and
+// reloaded when a different one is run.
+uint64_t run_program(const struct program *program, const uint64_t *args)
+{
+    static struct green_image *image;
+    static word_t stack[HARNESS_STACK_SIZE];
+    if (image == NULL || image->program != program) {
+        if (image != NULL) free_green_image(image);
+        image = load_green_image(program);
+    }
+    struct script script;
+    if (!start_script(&script, image, args, stack, HARNESS_STACK_SIZE)) {
+        fprintf(stderr, "ERROR: Stack overflow.\n");
+        abort();
+    }
+    for (;;) {
+        switch (execute(&script, DEFAULT_BUDGET)) {
+            case TURN_DONE:
+                return script.result;
+            case TURN_STACK_OVERFLOW:
+                fprintf(stderr, "ERROR: Stack overflow.\n");
+                abort();
+            default:
+                break;
+        }
+    }
+}
+
+uint64_t run(uint64_t arg)
+{
+    return run_program(&fib_program, &arg);
+}
+
+#ifndef HARNESS
+int main(int argc, const char *argv[])
+{
+    const struct program *program;
+    word_t args[MAX_BENCHMARK_ARGS];
+    if (!parse_program_args(argc, argv, &program, args)) {
+        fprintf(stderr, "Usage: %s <n> | <program> [args...]\n", argv[0]);
+        return 1;
+    }
+    printf("threadedgreen\n");
+
+    struct green_image *image = load_green_image(program);
+    struct scheduler *scheduler = new_scheduler(1, DEFAULT_BUDGET, DEFAULT_SCRIPT_STACK_SIZE);
+    struct script *script = spawn_script(scheduler, image, args);
+
+    clock_t start = clock();
+    run_scheduler(scheduler);
+    clock_t end = clock();
+    long ms = (end - start) / (CLOCKS_PER_SEC / 1000);
+
+    struct scheduler_stats stats;
+    get_scheduler_stats(scheduler, &stats);
+    word_t result;
+    if (script_result(script, &result) != SCRIPT_DONE) {
+        fprintf(stderr, "ERROR: Stack overflow.\n");
+        return 1;
+    }
+    printf("Done in %ld ms\n", ms);
+    printf("%llu turns (%llu yields, %llu preemptions)\n", (unsigned long long) stats.turns,
+        (unsigned long long) stats.yields, (unsigned long long) stats.preemptions);
+    printf("=> %lld\n", (long long) result);
+    free_scheduler(scheduler);
+    free_green_image(image);
+}
+#endif
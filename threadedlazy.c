@@ -0,0 +1,500 @@
+/*
+    Derived from threadedlink.c:
+
+        Lazy loading from a memory-mapped image file (imagefile.h). mkimage.c writes
+        the programs of programs.h to image files, and this engine runs one with
+        -i: the file is mapped read-only and shared, so that all the processes
+        running the same image share its pages, and the struct program of the image
+        points into the mapping.
+
+        Nothing is translated before the run: each function starts as a stub, LAZY
+        index (load_lazy_program() of loader.h), to which calls are linked. The first
+        call of a function runs the stub, which translates the function, reading its
+        bytecode for the first time, and continues in the translated code. When the
+        call came from a linked call, LAZY also relinks that call site to the
+        translated code, found from the return IP of the frame: each site pays for
+        the stub once. Startup costs the pages of the header and the function table,
+        and then only the code that actually runs.
+
+    Observations (GCC 12, Clang was not available):
+
+        - One more dispatch than threadedlink per run, that of the stub of the
+          entry function; each other call site goes through a stub at most once.
+          Once loaded, the code is that of threadedlink, and so is the speed: bench
+          has it 1-30% faster, which is code layout and noise.
+        - The image files of the programs are 400 to 900 bytes, a single page. All
+          of these programs have a single function, so there is nothing to skip;
+          with a program calling 2 of its 3 functions, the third is never translated.
+
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "bytecode.h"
+#include "harness.h"
+#include "imagefile.h"
+#include "loader.h"
+#include "programs.h"
+
+// #define TRACE
+
+#define STACK_SIZE (1 << 16) // deep enough for ack(3, 8)
+static word_t stack[STACK_SIZE];
+
+MAYBE_UNUSED
+static void print_stack(word_t *sp)
+{
+    printf("--- stack %p ---\n", sp);
+    for (word_t *entry = stack; entry < sp; entry++) {
+        printf("  %lld\n", (long long) *entry);
+    }
+    printf("------\n");
+}
+
+// Two operands and one result (primitive_infos), by value.
+typedef word_t (*binary_primitive_t)(word_t lhs, word_t rhs);
+// Any other arity: take the stack pointer and return the new one.
+typedef word_t *(*stack_primitive_t)(word_t *sp);
+
+static word_t lessThan(word_t lhs, word_t rhs)
+{
+    bool result = (int64_t) lhs < (int64_t) rhs;
+    #ifdef TRACE
+        printf("%lld < %lld => %s\n", (long long) lhs, (long long) rhs, result ? "true" : "false");
+    #endif
+    return result;
+}
+
+static word_t subtract(word_t lhs, word_t rhs)
+{
+    int64_t result = (int64_t) lhs - (int64_t) rhs;
+    #ifdef TRACE
+        printf("%lld - %lld => %lld\n", (long long) lhs, (long long) rhs, (long long) result);
+    #endif
+    return result;
+}
+
+static word_t add(word_t lhs, word_t rhs)
+{
+    int64_t result = (int64_t) lhs + (int64_t) rhs;
+    #ifdef TRACE
+        printf("%lld + %lld => %lld\n", (long long) lhs, (long long) rhs, (long long) result);
+    #endif
+    return result;
+}
+
+static word_t *newArray(word_t *sp)
+{
+    word_t size = *(--sp);
+    word_t *array = calloc(size, sizeof(word_t));
+    if (array == NULL) {
+        fprintf(stderr, "ERROR: Cannot allocate an array of %llu words.\n", (unsigned long long) size);
+        abort();
+    }
+    #ifdef TRACE
+        printf("newArray %llu => %p\n", (unsigned long long) size, (void *) array);
+    #endif
+    *(sp++) = (word_t) array;
+    return sp;
+}
+
+static word_t at(word_t array, word_t index)
+{
+    #ifdef TRACE
+        printf("%p at %llu => %llu\n", (void *) array, (unsigned long long) index,
+            (unsigned long long) ((word_t *) array)[index]);
+    #endif
+    return ((word_t *) array)[index];
+}
+
+static word_t *atPut(word_t *sp)
+{
+    word_t value = *(--sp);
+    word_t index = *(--sp);
+    word_t *array = (word_t *) *(--sp);
+    #ifdef TRACE
+        printf("%p at %llu put %llu\n", (void *) array, (unsigned long long) index, (unsigned long long) value);
+    #endif
+    array[index] = value;
+    return sp;
+}
+
+static word_t *freeArray(word_t *sp)
+{
+    free((word_t *) *(--sp));
+    return sp;
+}
+
+// Indexed by primitive, each primitive in the table of its signature.
+static const binary_primitive_t binary_primitives[PRIMITIVE_COUNT] = {
+    [PRIM_LESS_THAN] = lessThan,
+    [PRIM_SUBTRACT] = subtract,
+    [PRIM_ADD] = add,
+    [PRIM_AT] = at
+};
+
+static const stack_primitive_t stack_primitives[PRIMITIVE_COUNT] = {
+    [PRIM_NEW_ARRAY] = newArray,
+    [PRIM_AT_PUT] = atPut,
+    [PRIM_FREE_ARRAY] = freeArray
+};
+
+#define GOTO_NEXT do { COUNT_DISPATCH(); goto *((void*) *ip++); } while (0)
+#define PUSH(expr) *sp++ = expr
+#define POP() *--sp
+#define FETCH() *ip++
+
+// Set up by calling execute() with no program. Passed to the loader.
+static void *const *instruction_labels;
+
+static word_t execute(struct lazy_program *lazy, const word_t *args)
+{
+    static void *const labels[INSTRUCTION_COUNT] = {
+        [LIT] = &&LIT,
+        [LOAD] = &&LOAD,
+        [CALL] = &&CALL,
+        [CALL1] = &&CALL1,
+        [CALL2] = &&CALL2,
+        [CALL3] = &&CALL3,
+        [PRIM] = &&PRIM,
+        [PRIM_BINARY] = &&PRIM_BINARY,
+        [JT] = &&JT,
+        [JMP] = &&JMP,
+        [JLT] = &&JLT,
+        [JGE] = &&JGE,
+        [JLT_CONST] = &&JLT_CONST,
+        [JGE_CONST] = &&JGE_CONST,
+        [RET] = &&RET,
+        [STORE] = &&STORE,
+        [CONST_0] = &&CONST_0,
+        [CONST_1] = &&CONST_1,
+        [CONST_2] = &&CONST_2,
+        [SUB1] = &&SUB1,
+        [SUB2] = &&SUB2,
+        [ADD1] = &&ADD1,
+        [LAZY] = &&LAZY
+    };
+
+    if (lazy == NULL) {
+        instruction_labels = labels;
+        return 0;
+    }
+
+    // Interpreter state
+
+    const struct function *functions = lazy->functions;
+    const struct function *entry = functions;
+
+    word_t *ip = entry->code;
+    word_t *sp = stack;
+    word_t *bp;
+
+    word_t word;
+    word_t word2;
+    word_t *words;
+    const struct function *fun;
+    int64_t offset;
+
+    // Initial setup
+
+    for (size_t i = 0; i < entry->arity; i++) {
+        PUSH(args[i]);
+    }
+    bp = sp; // the args notionally are in the callee frame
+    PUSH(0); // no prev. BP
+    PUSH(0); // no prev. IP
+    PUSH(0); // no args
+    sp += entry->frame_size;
+    GOTO_NEXT;
+
+LIT:
+    word = FETCH();
+    #ifdef TRACE
+        printf("LIT %lld\n", (long long) word);
+    #endif
+    PUSH(word);
+    GOTO_NEXT;
+
+CONST_0:
+    PUSH(0);
+    GOTO_NEXT;
+
+CONST_1:
+    PUSH(1);
+    GOTO_NEXT;
+
+CONST_2:
+    PUSH(2);
+    GOTO_NEXT;
+
+SUB1:
+    *((int64_t *)(sp - 1)) -= 1;
+    GOTO_NEXT;
+
+SUB2:
+    *((int64_t *)(sp - 1)) -= 2;
+    GOTO_NEXT;
+
+ADD1:
+    *((int64_t *)(sp - 1)) += 1;
+    GOTO_NEXT;
+
+LOAD:
+    offset = FETCH();
+    #ifdef TRACE
+        printf("LOAD %lld\n", (long long) offset);
+    #endif
+    PUSH(*(bp + offset));
+    GOTO_NEXT;
+
+STORE:
+    offset = FETCH();
+    #ifdef TRACE
+        printf("STORE %lld\n", (long long) offset);
+    #endif
+    *(bp + offset) = POP();
+    GOTO_NEXT;
+
+CALL:
+    fun = functions + FETCH(); // function ID
+    word = FETCH();
+    #ifdef TRACE
+        printf("CALL %lld\n", (long long) word);
+    #endif
+
+    // push frame
+    words = bp;
+    bp = sp;
+    PUSH((word_t) words);
+    PUSH((word_t) ip);
+    PUSH(word); // args to pop later
+
+    sp += fun->frame_size;
+    ip = fun->code;
+    GOTO_NEXT;
+
+// A linked call of 'arity' args.
+#define LINKED_CALL(arity) \
+    do { \
+        words = (word_t *) FETCH(); /* callee code */ \
+        word = FETCH(); /* frame size */ \
+        word2 = (word_t) bp; \
+        bp = sp; \
+        PUSH(word2); \
+        PUSH((word_t) ip); \
+        PUSH(arity); /* args to pop later */ \
+        sp += word; \
+        ip = words; \
+    } while (0)
+
+CALL1:
+    #ifdef TRACE
+        printf("CALL1\n");
+    #endif
+    LINKED_CALL(1);
+    GOTO_NEXT;
+
+CALL2:
+    #ifdef TRACE
+        printf("CALL2\n");
+    #endif
+    LINKED_CALL(2);
+    GOTO_NEXT;
+
+CALL3:
+    #ifdef TRACE
+        printf("CALL3\n");
+    #endif
+    LINKED_CALL(3);
+    GOTO_NEXT;
+
+LAZY:
+    word = FETCH(); // function index
+    #ifdef TRACE
+        printf("LAZY %s\n", lazy->program->functions[word].name);
+    #endif
+    words = ip - 2; // the stub
+    ip = load_lazy_function(lazy, word)->code;
+    // A linked call site holds the stub right before the frame size, before the return IP.
+    word2 = *(bp + 1); // return IP
+    if (word2 != 0 && ((word_t *) word2)[-2] == (word_t) words) {
+        ((word_t *) word2)[-2] = (word_t) ip;
+    }
+    GOTO_NEXT;
+
+PRIM:
+    word = FETCH();
+    #ifdef TRACE
+        printf("PRIM %lld\n", (long long) word);
+    #endif
+    sp = stack_primitives[word](sp);
+    GOTO_NEXT;
+
+PRIM_BINARY:
+    word = FETCH();
+    #ifdef TRACE
+        printf("PRIM_BINARY %lld\n", (long long) word);
+    #endif
+    word2 = POP(); // rhs
+    *(sp - 1) = binary_primitives[word](*(sp - 1), word2);
+    GOTO_NEXT;
+
+JT:
+    offset = FETCH();
+    word = POP();
+    #ifdef TRACE
+        printf("JT %lld (%lld)\n", (long long) offset, (long long) word);
+    #endif
+    if (word) {
+        ip = ip + offset - 2;
+    }
+    GOTO_NEXT;
+
+JLT:
+    offset = FETCH();
+    word2 = POP(); // rhs
+    word = POP();
+    #ifdef TRACE
+        printf("JLT %lld (%lld < %lld)\n", (long long) offset, (long long) word, (long long) word2);
+    #endif
+    if ((int64_t) word < (int64_t) word2) {
+        ip = ip + offset - 2;
+    }
+    GOTO_NEXT;
+
+JGE:
+    offset = FETCH();
+    word2 = POP(); // rhs
+    word = POP();
+    #ifdef TRACE
+        printf("JGE %lld (%lld >= %lld)\n", (long long) offset, (long long) word, (long long) word2);
+    #endif
+    if ((int64_t) word >= (int64_t) word2) {
+        ip = ip + offset - 2;
+    }
+    GOTO_NEXT;
+
+JLT_CONST:
+    word2 = FETCH(); // rhs
+    offset = FETCH();
+    word = POP();
+    #ifdef TRACE
+        printf("JLT_CONST %lld %lld (%lld)\n", (long long) word2, (long long) offset, (long long) word);
+    #endif
+    if ((int64_t) word < (int64_t) word2) {
+        ip = ip + offset - 3;
+    }
+    GOTO_NEXT;
+
+JGE_CONST:
+    word2 = FETCH(); // rhs
+    offset = FETCH();
+    word = POP();
+    #ifdef TRACE
+        printf("JGE_CONST %lld %lld (%lld)\n", (long long) word2, (long long) offset, (long long) word);
+    #endif
+    if ((int64_t) word >= (int64_t) word2) {
+        ip = ip + offset - 3;
+    }
+    GOTO_NEXT;
+
+JMP:
+    offset = FETCH();
+    #ifdef TRACE
+        printf("JMP %lld\n", (long long) offset);
+    #endif
+    ip = ip + offset - 2;
+    GOTO_NEXT;
+
+RET:
+    word = POP();
+    #ifdef TRACE
+        printf("RET %lld\n", (long long) word);
+    #endif
+
+    // pop_frame
+    sp = bp + 3;
+    word2 = POP(); // args to pop
+    ip = (word_t *) POP();
+    bp = (word_t *) POP();
+    sp -= word2;
+
+    if (ip == NULL) {
+        return word;
+    }
+    PUSH(word);
+    GOTO_NEXT;
+}
+
+// Uses the default superinstructions table. The program is loaded on first use, and
+// reloaded when a different one is run; each function when first called.
+uint64_t run_program(const struct program *program, const uint64_t *args)
+{
+    static struct lazy_program *lazy;
+    if (lazy == NULL || lazy->program != program) {
+        if (lazy != NULL) free_lazy_program(lazy);
+        execute(NULL, NULL);
+        lazy = load_lazy_program(program, instruction_labels);
+    }
+    return execute(lazy, args);
+}
+
+uint64_t run(uint64_t arg)
+{
+    return run_program(&fib_program, &arg);
+}
+
+#ifndef HARNESS
+// -i <image file> [args...]: the args of its benchmark by default, if it has one.
+static bool parse_image_args(int argc, const char *argv[], struct mapped_program **mapped, word_t *args)
+{
+    if (argc < 3 || strcmp(argv[1], "-i") != 0) return false;
+    *mapped = map_image_file(argv[2]);
+    if (*mapped == NULL) exit(1);
+    const struct program *program = &(*mapped)->program;
+    size_t arity = program->functions[0].arity;
+    const struct benchmark *benchmark = find_benchmark(program->name);
+    if (argc == 3 && benchmark != NULL && benchmark->program->functions[0].arity == arity) {
+        memcpy(args, benchmark->args, arity * sizeof(word_t));
+        return true;
+    }
+    if ((size_t) argc - 3 != arity || arity > MAX_BENCHMARK_ARGS) return false;
+    for (size_t i = 0; i < arity; i++) {
+        if (!parse_word(argv[i + 3], args + i)) return false;
+    }
+    return true;
+}
+
+int main(int argc, const char *argv[])
+{
+    const struct program *program;
+    struct mapped_program *mapped = NULL;
+    word_t args[MAX_BENCHMARK_ARGS];
+    if (parse_image_args(argc, argv, &mapped, args)) {
+        program = &mapped->program;
+    } else if (mapped != NULL || !parse_program_args(argc, argv, &program, args)) {
+        fprintf(stderr, "Usage: %s <n> | <program> [args...] | -i <image file> [args...]\n", argv[0]);
+        return 1;
+    }
+    printf("threadedlazy\n");
+
+    execute(NULL, NULL);
+    struct lazy_program *lazy = load_lazy_program(program, instruction_labels);
+
+    clock_t start = clock();
+    word_t result = execute(lazy, args);
+    clock_t end = clock();
+    long ms = (end - start) / (CLOCKS_PER_SEC / 1000);
+
+    printf("Done in %ld ms\n", ms);
+    printf("=> %lld\n", (long long) result);
+    printf("Loaded %zu of %zu functions\n", lazy->loaded_count, program->function_count);
+    free_lazy_program(lazy);
+    if (mapped != NULL) unmap_image_file(mapped);
+}
+#endif
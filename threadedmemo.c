@@ -0,0 +1,491 @@
+/*
+    Derived from threadedlink.c:
+
+        Memoization of the calls of pure functions (memo.h). Functions are marked
+        pure in the program (fib, tak and ack are), and the loader checks that they
+        only call pure primitives and functions. Their calls, up to MAX_MEMO_ARITY
+        args, become MEMO_CALL f, n; MEMO_STORE: the result is looked up in a cache,
+        and stored there on return from a miss. The calls of other functions are the
+        CALL1 to CALL3 of threadedlink.c, as fast as without the cache.
+
+        The cache is that of the interpreter, cleared at the start of each run so
+        that runs do not get the results of the previous ones. main() writes its
+        hit, miss and eviction counters.
+
+    Observations (GCC 12, Clang was not available):
+
+        - fib 27 makes 52 lookups instead of 832039 calls, and runs 1000x faster.
+          The 5 us it takes are mostly clearing the 192 KiB of the cache. tak gets
+          750x. ack has 20x fewer dispatches and runs 75x faster: its 5118 keys
+          fill the 4096 entries, so 1023 are evicted and 17% of lookups hit.
+        - loop, nested and sieve make no calls, and run at the speed of
+          threadedlink.
+
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "bytecode.h"
+#include "harness.h"
+#include "loader.h"
+#include "memo.h"
+#include "programs.h"
+
+// #define TRACE
+
+#define STACK_SIZE (1 << 16) // deep enough for ack(3, 8)
+static word_t stack[STACK_SIZE];
+
+MAYBE_UNUSED
+static void print_stack(word_t *sp)
+{
+    printf("--- stack %p ---\n", sp);
+    for (word_t *entry = stack; entry < sp; entry++) {
+        printf("  %lld\n", (long long) *entry);
+    }
+    printf("------\n");
+}
+
+// Two operands and one result (primitive_infos), by value.
+typedef word_t (*binary_primitive_t)(word_t lhs, word_t rhs);
+// Any other arity: take the stack pointer and return the new one.
+typedef word_t *(*stack_primitive_t)(word_t *sp);
+
+static word_t lessThan(word_t lhs, word_t rhs)
+{
+    bool result = (int64_t) lhs < (int64_t) rhs;
+    #ifdef TRACE
+        printf("%lld < %lld => %s\n", (long long) lhs, (long long) rhs, result ? "true" : "false");
+    #endif
+    return result;
+}
+
+static word_t subtract(word_t lhs, word_t rhs)
+{
+    int64_t result = (int64_t) lhs - (int64_t) rhs;
+    #ifdef TRACE
+        printf("%lld - %lld => %lld\n", (long long) lhs, (long long) rhs, (long long) result);
+    #endif
+    return result;
+}
+
+static word_t add(word_t lhs, word_t rhs)
+{
+    int64_t result = (int64_t) lhs + (int64_t) rhs;
+    #ifdef TRACE
+        printf("%lld + %lld => %lld\n", (long long) lhs, (long long) rhs, (long long) result);
+    #endif
+    return result;
+}
+
+static word_t *newArray(word_t *sp)
+{
+    word_t size = *(--sp);
+    word_t *array = calloc(size, sizeof(word_t));
+    if (array == NULL) {
+        fprintf(stderr, "ERROR: Cannot allocate an array of %llu words.\n", (unsigned long long) size);
+        abort();
+    }
+    #ifdef TRACE
+        printf("newArray %llu => %p\n", (unsigned long long) size, (void *) array);
+    #endif
+    *(sp++) = (word_t) array;
+    return sp;
+}
+
+static word_t at(word_t array, word_t index)
+{
+    #ifdef TRACE
+        printf("%p at %llu => %llu\n", (void *) array, (unsigned long long) index,
+            (unsigned long long) ((word_t *) array)[index]);
+    #endif
+    return ((word_t *) array)[index];
+}
+
+static word_t *atPut(word_t *sp)
+{
+    word_t value = *(--sp);
+    word_t index = *(--sp);
+    word_t *array = (word_t *) *(--sp);
+    #ifdef TRACE
+        printf("%p at %llu put %llu\n", (void *) array, (unsigned long long) index, (unsigned long long) value);
+    #endif
+    array[index] = value;
+    return sp;
+}
+
+static word_t *freeArray(word_t *sp)
+{
+    free((word_t *) *(--sp));
+    return sp;
+}
+
+// Indexed by primitive, each primitive in the table of its signature.
+static const binary_primitive_t binary_primitives[PRIMITIVE_COUNT] = {
+    [PRIM_LESS_THAN] = lessThan,
+    [PRIM_SUBTRACT] = subtract,
+    [PRIM_ADD] = add,
+    [PRIM_AT] = at
+};
+
+static const stack_primitive_t stack_primitives[PRIMITIVE_COUNT] = {
+    [PRIM_NEW_ARRAY] = newArray,
+    [PRIM_AT_PUT] = atPut,
+    [PRIM_FREE_ARRAY] = freeArray
+};
+
+#define GOTO_NEXT do { COUNT_DISPATCH(); goto *((void*) *ip++); } while (0)
+#define PUSH(expr) *sp++ = expr
+#define POP() *--sp
+#define FETCH() *ip++
+
+// Set up by calling execute() with no functions. Passed to the loader.
+static void *const *instruction_labels;
+
+static struct memo_cache memo;
+
+static word_t execute(const struct function *functions, const struct function *entry, const word_t *args)
+{
+    static void *const labels[INSTRUCTION_COUNT] = {
+        [LIT] = &&LIT,
+        [LOAD] = &&LOAD,
+        [CALL] = &&CALL,
+        [CALL1] = &&CALL1,
+        [CALL2] = &&CALL2,
+        [CALL3] = &&CALL3,
+        [PRIM] = &&PRIM,
+        [PRIM_BINARY] = &&PRIM_BINARY,
+        [JT] = &&JT,
+        [JMP] = &&JMP,
+        [JLT] = &&JLT,
+        [JGE] = &&JGE,
+        [JLT_CONST] = &&JLT_CONST,
+        [JGE_CONST] = &&JGE_CONST,
+        [RET] = &&RET,
+        [STORE] = &&STORE,
+        [CONST_0] = &&CONST_0,
+        [CONST_1] = &&CONST_1,
+        [CONST_2] = &&CONST_2,
+        [SUB1] = &&SUB1,
+        [SUB2] = &&SUB2,
+        [ADD1] = &&ADD1,
+        [MEMO_CALL] = &&MEMO_CALL,
+        [MEMO_STORE] = &&MEMO_STORE
+    };
+
+    if (functions == NULL) {
+        instruction_labels = labels;
+        return 0;
+    }
+
+    // Interpreter state
+
+    word_t *ip = entry->code;
+    word_t *sp = stack;
+    word_t *bp;
+
+    word_t word;
+    word_t word2;
+    word_t *words;
+    const struct function *fun;
+    int64_t offset;
+
+    // Initial setup
+
+    memo_clear(&memo);
+
+    for (size_t i = 0; i < entry->arity; i++) {
+        PUSH(args[i]);
+    }
+    bp = sp; // the args notionally are in the callee frame
+    PUSH(0); // no prev. BP
+    PUSH(0); // no prev. IP
+    PUSH(0); // no args
+    sp += entry->frame_size;
+    GOTO_NEXT;
+
+LIT:
+    word = FETCH();
+    #ifdef TRACE
+        printf("LIT %lld\n", (long long) word);
+    #endif
+    PUSH(word);
+    GOTO_NEXT;
+
+CONST_0:
+    PUSH(0);
+    GOTO_NEXT;
+
+CONST_1:
+    PUSH(1);
+    GOTO_NEXT;
+
+CONST_2:
+    PUSH(2);
+    GOTO_NEXT;
+
+SUB1:
+    *((int64_t *)(sp - 1)) -= 1;
+    GOTO_NEXT;
+
+SUB2:
+    *((int64_t *)(sp - 1)) -= 2;
+    GOTO_NEXT;
+
+ADD1:
+    *((int64_t *)(sp - 1)) += 1;
+    GOTO_NEXT;
+
+LOAD:
+    offset = FETCH();
+    #ifdef TRACE
+        printf("LOAD %lld\n", (long long) offset);
+    #endif
+    PUSH(*(bp + offset));
+    GOTO_NEXT;
+
+STORE:
+    offset = FETCH();
+    #ifdef TRACE
+        printf("STORE %lld\n", (long long) offset);
+    #endif
+    *(bp + offset) = POP();
+    GOTO_NEXT;
+
+CALL:
+    fun = functions + FETCH(); // function ID
+    word = FETCH();
+    #ifdef TRACE
+        printf("CALL %lld\n", (long long) word);
+    #endif
+
+    // push frame
+    words = bp;
+    bp = sp;
+    PUSH((word_t) words);
+    PUSH((word_t) ip);
+    PUSH(word); // args to pop later
+
+    sp += fun->frame_size;
+    ip = fun->code;
+    GOTO_NEXT;
+
+// A linked call of 'arity' args.
+#define LINKED_CALL(arity) \
+    do { \
+        words = (word_t *) FETCH(); /* callee code */ \
+        word = FETCH(); /* frame size */ \
+        word2 = (word_t) bp; \
+        bp = sp; \
+        PUSH(word2); \
+        PUSH((word_t) ip); \
+        PUSH(arity); /* args to pop later */ \
+        sp += word; \
+        ip = words; \
+    } while (0)
+
+CALL1:
+    #ifdef TRACE
+        printf("CALL1\n");
+    #endif
+    LINKED_CALL(1);
+    GOTO_NEXT;
+
+CALL2:
+    #ifdef TRACE
+        printf("CALL2\n");
+    #endif
+    LINKED_CALL(2);
+    GOTO_NEXT;
+
+CALL3:
+    #ifdef TRACE
+        printf("CALL3\n");
+    #endif
+    LINKED_CALL(3);
+    GOTO_NEXT;
+
+MEMO_CALL:
+    fun = functions + *ip; // function ID
+    word = *(ip + 1); // args
+    #ifdef TRACE
+        printf("MEMO_CALL %lld\n", (long long) word);
+    #endif
+    if (memo_lookup(&memo, *ip, sp - word, word, &word2)) {
+        sp -= word;
+        PUSH(word2);
+        ip += 3; // past the operands and MEMO_STORE
+        GOTO_NEXT;
+    }
+    ip += 2;
+
+    // push frame, returning to MEMO_STORE
+    words = bp;
+    bp = sp;
+    PUSH((word_t) words);
+    PUSH((word_t) ip);
+    PUSH(word); // args to pop later
+
+    sp += fun->frame_size;
+    ip = fun->code;
+    GOTO_NEXT;
+
+MEMO_STORE:
+    #ifdef TRACE
+        printf("MEMO_STORE %lld\n", (long long) *(sp - 1));
+    #endif
+    memo_store(&memo, *(sp - 1));
+    GOTO_NEXT;
+
+PRIM:
+    word = FETCH();
+    #ifdef TRACE
+        printf("PRIM %lld\n", (long long) word);
+    #endif
+    sp = stack_primitives[word](sp);
+    GOTO_NEXT;
+
+PRIM_BINARY:
+    word = FETCH();
+    #ifdef TRACE
+        printf("PRIM_BINARY %lld\n", (long long) word);
+    #endif
+    word2 = POP(); // rhs
+    *(sp - 1) = binary_primitives[word](*(sp - 1), word2);
+    GOTO_NEXT;
+
+JT:
+    offset = FETCH();
+    word = POP();
+    #ifdef TRACE
+        printf("JT %lld (%lld)\n", (long long) offset, (long long) word);
+    #endif
+    if (word) {
+        ip = ip + offset - 2;
+    }
+    GOTO_NEXT;
+
+JLT:
+    offset = FETCH();
+    word2 = POP(); // rhs
+    word = POP();
+    #ifdef TRACE
+        printf("JLT %lld (%lld < %lld)\n", (long long) offset, (long long) word, (long long) word2);
+    #endif
+    if ((int64_t) word < (int64_t) word2) {
+        ip = ip + offset - 2;
+    }
+    GOTO_NEXT;
+
+JGE:
+    offset = FETCH();
+    word2 = POP(); // rhs
+    word = POP();
+    #ifdef TRACE
+        printf("JGE %lld (%lld >= %lld)\n", (long long) offset, (long long) word, (long long) word2);
+    #endif
+    if ((int64_t) word >= (int64_t) word2) {
+        ip = ip + offset - 2;
+    }
+    GOTO_NEXT;
+
+JLT_CONST:
+    word2 = FETCH(); // rhs
+    offset = FETCH();
+    word = POP();
+    #ifdef TRACE
+        printf("JLT_CONST %lld %lld (%lld)\n", (long long) word2, (long long) offset, (long long) word);
+    #endif
+    if ((int64_t) word < (int64_t) word2) {
+        ip = ip + offset - 3;
+    }
+    GOTO_NEXT;
+
+JGE_CONST:
+    word2 = FETCH(); // rhs
+    offset = FETCH();
+    word = POP();
+    #ifdef TRACE
+        printf("JGE_CONST %lld %lld (%lld)\n", (long long) word2, (long long) offset, (long long) word);
+    #endif
+    if ((int64_t) word >= (int64_t) word2) {
+        ip = ip + offset - 3;
+    }
+    GOTO_NEXT;
+
+JMP:
+    offset = FETCH();
+    #ifdef TRACE
+        printf("JMP %lld\n", (long long) offset);
+    #endif
+    ip = ip + offset - 2;
+    GOTO_NEXT;
+
+RET:
+    word = POP();
+    #ifdef TRACE
+        printf("RET %lld\n", (long long) word);
+    #endif
+
+    // pop_frame
+    sp = bp + 3;
+    word2 = POP(); // args to pop
+    ip = (word_t *) POP();
+    bp = (word_t *) POP();
+    sp -= word2;
+
+    if (ip == NULL) {
+        return word;
+    }
+    PUSH(word);
+    GOTO_NEXT;
+}
+
+// Uses the default superinstructions table. The program is loaded on first use, and
+// reloaded when a different one is run.
+uint64_t run_program(const struct program *program, const uint64_t *args)
+{
+    static const struct program *loaded;
+    static struct function *functions;
+    if (program != loaded) {
+        if (functions != NULL) free_program(functions, loaded->function_count);
+        execute(NULL, NULL, NULL);
+        functions = load_program(program, instruction_labels);
+        loaded = program;
+    }
+    return execute(functions, functions, args);
+}
+
+uint64_t run(uint64_t arg)
+{
+    return run_program(&fib_program, &arg);
+}
+
+#ifndef HARNESS
+int main(int argc, const char *argv[])
+{
+    const struct program *program;
+    word_t args[MAX_BENCHMARK_ARGS];
+    if (!parse_program_args(argc, argv, &program, args)) {
+        fprintf(stderr, "Usage: %s <n> | <program> [args...]\n", argv[0]);
+        return 1;
+    }
+    printf("threadedmemo\n");
+
+    execute(NULL, NULL, NULL);
+    struct function *functions = load_program(program, instruction_labels);
+
+    clock_t start = clock();
+    word_t result = execute(functions, functions, args);
+    clock_t end = clock();
+    long ms = (end - start) / (CLOCKS_PER_SEC / 1000);
+
+    printf("Done in %ld ms\n", ms);
+    printf("=> %lld\n", (long long) result);
+    write_memo_counters(&memo);
+}
+#endif
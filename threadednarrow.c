@@ -0,0 +1,429 @@
+/*
+    Derived from threadedbranch.c:
+
+        Runs the narrow code of narrow.h instead of word-sized threaded code: each
+        instruction is a 32-bit offset of its label from that of LIT, followed by its
+        operands packed in 8, 16 or 32 bits. Dispatching adds the offset to the base
+        label instead of loading a full address, and operands are fetched with
+        loads of their width.
+
+        The code keeps the same instructions, superinstructions included, and the same
+        frames: only the encoding of the code changes. main() prints the size of the
+        code in both encodings.
+
+    Observations (GCC 12, Clang was not available):
+
+        - The code is 2.7-3x smaller: 64 bytes instead of 184 for fib, 114 instead of
+          344 for tak, 204 instead of 608 for sieve.
+        - The same speed as threadedbranch (0-10% faster on the loops): the add and
+          the narrow loads are off the critical path. All programs fit in L1 either
+          way, so the smaller footprint does not show here.
+
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "bytecode.h"
+#include "harness.h"
+#include "loader.h"
+#include "narrow.h"
+#include "programs.h"
+
+// #define TRACE
+
+#define STACK_SIZE (1 << 16) // deep enough for ack(3, 8)
+static word_t stack[STACK_SIZE];
+
+MAYBE_UNUSED
+static void print_stack(word_t *sp)
+{
+    printf("--- stack %p ---\n", sp);
+    for (word_t *entry = stack; entry < sp; entry++) {
+        printf("  %lld\n", (long long) *entry);
+    }
+    printf("------\n");
+}
+
+// Two operands and one result (primitive_infos), by value.
+typedef word_t (*binary_primitive_t)(word_t lhs, word_t rhs);
+// Any other arity: take the stack pointer and return the new one.
+typedef word_t *(*stack_primitive_t)(word_t *sp);
+
+static word_t lessThan(word_t lhs, word_t rhs)
+{
+    bool result = (int64_t) lhs < (int64_t) rhs;
+    #ifdef TRACE
+        printf("%lld < %lld => %s\n", (long long) lhs, (long long) rhs, result ? "true" : "false");
+    #endif
+    return result;
+}
+
+static word_t subtract(word_t lhs, word_t rhs)
+{
+    int64_t result = (int64_t) lhs - (int64_t) rhs;
+    #ifdef TRACE
+        printf("%lld - %lld => %lld\n", (long long) lhs, (long long) rhs, (long long) result);
+    #endif
+    return result;
+}
+
+static word_t add(word_t lhs, word_t rhs)
+{
+    int64_t result = (int64_t) lhs + (int64_t) rhs;
+    #ifdef TRACE
+        printf("%lld + %lld => %lld\n", (long long) lhs, (long long) rhs, (long long) result);
+    #endif
+    return result;
+}
+
+static word_t *newArray(word_t *sp)
+{
+    word_t size = *(--sp);
+    word_t *array = calloc(size, sizeof(word_t));
+    if (array == NULL) {
+        fprintf(stderr, "ERROR: Cannot allocate an array of %llu words.\n", (unsigned long long) size);
+        abort();
+    }
+    #ifdef TRACE
+        printf("newArray %llu => %p\n", (unsigned long long) size, (void *) array);
+    #endif
+    *(sp++) = (word_t) array;
+    return sp;
+}
+
+static word_t at(word_t array, word_t index)
+{
+    #ifdef TRACE
+        printf("%p at %llu => %llu\n", (void *) array, (unsigned long long) index,
+            (unsigned long long) ((word_t *) array)[index]);
+    #endif
+    return ((word_t *) array)[index];
+}
+
+static word_t *atPut(word_t *sp)
+{
+    word_t value = *(--sp);
+    word_t index = *(--sp);
+    word_t *array = (word_t *) *(--sp);
+    #ifdef TRACE
+        printf("%p at %llu put %llu\n", (void *) array, (unsigned long long) index, (unsigned long long) value);
+    #endif
+    array[index] = value;
+    return sp;
+}
+
+static word_t *freeArray(word_t *sp)
+{
+    free((word_t *) *(--sp));
+    return sp;
+}
+
+// Indexed by primitive, each primitive in the table of its signature.
+static const binary_primitive_t binary_primitives[PRIMITIVE_COUNT] = {
+    [PRIM_LESS_THAN] = lessThan,
+    [PRIM_SUBTRACT] = subtract,
+    [PRIM_ADD] = add,
+    [PRIM_AT] = at
+};
+
+static const stack_primitive_t stack_primitives[PRIMITIVE_COUNT] = {
+    [PRIM_NEW_ARRAY] = newArray,
+    [PRIM_AT_PUT] = atPut,
+    [PRIM_FREE_ARRAY] = freeArray
+};
+
+// Handler offsets are relative to the label of LIT.
+#define GOTO_NEXT do { \
+        COUNT_DISPATCH(); \
+        void *next = (char *) &&LIT + read_s32(ip); \
+        ip += NARROW_HANDLER_SIZE; \
+        goto *next; \
+    } while (0)
+#define PUSH(expr) *sp++ = expr
+#define POP() *--sp
+#define FETCH_S8() (ip += 1, read_s8(ip - 1))
+#define FETCH_U8() (ip += 1, read_u8(ip - 1))
+#define FETCH_S16() (ip += 2, read_s16(ip - 2))
+#define FETCH_U16() (ip += 2, read_u16(ip - 2))
+#define FETCH_S32() (ip += 4, read_s32(ip - 4))
+
+// Set up by calling execute() with no functions. Passed to the loader.
+static void *const *instruction_labels;
+
+static word_t execute(const struct narrow_function *functions, const struct narrow_function *entry, const word_t *args)
+{
+    static void *const labels[INSTRUCTION_COUNT] = {
+        [LIT] = &&LIT,
+        [LOAD] = &&LOAD,
+        [CALL] = &&CALL,
+        [PRIM] = &&PRIM,
+        [PRIM_BINARY] = &&PRIM_BINARY,
+        [JT] = &&JT,
+        [JMP] = &&JMP,
+        [JLT] = &&JLT,
+        [JGE] = &&JGE,
+        [JLT_CONST] = &&JLT_CONST,
+        [JGE_CONST] = &&JGE_CONST,
+        [RET] = &&RET,
+        [STORE] = &&STORE,
+        [CONST_0] = &&CONST_0,
+        [CONST_1] = &&CONST_1,
+        [CONST_2] = &&CONST_2,
+        [SUB1] = &&SUB1,
+        [SUB2] = &&SUB2,
+        [ADD1] = &&ADD1
+    };
+
+    if (functions == NULL) {
+        instruction_labels = labels;
+        return 0;
+    }
+
+    // Interpreter state
+
+    const uint8_t *ip = entry->code;
+    word_t *sp = stack;
+    word_t *bp;
+
+    word_t word;
+    word_t word2;
+    word_t *words;
+    const struct narrow_function *fun;
+    int64_t offset;
+
+    // Initial setup
+
+    for (size_t i = 0; i < entry->arity; i++) {
+        PUSH(args[i]);
+    }
+    bp = sp; // the args notionally are in the callee frame
+    PUSH(0); // no prev. BP
+    PUSH(0); // no prev. IP
+    PUSH(0); // no args
+    sp += entry->frame_size;
+    GOTO_NEXT;
+
+LIT:
+    word = (int64_t) FETCH_S32();
+    #ifdef TRACE
+        printf("LIT %lld\n", (long long) word);
+    #endif
+    PUSH(word);
+    GOTO_NEXT;
+
+CONST_0:
+    PUSH(0);
+    GOTO_NEXT;
+
+CONST_1:
+    PUSH(1);
+    GOTO_NEXT;
+
+CONST_2:
+    PUSH(2);
+    GOTO_NEXT;
+
+SUB1:
+    *((int64_t *)(sp - 1)) -= 1;
+    GOTO_NEXT;
+
+SUB2:
+    *((int64_t *)(sp - 1)) -= 2;
+    GOTO_NEXT;
+
+ADD1:
+    *((int64_t *)(sp - 1)) += 1;
+    GOTO_NEXT;
+
+LOAD:
+    offset = FETCH_S8();
+    #ifdef TRACE
+        printf("LOAD %lld\n", (long long) offset);
+    #endif
+    PUSH(*(bp + offset));
+    GOTO_NEXT;
+
+STORE:
+    offset = FETCH_S8();
+    #ifdef TRACE
+        printf("STORE %lld\n", (long long) offset);
+    #endif
+    *(bp + offset) = POP();
+    GOTO_NEXT;
+
+CALL:
+    fun = functions + FETCH_U16(); // function ID
+    word = FETCH_U8();
+    #ifdef TRACE
+        printf("CALL %lld\n", (long long) word);
+    #endif
+
+    // push frame
+    words = bp;
+    bp = sp;
+    PUSH((word_t) words);
+    PUSH((word_t) ip);
+    PUSH(word); // args to pop later
+
+    sp += fun->frame_size;
+    ip = fun->code;
+    GOTO_NEXT;
+
+PRIM:
+    word = FETCH_U8();
+    #ifdef TRACE
+        printf("PRIM %lld\n", (long long) word);
+    #endif
+    sp = stack_primitives[word](sp);
+    GOTO_NEXT;
+
+PRIM_BINARY:
+    word = FETCH_U8();
+    #ifdef TRACE
+        printf("PRIM_BINARY %lld\n", (long long) word);
+    #endif
+    word2 = POP(); // rhs
+    *(sp - 1) = binary_primitives[word](*(sp - 1), word2);
+    GOTO_NEXT;
+
+JT:
+    offset = FETCH_S16();
+    word = POP();
+    #ifdef TRACE
+        printf("JT %lld (%lld)\n", (long long) offset, (long long) word);
+    #endif
+    if (word) {
+        ip += offset;
+    }
+    GOTO_NEXT;
+
+JLT:
+    offset = FETCH_S16();
+    word2 = POP(); // rhs
+    word = POP();
+    #ifdef TRACE
+        printf("JLT %lld (%lld < %lld)\n", (long long) offset, (long long) word, (long long) word2);
+    #endif
+    if ((int64_t) word < (int64_t) word2) {
+        ip += offset;
+    }
+    GOTO_NEXT;
+
+JGE:
+    offset = FETCH_S16();
+    word2 = POP(); // rhs
+    word = POP();
+    #ifdef TRACE
+        printf("JGE %lld (%lld >= %lld)\n", (long long) offset, (long long) word, (long long) word2);
+    #endif
+    if ((int64_t) word >= (int64_t) word2) {
+        ip += offset;
+    }
+    GOTO_NEXT;
+
+JLT_CONST:
+    word2 = (int64_t) FETCH_S16(); // rhs
+    offset = FETCH_S16();
+    word = POP();
+    #ifdef TRACE
+        printf("JLT_CONST %lld %lld (%lld)\n", (long long) word2, (long long) offset, (long long) word);
+    #endif
+    if ((int64_t) word < (int64_t) word2) {
+        ip += offset;
+    }
+    GOTO_NEXT;
+
+JGE_CONST:
+    word2 = (int64_t) FETCH_S16(); // rhs
+    offset = FETCH_S16();
+    word = POP();
+    #ifdef TRACE
+        printf("JGE_CONST %lld %lld (%lld)\n", (long long) word2, (long long) offset, (long long) word);
+    #endif
+    if ((int64_t) word >= (int64_t) word2) {
+        ip += offset;
+    }
+    GOTO_NEXT;
+
+JMP:
+    offset = FETCH_S16();
+    #ifdef TRACE
+        printf("JMP %lld\n", (long long) offset);
+    #endif
+    ip += offset;
+    GOTO_NEXT;
+
+RET:
+    word = POP();
+    #ifdef TRACE
+        printf("RET %lld\n", (long long) word);
+    #endif
+
+    // pop_frame
+    sp = bp + 3;
+    word2 = POP(); // args to pop
+    ip = (const uint8_t *) POP();
+    bp = (word_t *) POP();
+    sp -= word2;
+
+    if (ip == NULL) {
+        return word;
+    }
+    PUSH(word);
+    GOTO_NEXT;
+}
+
+// Uses the default superinstructions table. The program is loaded on first use, and
+// reloaded when a different one is run.
+uint64_t run_program(const struct program *program, const uint64_t *args)
+{
+    static const struct program *loaded;
+    static struct narrow_function *functions;
+    if (program != loaded) {
+        if (functions != NULL) free_narrow_program(functions, loaded->function_count);
+        execute(NULL, NULL, NULL);
+        size_t wide_size = 0;
+        functions = load_narrow_program(program, instruction_labels, instruction_labels[LIT], &wide_size);
+        loaded = program;
+    }
+    return execute(functions, functions, args);
+}
+
+uint64_t run(uint64_t arg)
+{
+    return run_program(&fib_program, &arg);
+}
+
+#ifndef HARNESS
+int main(int argc, const char *argv[])
+{
+    const struct program *program;
+    word_t args[MAX_BENCHMARK_ARGS];
+    if (!parse_program_args(argc, argv, &program, args)) {
+        fprintf(stderr, "Usage: %s <n> | <program> [args...]\n", argv[0]);
+        return 1;
+    }
+    printf("threadednarrow\n");
+
+    execute(NULL, NULL, NULL);
+    size_t wide_size = 0;
+    struct narrow_function *functions = load_narrow_program(program, instruction_labels, instruction_labels[LIT], &wide_size);
+    size_t narrow_size = 0;
+    for (size_t i = 0; i < program->function_count; i++) {
+        narrow_size += functions[i].code_size;
+    }
+    printf("Code: %zu bytes (%zu as threaded words)\n", narrow_size, wide_size);
+
+    clock_t start = clock();
+    word_t result = execute(functions, functions, args);
+    clock_t end = clock();
+    long ms = (end - start) / (CLOCKS_PER_SEC / 1000);
+
+    printf("Done in %ld ms\n", ms);
+    printf("=> %lld\n", (long long) result);
+}
+#endif
@@ -0,0 +1,354 @@
+/*
+    Derived from threaded2.c:
+
+        Keeps the top of the stack in a local variable, 'tos', that the compiler can
+        allocate to a register. The cache is always full: the top element is in 'tos'
+        and only the ones below it are in memory at sp[-1], sp[-2], ... A binary
+        primitive reads one operand from memory and returns its result in a register
+        instead of popping two and pushing one; SUB1 and friends do not access memory
+        at all. In exchange, every push first spills 'tos'.
+
+        A CALL spills the last arg so that the callee finds all args in memory below BP,
+        as before. The callee starts with an undefined value in 'tos' which the first
+        push spills into a dummy stack slot above the locals; RET discards it along
+        with the frame and returns with the result in 'tos'.
+
+        Primitives take the top of the stack as an argument and return the new one.
+
+    Observations (GCC 12, Clang was not available):
+
+        - Same performance as threaded2 and comboinstructions2 on fib, within noise on
+          the other programs: what binary primitives save, the spills at every push
+          and the reloads after STORE and JT (which empty the stack) give back.
+
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "bytecode.h"
+#include "harness.h"
+#include "loader.h"
+#include "programs.h"
+
+// #define TRACE
+
+#define STACK_SIZE (1 << 16) // deep enough for ack(3, 8)
+static word_t stack[STACK_SIZE];
+
+MAYBE_UNUSED
+static void print_stack(word_t *sp, word_t tos)
+{
+    printf("--- stack %p ---\n", sp);
+    for (word_t *entry = stack; entry < sp; entry++) {
+        printf("  %lld\n", (long long) *entry);
+    }
+    printf("  %lld (cached)\n", (long long) tos);
+    printf("------\n");
+}
+
+typedef word_t (*prim_handler_t)(word_t **spp, word_t tos);
+
+static word_t lessThan(word_t **spp, word_t tos)
+{
+    int64_t rhs = tos;
+    int64_t lhs = *(--*spp);
+    bool result = lhs < rhs;
+    #ifdef TRACE
+        printf("%lld < %lld => %s\n", (long long) lhs, (long long) rhs, result ? "true" : "false");
+    #endif
+    return result;
+}
+
+static word_t subtract(word_t **spp, word_t tos)
+{
+    int64_t rhs = tos;
+    int64_t lhs = *(--*spp);
+    int64_t result = lhs - rhs;
+    #ifdef TRACE
+        printf("%lld - %lld => %lld\n", (long long) lhs, (long long) rhs, (long long) result);
+    #endif
+    return result;
+}
+
+static word_t add(word_t **spp, word_t tos)
+{
+    int64_t rhs = tos;
+    int64_t lhs = *(--*spp);
+    int64_t result = lhs + rhs;
+    #ifdef TRACE
+        printf("%lld + %lld => %lld\n", (long long) lhs, (long long) rhs, (long long) result);
+    #endif
+    return result;
+}
+
+static word_t newArray(word_t **spp, word_t tos)
+{
+    (void) spp;
+    word_t size = tos;
+    word_t *array = calloc(size, sizeof(word_t));
+    if (array == NULL) {
+        fprintf(stderr, "ERROR: Cannot allocate an array of %llu words.\n", (unsigned long long) size);
+        abort();
+    }
+    #ifdef TRACE
+        printf("newArray %llu => %p\n", (unsigned long long) size, (void *) array);
+    #endif
+    return (word_t) array;
+}
+
+static word_t at(word_t **spp, word_t tos)
+{
+    word_t index = tos;
+    word_t *array = (word_t *) *(--*spp);
+    #ifdef TRACE
+        printf("%p at %llu => %llu\n", (void *) array, (unsigned long long) index, (unsigned long long) array[index]);
+    #endif
+    return array[index];
+}
+
+// Primitives without a result reload the cache with the element below their operands.
+
+static word_t atPut(word_t **spp, word_t tos)
+{
+    word_t value = tos;
+    word_t index = *(--*spp);
+    word_t *array = (word_t *) *(--*spp);
+    #ifdef TRACE
+        printf("%p at %llu put %llu\n", (void *) array, (unsigned long long) index, (unsigned long long) value);
+    #endif
+    array[index] = value;
+    return *(--*spp);
+}
+
+static word_t freeArray(word_t **spp, word_t tos)
+{
+    free((word_t *) tos);
+    return *(--*spp);
+}
+
+static prim_handler_t prim_handlers[] = {
+    [PRIM_LESS_THAN] = lessThan,
+    [PRIM_SUBTRACT] = subtract,
+    [PRIM_ADD] = add,
+    [PRIM_NEW_ARRAY] = newArray,
+    [PRIM_AT] = at,
+    [PRIM_AT_PUT] = atPut,
+    [PRIM_FREE_ARRAY] = freeArray
+};
+
+#define GOTO_NEXT do { COUNT_DISPATCH(); goto *((void*) *ip++); } while (0)
+#define PUSH(expr) do { *sp++ = tos; tos = (expr); } while (0)
+#define DROP() tos = *--sp
+#define FETCH() *ip++
+
+// Set up by calling execute() with no functions. Passed to the loader.
+static void *const *instruction_labels;
+
+static word_t execute(const struct function *functions, const struct function *entry, const word_t *args)
+{
+    static void *const labels[INSTRUCTION_COUNT] = {
+        [LIT] = &&LIT,
+        [LOAD] = &&LOAD,
+        [CALL] = &&CALL,
+        [PRIM] = &&PRIM,
+        [JT] = &&JT,
+        [JMP] = &&JMP,
+        [RET] = &&RET,
+        [STORE] = &&STORE,
+        [CONST_0] = &&CONST_0,
+        [CONST_1] = &&CONST_1,
+        [CONST_2] = &&CONST_2,
+        [SUB1] = &&SUB1,
+        [SUB2] = &&SUB2,
+        [ADD1] = &&ADD1
+    };
+
+    if (functions == NULL) {
+        instruction_labels = labels;
+        return 0;
+    }
+
+    // Interpreter state
+
+    word_t *ip = entry->code;
+    word_t *sp = stack;
+    word_t *bp;
+    word_t tos = 0; // in a register, hopefully
+
+    word_t word;
+    word_t word2;
+    word_t *words;
+    const struct function *fun;
+    int64_t offset;
+
+    // Initial setup
+
+    for (size_t i = 0; i < entry->arity; i++) {
+        *sp++ = args[i];
+    }
+    bp = sp; // the args notionally are in the callee frame
+    *sp++ = 0; // no prev. BP
+    *sp++ = 0; // no prev. IP
+    *sp++ = 0; // no args
+    sp += entry->frame_size;
+    GOTO_NEXT;
+
+LIT:
+    word = FETCH();
+    #ifdef TRACE
+        printf("LIT %lld\n", (long long) word);
+    #endif
+    PUSH(word);
+    GOTO_NEXT;
+
+CONST_0:
+    PUSH(0);
+    GOTO_NEXT;
+
+CONST_1:
+    PUSH(1);
+    GOTO_NEXT;
+
+CONST_2:
+    PUSH(2);
+    GOTO_NEXT;
+
+SUB1:
+    tos -= 1;
+    GOTO_NEXT;
+
+SUB2:
+    tos -= 2;
+    GOTO_NEXT;
+
+ADD1:
+    tos += 1;
+    GOTO_NEXT;
+
+LOAD:
+    offset = FETCH();
+    #ifdef TRACE
+        printf("LOAD %lld\n", (long long) offset);
+    #endif
+    PUSH(*(bp + offset));
+    GOTO_NEXT;
+
+STORE:
+    offset = FETCH();
+    #ifdef TRACE
+        printf("STORE %lld\n", (long long) offset);
+    #endif
+    *(bp + offset) = tos;
+    DROP();
+    GOTO_NEXT;
+
+CALL:
+    fun = functions + FETCH(); // function ID
+    word = FETCH();
+    #ifdef TRACE
+        printf("CALL %lld\n", (long long) word);
+    #endif
+
+    // push frame
+    *sp++ = tos; // the last arg
+    words = bp;
+    bp = sp;
+    *sp++ = (word_t) words;
+    *sp++ = (word_t) ip;
+    *sp++ = word; // args to pop later
+
+    sp += fun->frame_size;
+    ip = fun->code;
+    GOTO_NEXT;
+
+PRIM:
+    word = FETCH();
+    #ifdef TRACE
+        printf("PRIM %lld\n", (long long) word);
+    #endif
+    tos = prim_handlers[word](&sp, tos);
+    GOTO_NEXT;
+
+JT:
+    offset = FETCH();
+    word = tos;
+    DROP();
+    #ifdef TRACE
+        printf("JT %lld (%lld)\n", (long long) offset, (long long) word);
+    #endif
+    if (word) {
+        ip = ip + offset - 2;
+    }
+    GOTO_NEXT;
+
+JMP:
+    offset = FETCH();
+    #ifdef TRACE
+        printf("JMP %lld\n", (long long) offset);
+    #endif
+    ip = ip + offset - 2;
+    GOTO_NEXT;
+
+RET:
+    #ifdef TRACE
+        printf("RET %lld\n", (long long) tos);
+    #endif
+
+    // pop_frame, keeping the result in tos
+    sp = bp + 3;
+    word2 = *--sp; // args to pop
+    ip = (word_t *) *--sp;
+    bp = (word_t *) *--sp;
+    sp -= word2;
+
+    if (ip == NULL) return tos;
+    GOTO_NEXT;
+}
+
+// The program is loaded on first use, and reloaded when a different one is run.
+uint64_t run_program(const struct program *program, const uint64_t *args)
+{
+    static const struct program *loaded;
+    static struct function *functions;
+    if (program != loaded) {
+        if (functions != NULL) free_program(functions, loaded->function_count);
+        execute(NULL, NULL, NULL);
+        functions = load_program(program, instruction_labels);
+        loaded = program;
+    }
+    return execute(functions, functions, args);
+}
+
+uint64_t run(uint64_t arg)
+{
+    return run_program(&fib_program, &arg);
+}
+
+#ifndef HARNESS
+int main(int argc, const char *argv[])
+{
+    const struct program *program;
+    word_t args[MAX_BENCHMARK_ARGS];
+    if (!parse_program_args(argc, argv, &program, args)) {
+        fprintf(stderr, "Usage: %s <n> | <program> [args...]\n", argv[0]);
+        return 1;
+    }
+    printf("tos\n");
+
+    execute(NULL, NULL, NULL);
+    struct function *functions = load_program(program, instruction_labels);
+
+    clock_t start = clock();
+    word_t result = execute(functions, functions, args);
+    clock_t end = clock();
+    long ms = (end - start) / (CLOCKS_PER_SEC / 1000);
+
+    printf("Done in %ld ms\n", ms);
+    printf("=> %lld\n", (long long) result);
+}
+#endif
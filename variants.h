@@ -0,0 +1,66 @@
+/*
+    The interpreter variants linked into bench.c, each with the variant it is derived
+    from (see the header comment of each file), so that the harness can report the
+    README lineage numbers. Keep in sync with VARIANTS in the Makefile.
+
+    ENGINE marks the variants that also run the programs of programs.h (run_program()
+    of harness.h); the others only run fib.
+ */
+
+#ifndef VARIANTS_H
+#define VARIANTS_H
+
+#define VARIANTS \
+    VARIANT(wordcode, NULL) \
+    VARIANT(wordcode2, "wordcode") \
+    VARIANT(wordcode3, "wordcode2") \
+    VARIANT(wordcode4, "wordcode3") \
+    VARIANT(handlercode, "wordcode4") \
+    VARIANT(handlercode2, "handlercode") \
+    VARIANT(directthreaded, "handlercode2") \
+    VARIANT(directthreaded2, "directthreaded") \
+    VARIANT(directthreaded3, "directthreaded2") \
+    VARIANT(directthreaded3const, "directthreaded3") \
+    VARIANT(directthreaded3primtweak, "directthreaded3") \
+    VARIANT(directthreaded4, "directthreaded3const") \
+    VARIANT(comboinstructions, "directthreaded3const") \
+    VARIANT(comboinstructions2, "comboinstructions") \
+    ENGINE(threaded, "directthreaded3") \
+    ENGINE(threaded2, "threaded") \
+    ENGINE(tos, "threaded2") \
+    ENGINE(tos2, "tos") \
+    ENGINE(registervm, "threaded") \
+    ENGINE(tailcall, "threaded2") \
+    ENGINE(jit, "threaded2") \
+    ENGINE(tracejit, "jit") \
+    ENGINE(reentrant, "tailcall") \
+    ENGINE(threadedprims, "threaded2") \
+    ENGINE(threadedbranch, "threadedprims") \
+    ENGINE(threadedlink, "threadedbranch") \
+    ENGINE(threadedtail, "threadedlink") \
+    ENGINE(threadedcompact, "threadedbranch") \
+    ENGINE(threadedbpfree, "threadedlink") \
+    ENGINE(threadednarrow, "threadedbranch") \
+    ENGINE(threadedlazy, "threadedlink") \
+    ENGINE(threadedmemo, "threadedlink") \
+    ENGINE(threadedchecked, "threadedbranch") \
+    ENGINE(threadedgreen, "threadedlink") \
+    ENGINE(xswitch, "wordcode3") \
+    ENGINE(xtable, "wordcode4") \
+    ENGINE(xhandler, "handlercode2") \
+    ENGINE(xthreaded, "threaded2") \
+    ENGINE(xtailcall, "tailcall") \
+    ENGINE(xswitchquick, "xswitch") \
+    ENGINE(xthreadedquick, "xthreaded") \
+    ENGINE(xtailcallquick, "xtailcall") \
+    ENGINE(xthreadedreplicated, "xthreaded") \
+    ENGINE(xlanes, "xswitch")
+
+/*
+    The variants that compile or memoize away most of the instructions of a program:
+    their dispatch-counting build only counts those interpreted before, which is no
+    measure of the work done. bench leaves their dispatch numbers empty.
+ */
+#define UNCOUNTED_VARIANTS "jit", "tracejit", "threadedmemo"
+
+#endif
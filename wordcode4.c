@@ -16,6 +16,8 @@
 #include <string.h>
 #include <time.h>
 
+#include "harness.h"
+
 #define MAYBE_UNUSED __attribute__((__unused__))
 
 typedef uint64_t word_t;
@@ -232,6 +234,7 @@ static instr_handler ops[] = {
 static word_t execute(struct interpreter *interp) {
     while (true) {
         word_t opcode = fetch(interp);
+        COUNT_DISPATCH();
         if (opcode == RET) return pop(interp);
         ops[opcode](interp);
     }
@@ -240,15 +243,8 @@ static word_t execute(struct interpreter *interp) {
 #define STACK_SIZE 1024
 static word_t stack[STACK_SIZE];
 
-int main(int argc, const char *argv[])
+uint64_t run(uint64_t arg)
 {
-    if (argc != 2) {
-        fprintf(stderr, "A single numeric argument is required.\n");
-        return 1;
-    }
-    int arg = atoi(argv[1]);
-    printf("wordcode4\n");
-
     struct interpreter interp = {
         .bp = stack,
         .sp = stack,
@@ -258,10 +254,24 @@ int main(int argc, const char *argv[])
     push(0, &interp); // no prev. IP
     push(arg, &interp); // call arg
 
+    return execute(&interp);
+}
+
+#ifndef HARNESS
+int main(int argc, const char *argv[])
+{
+    if (argc != 2) {
+        fprintf(stderr, "A single numeric argument is required.\n");
+        return 1;
+    }
+    int arg = atoi(argv[1]);
+    printf("wordcode4\n");
+
   	clock_t start = clock();
-	word_t result = execute(&interp);
+	word_t result = run(arg);
 	clock_t end = clock();
 	long ms = (end - start) / (CLOCKS_PER_SEC / 1000);
 
     printf("Done in %ld ms; result = %lld\n", ms, result);
-}
\ No newline at end of file
+}
+#endif
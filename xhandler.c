@@ -0,0 +1,18 @@
+/*
+    Derived from handlercode2.c:
+
+        The instructions of instructions.h as functions, whose addresses make the
+        code, called in a loop as in handlercode2.c, but running the loader's code with
+        superinstructions (see dispatch.h).
+
+    Observations (GCC 12, Clang was not available):
+
+        - Within 10% of xtable: loading the handler from the code instead of from a
+          table barely matters next to the call.
+
+ */
+
+#define DISPATCH DISPATCH_HANDLER
+#define ENGINE_NAME "xhandler"
+
+#include "dispatch.h"
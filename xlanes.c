@@ -0,0 +1,540 @@
+/*
+    Derived from xswitch.c:
+
+        Lane-parallel evaluation: one function of a program run on LANES inputs at
+        once, in lockstep. The stack holds vectors of LANES words, one lane per input,
+        and each instruction of the loaded code runs on all the lanes it is active
+        for: LOAD, LIT and the arithmetic of the pure primitives become vector
+        operations (GCC vector extensions, compiled for AVX-512, AVX2 and a baseline
+        with target_clones, chosen at startup by the CPU).
+
+        Lanes diverge at JT and the compare-and-branch instructions: each lane has
+        its own IP, and the active lanes are those at the earliest IP of the frame,
+        the others waiting parked at theirs. A divergent branch parks the lanes going
+        the later way; the active lanes pick up the parked ones when they reach their
+        IP, or park themselves and switch to them when they jump past it. Writes to
+        the stack are masked by the active lanes, so that parked lanes, whose stack
+        may be deeper, keep theirs. A CALL pushes a frame of the calling lanes, and
+        returns once they all have returned. This assumes lanes at the same IP have
+        the same stack depth, as in any bytecode load_sp_frame_program() accepts.
+
+        When lanes diverge so much that a call is made by SCALAR_CALL_LANES lanes or
+        fewer, it runs on the scalar engine of this file (the instructions.h switch),
+        one lane after the other. So do whole programs calling primitives that are not
+        pure (primitive_infos), which the lanes do not implement.
+
+            xlanes <n> | <program> [args...]        one evaluation, as any engine
+            xlanes -n <count> [<program> <lo> <hi>] throughput of 'count' evaluations
+                                                    of the first arg from lo to hi in
+                                                    turn (fib 20 to 25 by default),
+                                                    scalar and in lanes
+
+    Observations (GCC 12, Clang was not available):
+
+        - On AVX-512, evaluations of fib 20..25 have 1.45-1.6x the throughput
+          of the scalar engine, and tak 18..24 1.55-1.85x. These are the requested
+          fib inputs, but a few hundred evaluations rather than a million: the
+          scalar engine would take 25 minutes for 1M. Lanes that reach the base
+          case early, and recursion trees of different shapes, leave most lanes
+          idle. The same inputs in all lanes (fib 25 25) get 6.5x.
+        - The loops, which only diverge at their exit, get 5-7x; sieve is not pure
+          and runs scalar.
+        - Built for AVX2 or SSE2 instead, fib gets 0.7-0.9x: a vector of 8 words is 2
+          or 4 instructions, and the masked writes cost as much.
+        - A single evaluation (run_program(), as in bench) runs in one lane, and so
+          on the scalar engine from the first call: 5-25% slower than xswitch.
+        - A scalar fallback threshold of 2 lanes did best on fib and tak: 1 and
+          3 were 5-15% slower, 4 was 20% slower on tak.
+
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "bytecode.h"
+#include "harness.h"
+#include "instructions.h"
+#include "loader.h"
+#include "programs.h"
+
+#define LANES 8 // words of an AVX-512 vector
+#define SCALAR_CALL_LANES 2
+#define STACK_SIZE (1 << 16) // deep enough for ack(3, 8)
+#define LANE_STACK_SIZE (1 << 16) // in vectors
+#define LANE_FRAME_COUNT (1 << 13)
+
+typedef int64_t lane_vector __attribute__((vector_size(LANES * sizeof(int64_t))));
+
+// The scalar engine: xswitch.c
+
+static word_t stack[STACK_SIZE];
+
+#define IP ip
+#define SP sp
+#define BP bp
+#define FUNCTIONS functions
+#define EXIT(value) return (value)
+#define FETCH() *IP++
+#define PUSH(expr) *SP++ = (expr)
+#define POP() *--SP
+#define TOP() (((int64_t *) SP)[-1])
+
+static word_t execute(const struct function *functions, const struct function *entry, const word_t *args)
+{
+    word_t *ip = entry->code;
+    word_t *sp = stack;
+    word_t *bp;
+    for (size_t i = 0; i < entry->arity; i++) {
+        PUSH(args[i]);
+    }
+    bp = sp; // the args notionally are in the callee frame
+    PUSH(0); // no prev. BP
+    PUSH(0); // no prev. IP
+    PUSH(0); // no args
+    sp += entry->frame_size;
+
+    #define CASE(name, ...) case name: { __VA_ARGS__ } break;
+    for (;;) {
+        COUNT_DISPATCH();
+        switch (FETCH()) {
+            INSTRUCTIONS(CASE)
+        }
+    }
+}
+
+// The lanes
+
+// A frame of the lanes that made a call, in a stack of its own: the lane stack only
+// holds their args, the unused space of a frame header, their locals and their stack.
+struct lane_frame {
+    lane_vector result; // of the lanes that returned
+    const word_t *pcs[LANES]; // of the parked lanes
+    lane_vector *sps[LANES];
+    lane_vector *bp;
+    const word_t *return_ip; // of the calling lanes, NULL for the entry frame
+    const word_t *min_wait; // of the frame, saved while a callee runs
+    word_t args;
+    unsigned lanes; // that made the call: the others belong to outer frames
+    unsigned waiting; // parked lanes
+};
+
+static lane_vector lane_stack[LANE_STACK_SIZE];
+static struct lane_frame lane_frames[LANE_FRAME_COUNT];
+
+#define NO_WAIT ((const word_t *) UINTPTR_MAX)
+
+static void park(struct lane_frame *frame, unsigned lanes, const word_t *ip, lane_vector *sp)
+{
+    frame->waiting |= lanes;
+    for (int lane = 0; lane < LANES; lane++) {
+        if (lanes & (1u << lane)) {
+            frame->pcs[lane] = ip;
+            frame->sps[lane] = sp;
+        }
+    }
+}
+
+// The earliest IP of the parked lanes, NO_WAIT if there are none.
+static const word_t *earliest_wait(const struct lane_frame *frame)
+{
+    const word_t *result = NO_WAIT;
+    for (int lane = 0; lane < LANES; lane++) {
+        if ((frame->waiting & (1u << lane)) && frame->pcs[lane] < result) result = frame->pcs[lane];
+    }
+    return result;
+}
+
+// Unpark the lanes parked at 'ip'.
+static unsigned unpark(struct lane_frame *frame, const word_t *ip)
+{
+    unsigned lanes = 0;
+    for (int lane = 0; lane < LANES; lane++) {
+        if ((frame->waiting & (1u << lane)) && frame->pcs[lane] == ip) lanes |= 1u << lane;
+    }
+    frame->waiting &= ~lanes;
+    return lanes;
+}
+
+static const lane_vector lane_bits = { 1, 2, 4, 8, 16, 32, 64, 128 };
+
+// A vector of all ones in the lanes of 'bits', zeros elsewhere.
+#define MASK_OF(bits) ((lane_vector) ((lane_bits & (int64_t) (bits)) != 0))
+#define BITS_OF(vector, bits) do { \
+        bits = 0; \
+        for (int l = 0; l < LANES; l++) bits |= (unsigned) ((vector)[l] != 0) << l; \
+    } while (0)
+#define BLEND(mask, new, old) (((new) & (mask)) | ((old) & ~(mask)))
+
+#define LANE_PUSH(expr) do { *sp = BLEND(mask, (expr), *sp); sp++; } while (0)
+#define LANE_POP() (*--sp)
+#define LANE_SET_TOP(expr) (sp[-1] = BLEND(mask, (expr), sp[-1]))
+
+// Jump to 'target' in the active lanes where 'condition' holds: all of them or none
+// jump, the others diverge and the lanes going the later way are parked.
+#define LANE_BRANCH(condition, target) do { \
+        lane_vector condition_ = (condition); \
+        const word_t *target_ = (target); \
+        unsigned taken; \
+        BITS_OF(condition_, taken); \
+        taken &= active; \
+        if (taken == active) { \
+            ip = target_; \
+        } else if (taken != 0) { \
+            /* Carry on with the earlier of the two ways. */ \
+            unsigned later = target_ > ip ? taken : active & ~taken; \
+            park(frame, later, target_ > ip ? target_ : ip, sp); \
+            if (target_ < ip) ip = target_; \
+            active &= ~later; \
+            mask = MASK_OF(active); \
+            min_wait = earliest_wait(frame); \
+        } \
+    } while (0)
+
+/*
+    Run 'entry' on the lanes of 'lanes', args[i * LANES + lane] being arg i of a lane,
+    storing the result of each in results[lane]. Runs all lanes of a program that is
+    not pure on the scalar engine.
+ */
+__attribute__((target_clones("avx512f", "avx2", "default")))
+static void execute_lanes(
+    const struct function *functions,
+    const struct function *entry,
+    const word_t *args,
+    unsigned lanes,
+    word_t *results)
+{
+    const word_t *ip = entry->code;
+    lane_vector *sp = lane_stack;
+    lane_vector *bp;
+    struct lane_frame *frame = lane_frames;
+    unsigned active = lanes;
+    lane_vector mask = MASK_OF(active);
+    const word_t *min_wait = NO_WAIT;
+
+    for (size_t i = 0; i < entry->arity; i++) {
+        lane_vector arg;
+        memcpy(&arg, args + i * LANES, sizeof(arg));
+        LANE_PUSH(arg);
+    }
+    bp = sp;
+    sp += FRAME_HEADER_SIZE + entry->frame_size;
+    frame->bp = bp;
+    frame->return_ip = NULL;
+    frame->args = entry->arity;
+    frame->lanes = lanes;
+    frame->waiting = 0;
+
+    for (;;) {
+        if (ip >= min_wait) {
+            if (ip == min_wait) {
+                active |= unpark(frame, ip);
+            } else {
+                park(frame, active, ip, sp);
+                ip = earliest_wait(frame);
+                active = unpark(frame, ip);
+                sp = frame->sps[__builtin_ctz(active)];
+            }
+            min_wait = earliest_wait(frame);
+            mask = MASK_OF(active);
+        }
+        COUNT_DISPATCH();
+        switch (*ip++) {
+            case LIT: {
+                int64_t word = *ip++;
+                LANE_PUSH(word + (lane_vector) { 0 });
+                break;
+            }
+            case CONST_0: LANE_PUSH((lane_vector) { 0 }); break;
+            case CONST_1: LANE_PUSH((lane_vector) { 0 } + 1); break;
+            case CONST_2: LANE_PUSH((lane_vector) { 0 } + 2); break;
+            case SUB1: LANE_SET_TOP(sp[-1] - 1); break;
+            case SUB2: LANE_SET_TOP(sp[-1] - 2); break;
+            case ADD1: LANE_SET_TOP(sp[-1] + 1); break;
+            case LOAD: {
+                int64_t offset = *ip++;
+                LANE_PUSH(*(bp + offset));
+                break;
+            }
+            case STORE: {
+                int64_t offset = *ip++;
+                lane_vector value = LANE_POP();
+                *(bp + offset) = BLEND(mask, value, *(bp + offset));
+                break;
+            }
+            case CALL: {
+                const struct function *fun = functions + *ip++;
+                word_t arg_count = *ip++;
+                sp -= arg_count;
+                if (__builtin_popcount(active) <= SCALAR_CALL_LANES) {
+                    lane_vector result = { 0 };
+                    for (int lane = 0; lane < LANES; lane++) {
+                        if (!(active & (1u << lane))) continue;
+                        word_t lane_args[arg_count + 1];
+                        for (word_t i = 0; i < arg_count; i++) {
+                            lane_args[i] = sp[i][lane];
+                        }
+                        result[lane] = execute(functions, fun, lane_args);
+                    }
+                    LANE_PUSH(result);
+                    break;
+                }
+                frame->min_wait = min_wait;
+                frame++;
+                frame->bp = bp = sp + arg_count;
+                frame->return_ip = ip;
+                frame->args = arg_count;
+                frame->lanes = active;
+                frame->waiting = 0;
+                sp = bp + FRAME_HEADER_SIZE + fun->frame_size;
+                ip = fun->code;
+                min_wait = NO_WAIT;
+                break;
+            }
+            case PRIM: {
+                word_t primitive = *ip++;
+                lane_vector rhs = LANE_POP();
+                lane_vector lhs = sp[-1];
+                switch (primitive) {
+                    case PRIM_LESS_THAN: LANE_SET_TOP((lane_vector) (lhs < rhs) & 1); break;
+                    case PRIM_SUBTRACT: LANE_SET_TOP(lhs - rhs); break;
+                    case PRIM_ADD: LANE_SET_TOP(lhs + rhs); break;
+                }
+                break;
+            }
+            case JT: {
+                int64_t offset = *ip++;
+                lane_vector condition = LANE_POP();
+                LANE_BRANCH(condition, ip + offset - 2);
+                break;
+            }
+            case JLT: {
+                int64_t offset = *ip++;
+                lane_vector rhs = LANE_POP();
+                lane_vector lhs = LANE_POP();
+                LANE_BRANCH(lhs < rhs, ip + offset - 2);
+                break;
+            }
+            case JGE: {
+                int64_t offset = *ip++;
+                lane_vector rhs = LANE_POP();
+                lane_vector lhs = LANE_POP();
+                LANE_BRANCH(lhs >= rhs, ip + offset - 2);
+                break;
+            }
+            case JLT_CONST: {
+                int64_t rhs = *ip++;
+                int64_t offset = *ip++;
+                lane_vector lhs = LANE_POP();
+                LANE_BRANCH(lhs < rhs, ip + offset - 3);
+                break;
+            }
+            case JGE_CONST: {
+                int64_t rhs = *ip++;
+                int64_t offset = *ip++;
+                lane_vector lhs = LANE_POP();
+                LANE_BRANCH(lhs >= rhs, ip + offset - 3);
+                break;
+            }
+            case JMP: {
+                int64_t offset = *ip++;
+                ip = ip + offset - 2;
+                break;
+            }
+            case RET: {
+                frame->result = BLEND(mask, LANE_POP(), frame->result);
+                if (frame->waiting != 0) {
+                    ip = earliest_wait(frame);
+                    active = unpark(frame, ip);
+                    sp = frame->sps[__builtin_ctz(active)];
+                    min_wait = earliest_wait(frame);
+                    mask = MASK_OF(active);
+                    break;
+                }
+                lane_vector result = frame->result;
+                if (frame->return_ip == NULL) {
+                    for (int lane = 0; lane < LANES; lane++) {
+                        if (lanes & (1u << lane)) results[lane] = result[lane];
+                    }
+                    return;
+                }
+                active = frame->lanes;
+                mask = MASK_OF(active);
+                sp = frame->bp - frame->args;
+                ip = frame->return_ip;
+                frame--;
+                bp = frame->bp;
+                min_wait = frame->min_wait;
+                LANE_PUSH(result);
+                break;
+            }
+            default:
+                fprintf(stderr, "ERROR: Instruction %s is not implemented in lanes.\n", instruction_name(ip[-1]));
+                abort();
+        }
+    }
+}
+
+// Whether the program only calls pure primitives, the only ones the lanes implement.
+static bool is_pure(const struct program *program)
+{
+    for (size_t f = 0; f < program->function_count; f++) {
+        const struct bytecode_function *fun = program->functions + f;
+        for (size_t pc = 0; pc < fun->code_size; pc += opcode_size(fun->code[pc])) {
+            if (fun->code[pc] == PRIM && !primitive_infos[fun->code[pc + 1]].pure) return false;
+        }
+    }
+    return true;
+}
+
+// Both engines run the same code, loaded with instruction numbers.
+#define NUMBER_LABEL(name, ...) [name] = (void *) (uintptr_t) name,
+static void *const instruction_labels[INSTRUCTION_COUNT] = { INSTRUCTIONS(NUMBER_LABEL) };
+
+// Evaluate the loaded 'program' on 'count' inputs: args[input * arity + i] is arg i of an input.
+static void run_lanes(
+    const struct program *program,
+    const struct function *functions,
+    size_t count,
+    const word_t *args,
+    word_t *results)
+{
+    size_t arity = functions[0].arity;
+    if (!is_pure(program)) {
+        for (size_t input = 0; input < count; input++) {
+            results[input] = execute(functions, functions, args + input * arity);
+        }
+        return;
+    }
+    for (size_t first = 0; first < count; first += LANES) {
+        word_t lane_args[MAX_BENCHMARK_ARGS * LANES];
+        word_t lane_results[LANES];
+        unsigned lanes = 0;
+        for (size_t lane = 0; lane < LANES && first + lane < count; lane++) {
+            for (size_t i = 0; i < arity; i++) {
+                lane_args[i * LANES + lane] = args[(first + lane) * arity + i];
+            }
+            lanes |= 1u << lane;
+        }
+        execute_lanes(functions, functions, lane_args, lanes, lane_results);
+        for (size_t lane = 0; lane < LANES && first + lane < count; lane++) {
+            results[first + lane] = lane_results[lane];
+        }
+    }
+}
+
+// Uses the default superinstructions table. The program is loaded on first use, and
+// reloaded when a different one is run. A single evaluation runs in one lane.
+uint64_t run_program(const struct program *program, const uint64_t *args)
+{
+    static const struct program *loaded;
+    static struct function *functions;
+    if (program != loaded) {
+        if (functions != NULL) free_program(functions, loaded->function_count);
+        functions = load_program(program, instruction_labels);
+        loaded = program;
+    }
+    word_t result;
+    run_lanes(program, functions, 1, args, &result);
+    return result;
+}
+
+uint64_t run(uint64_t arg)
+{
+    return run_program(&fib_program, &arg);
+}
+
+#ifndef HARNESS
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000u + ts.tv_nsec;
+}
+
+static const char *isa(void)
+{
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx512f")) return "avx512f";
+    if (__builtin_cpu_supports("avx2")) return "avx2";
+    return "default";
+}
+
+// Evaluate 'count' inputs scalar and in lanes, and compare.
+static int measure_throughput(const struct program *program, size_t count, word_t lo, word_t hi)
+{
+    const struct benchmark *benchmark = find_benchmark(program->name);
+    size_t arity = program->functions[0].arity;
+    word_t *args = checked_malloc(count * arity * sizeof(word_t), "the inputs");
+    word_t *scalar_results = checked_malloc(count * sizeof(word_t), "the results");
+    word_t *lane_results = checked_malloc(count * sizeof(word_t), "the results");
+    for (size_t input = 0; input < count; input++) {
+        memcpy(args + input * arity, benchmark->args, arity * sizeof(word_t));
+        args[input * arity] = lo + input % (hi - lo + 1);
+    }
+    struct function *functions = load_program(program, instruction_labels);
+
+    uint64_t start = now_ns();
+    for (size_t input = 0; input < count; input++) {
+        scalar_results[input] = execute(functions, functions, args + input * arity);
+    }
+    uint64_t scalar_ns = now_ns() - start;
+    start = now_ns();
+    run_lanes(program, functions, count, args, lane_results);
+    uint64_t lanes_ns = now_ns() - start;
+
+    for (size_t input = 0; input < count; input++) {
+        if (lane_results[input] != scalar_results[input]) {
+            fprintf(stderr, "ERROR: Input %zu computed %llu in lanes, %llu scalar.\n", input,
+                (unsigned long long) lane_results[input], (unsigned long long) scalar_results[input]);
+            return 1;
+        }
+    }
+    printf("program,lo,hi,evaluations,mode,isa,ns,evals_per_second,speedup\n");
+    printf("%s,%llu,%llu,%zu,scalar,,%llu,%.1f,\n", program->name, (unsigned long long) lo,
+        (unsigned long long) hi, count, (unsigned long long) scalar_ns, count * 1e9 / scalar_ns);
+    printf("%s,%llu,%llu,%zu,lanes,%s,%llu,%.1f,%.3f\n", program->name, (unsigned long long) lo,
+        (unsigned long long) hi, count, is_pure(program) ? isa() : "scalar", (unsigned long long) lanes_ns,
+        count * 1e9 / lanes_ns, (double) scalar_ns / lanes_ns);
+    free_program(functions, program->function_count);
+    free(args);
+    free(scalar_results);
+    free(lane_results);
+    return 0;
+}
+
+static int usage(const char *argv0)
+{
+    fprintf(stderr, "Usage: %s <n> | <program> [args...] | -n <count> [<program> <lo> <hi>]\n", argv0);
+    return 1;
+}
+
+int main(int argc, const char *argv[])
+{
+    if (argc >= 3 && strcmp(argv[1], "-n") == 0) {
+        size_t count = strtoull(argv[2], NULL, 10);
+        const struct benchmark *benchmark = find_benchmark(argc > 3 ? argv[3] : "fib");
+        if (count == 0 || benchmark == NULL || (argc != 3 && argc != 6)) return usage(argv[0]);
+        word_t lo = argc == 6 ? strtoull(argv[4], NULL, 10) : 20;
+        word_t hi = argc == 6 ? strtoull(argv[5], NULL, 10) : 25;
+        if (hi < lo) return usage(argv[0]);
+        return measure_throughput(benchmark->program, count, lo, hi);
+    }
+
+    const struct program *program;
+    word_t args[MAX_BENCHMARK_ARGS];
+    if (!parse_program_args(argc, argv, &program, args)) return usage(argv[0]);
+    printf("xlanes\n");
+
+    clock_t start = clock();
+    word_t result = run_program(program, args);
+    clock_t end = clock();
+    long ms = (end - start) / (CLOCKS_PER_SEC / 1000);
+
+    printf("Done in %ld ms\n", ms);
+    printf("=> %lld\n", (long long) result);
+}
+#endif
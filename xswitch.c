@@ -0,0 +1,18 @@
+/*
+    Derived from wordcode3.c:
+
+        The instructions of instructions.h, dispatched by a switch on instruction
+        numbers in a loop, as in wordcode3.c, but running the loader's code with
+        superinstructions (see dispatch.h).
+
+    Observations (GCC 12, Clang was not available):
+
+        - 1.5x faster than wordcode3 on fib, with fewer dispatches (combo instructions)
+          and primitives passing the stack pointer; 1.4-1.8x slower than xthreaded.
+
+ */
+
+#define DISPATCH DISPATCH_SWITCH
+#define ENGINE_NAME "xswitch"
+
+#include "dispatch.h"
@@ -0,0 +1,23 @@
+/*
+    Derived from xswitch.c:
+
+        Quickening: the first time a PRIM site runs, it rewrites itself into an
+        instruction dedicated to its primitive, inlining lessThan, subtract and add,
+        and calling through the primitive table without further checks for the others
+        (QUICKEN, see instructions.h). Later runs of the site dispatch straight to that
+        instruction, so only PRIM itself has to look the primitive up, once per site.
+
+        The loader is unchanged: the rewriting happens as the code runs.
+
+    Observations (GCC 12, Clang was not available):
+
+        - 10-15% faster than xswitch on loop, nested and sieve, 0-10% on fib and ack,
+          the same on tak: the switch dispatch itself stays the largest cost.
+
+ */
+
+#define DISPATCH DISPATCH_SWITCH
+#define ENGINE_NAME "xswitchquick"
+#define QUICKEN
+
+#include "dispatch.h"
@@ -0,0 +1,18 @@
+/*
+    Derived from wordcode4.c:
+
+        The instructions of instructions.h as functions, called through a table
+        indexed by instruction numbers in a loop, as in wordcode4.c, but running the
+        loader's code with superinstructions (see dispatch.h).
+
+    Observations (GCC 12, Clang was not available):
+
+        - 1.7-2.5x slower than xswitch: the registers live in memory and every
+          instruction is a call. 1.15x faster than wordcode4 on fib.
+
+ */
+
+#define DISPATCH DISPATCH_TABLE
+#define ENGINE_NAME "xtable"
+
+#include "dispatch.h"
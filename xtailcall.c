@@ -0,0 +1,19 @@
+/*
+    Derived from tailcall.c:
+
+        tailcall.c generated from the instruction definitions of instructions.h
+        (see dispatch.h): one function per instruction, tail-calling the next.
+
+    Observations (GCC 12, Clang was not available):
+
+        - Same as tailcall, its handlers compiling to the same code.
+        - That took defining the instructions in the order of tailcall.c: with the combo
+          instructions last, the same handler code ran 10-25% slower on loop, nested
+          and ack, from code layout alone.
+
+ */
+
+#define DISPATCH DISPATCH_TAILCALL
+#define ENGINE_NAME "xtailcall"
+
+#include "dispatch.h"
@@ -0,0 +1,24 @@
+/*
+    Derived from xtailcall.c:
+
+        Quickening: the first time a PRIM site runs, it rewrites itself into an
+        instruction dedicated to its primitive, inlining lessThan, subtract and add,
+        and calling through the primitive table without further checks for the others
+        (QUICKEN, see instructions.h). Later runs of the site dispatch straight to that
+        instruction, so only PRIM itself has to look the primitive up, once per site.
+
+        The loader is unchanged: the rewriting happens as the code runs.
+
+    Observations (GCC 12, Clang was not available):
+
+        - 1.25-1.3x faster than xtailcall on loop, nested and sieve, 5-15% on fib, tak
+          and ack. The inline primitives no longer call out of the handler, so sp stays
+          in its register.
+
+ */
+
+#define DISPATCH DISPATCH_TAILCALL
+#define ENGINE_NAME "xtailcallquick"
+#define QUICKEN
+
+#include "dispatch.h"
@@ -0,0 +1,31 @@
+/*
+    Derived from xthreaded.c:
+
+        Dispatch replication and a hot/cold layout (see dispatch.h). With one
+        GOTO_NEXT per label, the indirect branch of an instruction is predicted from
+        the history of all its sites. Here, the hot instructions have 4 copies, and
+        the loader gives the sites of an instruction followed by the same instruction
+        the same copy. LIT and CONST_0, which the superinstructions leave almost no
+        sites of, move out of line, and the other labels are aligned.
+
+    Observations (GCC 12, Clang was not available):
+
+        - The copies need -fno-crossjumping, set for execute() only: without it, GCC
+          merges them back into 5 shared dispatch branches, plus the original 16.
+          With it, execute() has 43 indirect jumps, and the loader spreads the sites
+          over 1 to 4 copies (fib uses 3 copies of LOAD, sieve all 4).
+        - 5-13% slower than xthreaded, with the same dispatches. Separately, the
+          replication is within the noise (-10% on tak to +3% on loop) and the
+          layout costs 3-5%: the alignment spreads the handlers over more cache
+          lines, and LIT and CONST_0 were already at the end of execute(). The
+          sandbox has no performance counters, so the branch misses that
+          build/bench reports could not be compared here. A predictor indexed by
+          the global history, as on recent x86, may tell the sites apart already.
+ */
+
+#define DISPATCH DISPATCH_THREADED
+#define REPLICAS 4
+#define HOT_COLD_LAYOUT
+#define ENGINE_NAME "xthreadedreplicated"
+
+#include "dispatch.h"